@@ -0,0 +1,17 @@
+#pragma once
+
+#include "cpu.h"
+
+/*! Runs every job of manifest, jobs are shared between threads.
+ * Every line of manifest is BIN_FILE IN_FILE OUT_FILE, IN_FILE "-"
+ * is empty input. Optional fourth --check-memory or --no-check-memory
+ * overrides check_memory of config for the job. OUT and remaining
+ * stack of job are written to OUT_FILE. Every .bin is mapped, decoded
+ * and verified once and shared read only by its jobs, each job has
+ * its own CPU, stacks, memory and IO
+ * @param [in] manifest Name of manifest, "-" for stdin
+ * @param [in] config Configuration of every cpu, descriptors are ignored
+ * @param [in] nthreads Number of worker threads
+ * @return Number of failed jobs or -1 if manifest can't be read
+ */
+int BatchRun(const char* manifest, const CPUConfig* config, size_t nthreads);
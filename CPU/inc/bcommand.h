@@ -2,12 +2,26 @@
 
 #include <inttypes.h>
 
-#pragma pack(push, 1)
+// Aligned command of current binary format
 struct BinCommand {
 	uint8_t type;
 	uint8_t arg1;
+	// Always zero, keeps arg2 aligned
+	uint16_t reserved;
 	int32_t arg2;
 };
-#pragma pack(pop)
 
 typedef struct BinCommand BinCommand;
+
+static_assert(sizeof(BinCommand) == 8, "BinCommand should be 8 bytes");
+
+// Packed command of legacy binary format version 1
+#pragma pack(push, 1)
+struct BinCommandV1 {
+	uint8_t type;
+	uint8_t arg1;
+	int32_t arg2;
+};
+#pragma pack(pop)
+
+typedef struct BinCommandV1 BinCommandV1;
@@ -4,21 +4,117 @@
 #include <inttypes.h>
 
 #include "bcommand.h"
+#include "tokenizer.h"
+
+#define BINARY_MAGIC (0x4E424D56) // "VMBN"
+
+// Version 1 has packed 6 byte commands, 
+// version 2 has aligned 8 byte commands
+#define BINARY_VERSION_V1 (1)
+#define BINARY_VERSION (2)
+
+// File was converted in memory and should be freed, not unmapped
+#define BINARY_IN_MEMORY (1 << 0)
+
+// Optional sections follow commands up to the end of file,
+// each one is a BinarySection header and size bytes of data
+#define SECTION_LABELS (1) // Label names for debugging and profiling
+#define SECTION_MEMORY (2) // Sizes of memory regions set by REGION
+
+// Memory ids fit one byte of command
+#define BINARY_MAX_REGIONS (256)
+
+struct BinarySection {
+	uint32_t tag;
+	uint32_t size;
+};
+
+typedef struct BinarySection BinarySection;
+
+// Record of memory section, records are sorted by mem_id
+struct BinaryRegion {
+	uint32_t mem_id;
+	uint32_t size;
+};
+
+typedef struct BinaryRegion BinaryRegion;
 
-#pragma pack(push, 1)
 struct BinaryFile {
-	size_t ncommands;
+	uint32_t magic;
+	uint16_t version;
+	// Offset of commands from the beginning of file
+	uint16_t header_size;
+	// Checksum of everything after header
+	uint32_t checksum;
+	uint32_t flags;
+	// Size of the whole file in bytes
+	uint64_t size;
+	
+	uint64_t ncommands;
 	
 	BinCommand commands[1];
 };
-#pragma pack(pop)
 
 typedef struct BinaryFile BinaryFile;
 
+// Reads file into memory, result should be freed
 BinaryFile* BinaryFileFromBinFile(const char* fname);
-BinaryFile* BinaryFileFromVMFile(const char* fname);
+BinaryFile* BinaryFileFromVMFile(const char* fname, int optimize);
+
+// Same as BinaryFileFromVMFile, but lines are split into njobs chunks
+// assembled by concurrent threads and merged, result is the same
+BinaryFile* BinaryFileFromVMFileParallel(const char* fname, int optimize, int njobs);
+
+/*! Copies binary file from memory, result should be freed
+ * @param [in] data Contents of .bin file
+ * @param [in] size Size of data in bytes
+ * @return File in current version or NULL if data is not valid
+ */
+BinaryFile* BinaryFileFromBuffer(const void* data, size_t size);
+
+// Assembles .vm text from memory, result should be freed
+BinaryFile* BinaryFileFromVMBuffer(const char* data, size_t size, int optimize);
+
+// Maps file read only without copying, result should be unmapped.
+// Files of older versions are converted in memory
+BinaryFile* BinaryFileMap(const char* fname);
+void BinaryFileUnmap(BinaryFile* file);
+
+/*! Converts file to another format version
+ * @param [in] file Pointer to file
+ * @param [in] version Format version of result
+ * @return Converted file in memory, should be freed
+ */
+BinaryFile* BinaryFileConvert(const BinaryFile* file, int version);
+
+/*! Validates header, size and checksum of binary file
+ * @param [in] file Pointer to loaded file
+ * @param [in] size Number of loaded bytes
+ * @return 0 if file is valid
+ */
+int BinaryFileCheck(const BinaryFile* file, size_t size);
+
+uint32_t BinaryFileChecksum(const BinaryFile* file);
+
+/*! Finds optional section of file
+ * @param [in] file Pointer to checked file
+ * @param [in] tag Tag of section
+ * @param [out] size Size of section data in bytes
+ * @return Pointer to unaligned section data or NULL if there is no section
+ */
+const void* BinaryFileSection(const BinaryFile* file, uint32_t tag, size_t* size);
+
+/*! Reads memory section of file
+ * @param [in] file Pointer to checked file
+ * @param [in, out] sizes Number of elements of every region,
+ * sizes of regions set by file are replaced
+ * @param [in] nsizes Number of regions
+ * @return 0 on success or if there is no section, 1 if section is bad
+ */
+int BinaryFileRegions(const BinaryFile* file, size_t* sizes, size_t nsizes);
 
 int BinaryFileToFile(BinaryFile* file, const char* fname);
+int BinaryFileToFileVersion(const BinaryFile* file, const char* fname, int version);
 
 
 typedef struct LabelEntry LabelEntry;
@@ -29,19 +125,57 @@ struct LabelEntry
 	int ncommand;
 }; 
 
+// Slot of label hash table, index is -1 in empty slots
+struct LabelSlot
+{
+	uint32_t hash;
+	int index;
+};
+
+typedef struct LabelSlot LabelSlot;
+
+// Chunk of arena with interned label names
+struct LabelArena;
+
 struct CommandsContainer {
 	size_t lsize;
 	size_t lcapacity;
 	LabelEntry* labels;
 	
+	// Open addressing table of label indices,
+	// number of slots is a power of two
+	size_t lslots;
+	LabelSlot* lindex;
+	
+	struct LabelArena* arena;
+	
+	// Sizes of memory regions set by REGION, 0 if not set
+	uint32_t rsizes[BINARY_MAX_REGIONS];
+	
 	size_t ccapacity;
 	BinaryFile* file;
 };
 
 typedef struct CommandsContainer CommandsContainer;
 
+/*! Reads labels section of file
+ * @param [in] file Pointer to checked file
+ * @param [out] nlabels Number of labels
+ * @return Labels with names pointing into file, should be freed,
+ * NULL if file has no labels
+ */
+LabelEntry* BinaryFileLabels(const BinaryFile* file, size_t* nlabels);
+
 int CContainerPushLabels(CommandsContainer* container);
 int CContainerAdd(CommandsContainer* container, BinCommand cmd);
 
-int CContainerLabelSet(CommandsContainer* container, const char* name, int ncommand);
-int CContainerLabelGet(CommandsContainer* container, const char* name);
+int CContainerLabelSet(CommandsContainer* container, Token name, int ncommand);
+int CContainerLabelGet(CommandsContainer* container, Token name);
+
+/*! Sets size of memory region, REGION NAME SIZE directive
+ * @param [in] container Container
+ * @param [in] name Name of region
+ * @param [in] size Number of elements
+ * @return 0 on success, 1 if region is unknown, size is bad or set twice
+ */
+int CContainerRegion(CommandsContainer* container, Token name, Token size);
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "binaryfile.h"
+
+// Where execution goes after the last command of block
+enum BlockFlow {
+	BLOCK_NEXT,		// Falls to the next block
+	BLOCK_JUMP,		// JUMP UN to target
+	BLOCK_BRANCH,	// Conditional JUMP to target or next
+	BLOCK_CALL,		// CALL of target, RETURN goes to next
+	BLOCK_TAILCALL,	// TAILCALL of target, it returns to caller
+	BLOCK_RETURN,	// RETURN to caller
+	BLOCK_HALT		// Halt sentinel after the last command
+};
+
+// Command needs need elements on operand stack and changes its depth by net
+struct CommandEffect {
+	int64_t need;
+	int64_t net;
+	int flow;
+};
+
+typedef struct CommandEffect CommandEffect;
+
+// Commands from start to end, not including end. Jumps, calls and
+// returns end blocks, their targets start them
+struct CodeBlock {
+	size_t start;
+	size_t end;
+
+	// Elements needed on entry, change of depth and the highest
+	// depth above entry, call is not included
+	int64_t need;
+	int64_t net;
+	int64_t peak;
+
+	int flow;
+
+	// Block after the last command and target of jump or call,
+	// NULL if there is no such block
+	struct CodeBlock* next;
+	struct CodeBlock* target;
+};
+
+typedef struct CodeBlock CodeBlock;
+
+struct CodeBlocks {
+	// Blocks in order of code and halt sentinel block after them
+	CodeBlock* blocks;
+	size_t nblocks;
+
+	// Block starting on every command and halt, NULL inside blocks
+	CodeBlock** block_of;
+
+	CommandEffect* effects;
+};
+
+typedef struct CodeBlocks CodeBlocks;
+
+/*! Stack effect of command
+ * @param [in] cmd Command
+ * @param [out] effect Effect
+ * @return 0 if command has known effect
+ */
+int get_command_effect(BinCommand cmd, CommandEffect* effect);
+
+/*! Splits code into basic blocks
+ * @param [in] file Code
+ * @return Blocks or NULL if code has commands of unknown effect
+ * or addresses outside of code
+ */
+CodeBlocks* BlocksBuild(const BinaryFile* file);
+
+void BlocksDeInit(CodeBlocks* blocks);
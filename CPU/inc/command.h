@@ -4,19 +4,61 @@
 #include <inttypes.h>
 
 int get_command_id(const char *name);
+int get_command_id(const char *name, size_t len);
 int get_command_id(const uint8_t hex);
 
+int get_jmp_id(const char *name);
+int get_jmp_id(const char *name, size_t len);
+int get_jmp_id(const uint8_t hex);
+const char* get_jmp_name(int id);
+
+// Number of commands
+int get_not_command_id();
+
 const char* get_command_name(int id);
 uint8_t get_command_binary(int id);
 
+// Typed arithmetic takes optional type: NAME [I32 | I64 | F64]
+#define ARGC_TYPED (4)
+
+// Number of tokens of command in assembly, including its name,
+// or ARGC_TYPED
+size_t get_command_argc(int id);
+
+// Types of arithmetic operands, carried in arg1. Every stack
+// element is 8 bytes, I32 values are kept sign extended and
+// F64 values are kept as their bits
+#define TYPE_I32 (0)
+#define TYPE_I64 (1)
+#define TYPE_F64 (2)
+
+int get_type_id(const char* name, size_t len);
+const char* get_type_name(int type);
+
+// Number of types
+int get_not_type_id();
+
 #include "binaryfile.h"
+#include "blocks.h"
 #include "cpu.h"
 
 #define PROCESSOR_FUNC_ARGS \
-(const char* args[], size_t argc, CommandsContainer* container)
+(const Token args[], size_t argc, CommandsContainer* container)
 
 #define EXECUTOR_FUNC_ARGS \
 (CPU* cpu, BinCommand cmd)
 
 int (*get_processor(int id)) PROCESSOR_FUNC_ARGS;
 int (*get_executor(int id)) EXECUTOR_FUNC_ARGS;
+
+/*! Decodes code for execute_commands
+ * @param [in] blocks Blocks of code checked by VerifyCode, it is 
+ * executed without checks the verifier has done, NULL for checked code
+ * @return Commands and halt sentinel, NULL on bad code
+ */
+DecodedCommand* decode_commands(const BinaryFile* file, const CodeBlocks* blocks);
+
+// Switches decoded code between checked and verified executors
+void set_dispatch(DecodedCommand* code, size_t ncommands, const CodeBlocks* blocks);
+
+int execute_commands(CPU* cpu);
@@ -1,24 +1,160 @@
 #pragma once
 
 #include "binaryfile.h"
-#include "stack.h"
+#include "blocks.h"
+#include "vmstack.h"
 #include "memory.h"
+#include "vmio.h"
+
+struct DecodedCommand {
+	// Handler label address for threaded dispatch
+	const void* target;
+	int id;
+	
+	// Elements pushed by block above its entry depth,
+	// set on the first command of block of verified code
+	uint32_t reserve;
+	
+	BinCommand cmd;
+};
+
+typedef struct DecodedCommand DecodedCommand;
+
+// Execution stopped after budget of commands, cpu can be resumed
+#define CPU_BUDGET (-1)
+
+// SNAPSHOT command was executed, cpu can be resumed
+#define CPU_SNAPSHOT (-2)
+
+// Operand or return stack would be deeper than max_depth
+#define CPU_STACK_OVERFLOW (-3)
+
+// Code decoded and verified once, may be shared read only by cpus
+// running it on different threads
+struct CPUCode {
+	// Not owned, may be shared read only mapping
+	const BinaryFile* file;
+	DecodedCommand* decoded;
+	
+	// Native code, NULL if code is interpreted
+	struct JitCode* jit;
+	
+	// Code was checked by VerifyCode and runs without checks
+	int verified;
+	
+	// Basic blocks of verified code, NULL if code is not verified
+	CodeBlocks* blocks;
+	
+	// Memory of cpus is checked, jit leaves checks to executors
+	int check_memory;
+	
+	// Number of elements of every memory region
+	size_t sizes[MEMORY_REGIONS];
+};
+
+typedef struct CPUCode CPUCode;
 
 struct CPU {
 	Memory* memory;
 	
-	PStack_t* rstack;
+	VMStack rstack;
 	
-	PStack_t* stack;
+	VMStack stack;
 	
 	size_t fetcher;
-	BinaryFile* code;
+	
+	// Commands left to execute before CPU_BUDGET, UINT64_MAX
+	// for no limit, ignored by jit
+	uint64_t budget;
+	
+	// Buffered IN and OUT
+	VMIO io;
+	
+	// Copied from shared code
+	const BinaryFile* code;
+	DecodedCommand* decoded;
+	
+	// Native code, NULL if cpu is interpreted
+	struct JitCode* jit;
+	
+	// Execution profile, NULL if cpu is not profiled
+	struct Profile* profile;
+	
+	// Execution trace, NULL if cpu is not traced
+	struct Trace* trace;
+	
+	// Code was checked by VerifyCode and runs without checks
+	int verified;
+	
+	// Code of this cpu only, NULL if code is shared
+	CPUCode* own_code;
 };
 
 typedef struct CPU CPU;
 
-CPU* CPUInit(BinaryFile* code);
+struct CPUConfig {
+	// Run stacks through guarded PStack_t and check memory bounds
+	int checked;
+	
+	// Maximum depth of operand and return stacks
+	size_t max_depth;
+	
+	// Translate code to native, ignored in checked mode
+	int jit;
+	
+	// Count and time every command, disables jit
+	int profile;
+	
+	// Write execution trace to this file, NULL to not trace,
+	// disables jit, ignored if cpu is profiled
+	const char* trace;
+	
+	// Verify code on load to run it without checks, 
+	// ignored in checked mode
+	int verify;
+	
+	// Check bounds of accesses by indices from stack and registers
+	// in verified code, code that is not verified is always checked
+	int check_memory;
+	
+	// VMIO_TEXT or VMIO_BINARY formats of IN and OUT
+	int in_format;
+	int out_format;
+	
+	// Descriptors of IN and OUT, stdin and stdout by default
+	int in_fd;
+	int out_fd;
+};
+
+typedef struct CPUConfig CPUConfig;
+
+void CPUConfigInit(CPUConfig* config);
+
+/*! Decodes and verifies code for cpus with the same config
+ * @param [in] file Code, must outlive decoded code
+ * @param [in] config Configuration, stacks, profile, trace and IO
+ * are taken by every cpu from its own config
+ * @return Code or NULL if code can't be loaded
+ */
+CPUCode* CPUCodeInit(const BinaryFile* file, const CPUConfig* config);
+
+void CPUCodeDeInit(CPUCode* code);
+
+/*! Creates cpu with its own stacks, memory and IO on shared code
+ * @param [in] code Code, must outlive cpu
+ * @param [in] config Configuration, code part of it is ignored
+ * @return CPU or NULL on error
+ */
+CPU* CPUInitShared(const CPUCode* code, const CPUConfig* config);
+
+// Creates cpu with code of its own
+CPU* CPUInit(const BinaryFile* code, const CPUConfig* config);
 
+/*! Executes code from current fetcher
+ * @param [in] cpu CPU
+ * @return 0 on halt, CPU_BUDGET or CPU_SNAPSHOT if cpu can be resumed,
+ * CPU_STACK_OVERFLOW or other value on error
+ */
 int CPUExecute(CPU* cpu);
 
 void CPUDeInit(CPU* cpu);
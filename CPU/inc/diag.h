@@ -0,0 +1,20 @@
+#pragma once
+
+// Diagnostics of assembler, loader and cpu go through diag_printf,
+// they are printed to stdout unless a handler is set
+
+/*! Receives diagnostics instead of stdout
+ * @param [in] ctx Context given to set_diag_handler
+ * @param [in] message Formatted message as it would be printed
+ */
+typedef void (*DiagFunc)(void* ctx, const char* message);
+
+/*! Sets handler for the whole process, it must be set before
+ * threads that print diagnostics are started
+ * @param [in] func Handler, NULL to print to stdout
+ * @param [in] ctx Passed to handler
+ */
+void set_diag_handler(DiagFunc func, void* ctx);
+
+// printf of diagnostics
+int diag_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
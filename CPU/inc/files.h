@@ -16,3 +16,8 @@ void write_file(FileData data, const char* filename);
 char* read_file_str(const char *filename);
 
 FileData read_file_bin(const char *filename);
+
+// Maps file read only if possible, reads it otherwise
+FileData map_file(const char *filename);
+
+void unmap_file(FileData data);
@@ -15,10 +15,59 @@
 #define FOR_EACH_13(what, x, ...) what x FOR_EACH_12(what, __VA_ARGS__)
 #define FOR_EACH_14(what, x, ...) what x FOR_EACH_13(what, __VA_ARGS__)
 #define FOR_EACH_15(what, x, ...) what x FOR_EACH_14(what, __VA_ARGS__)
+#define FOR_EACH_16(what, x, ...) what x FOR_EACH_15(what, __VA_ARGS__)
+#define FOR_EACH_17(what, x, ...) what x FOR_EACH_16(what, __VA_ARGS__)
+#define FOR_EACH_18(what, x, ...) what x FOR_EACH_17(what, __VA_ARGS__)
+#define FOR_EACH_19(what, x, ...) what x FOR_EACH_18(what, __VA_ARGS__)
+#define FOR_EACH_20(what, x, ...) what x FOR_EACH_19(what, __VA_ARGS__)
+#define FOR_EACH_21(what, x, ...) what x FOR_EACH_20(what, __VA_ARGS__)
+#define FOR_EACH_22(what, x, ...) what x FOR_EACH_21(what, __VA_ARGS__)
+#define FOR_EACH_23(what, x, ...) what x FOR_EACH_22(what, __VA_ARGS__)
+#define FOR_EACH_24(what, x, ...) what x FOR_EACH_23(what, __VA_ARGS__)
+#define FOR_EACH_25(what, x, ...) what x FOR_EACH_24(what, __VA_ARGS__)
+#define FOR_EACH_26(what, x, ...) what x FOR_EACH_25(what, __VA_ARGS__)
+#define FOR_EACH_27(what, x, ...) what x FOR_EACH_26(what, __VA_ARGS__)
+#define FOR_EACH_28(what, x, ...) what x FOR_EACH_27(what, __VA_ARGS__)
+#define FOR_EACH_29(what, x, ...) what x FOR_EACH_28(what, __VA_ARGS__)
+#define FOR_EACH_30(what, x, ...) what x FOR_EACH_29(what, __VA_ARGS__)
+#define FOR_EACH_31(what, x, ...) what x FOR_EACH_30(what, __VA_ARGS__)
+#define FOR_EACH_32(what, x, ...) what x FOR_EACH_31(what, __VA_ARGS__)
+#define FOR_EACH_33(what, x, ...) what x FOR_EACH_32(what, __VA_ARGS__)
+#define FOR_EACH_34(what, x, ...) what x FOR_EACH_33(what, __VA_ARGS__)
+#define FOR_EACH_35(what, x, ...) what x FOR_EACH_34(what, __VA_ARGS__)
+#define FOR_EACH_36(what, x, ...) what x FOR_EACH_35(what, __VA_ARGS__)
+#define FOR_EACH_37(what, x, ...) what x FOR_EACH_36(what, __VA_ARGS__)
+#define FOR_EACH_38(what, x, ...) what x FOR_EACH_37(what, __VA_ARGS__)
+#define FOR_EACH_39(what, x, ...) what x FOR_EACH_38(what, __VA_ARGS__)
+#define FOR_EACH_40(what, x, ...) what x FOR_EACH_39(what, __VA_ARGS__)
+#define FOR_EACH_41(what, x, ...) what x FOR_EACH_40(what, __VA_ARGS__)
+#define FOR_EACH_42(what, x, ...) what x FOR_EACH_41(what, __VA_ARGS__)
+#define FOR_EACH_43(what, x, ...) what x FOR_EACH_42(what, __VA_ARGS__)
+#define FOR_EACH_44(what, x, ...) what x FOR_EACH_43(what, __VA_ARGS__)
+#define FOR_EACH_45(what, x, ...) what x FOR_EACH_44(what, __VA_ARGS__)
+#define FOR_EACH_46(what, x, ...) what x FOR_EACH_45(what, __VA_ARGS__)
+#define FOR_EACH_47(what, x, ...) what x FOR_EACH_46(what, __VA_ARGS__)
+#define FOR_EACH_48(what, x, ...) what x FOR_EACH_47(what, __VA_ARGS__)
+#define FOR_EACH_49(what, x, ...) what x FOR_EACH_48(what, __VA_ARGS__)
+#define FOR_EACH_50(what, x, ...) what x FOR_EACH_49(what, __VA_ARGS__)
+#define FOR_EACH_51(what, x, ...) what x FOR_EACH_50(what, __VA_ARGS__)
+#define FOR_EACH_52(what, x, ...) what x FOR_EACH_51(what, __VA_ARGS__)
+#define FOR_EACH_53(what, x, ...) what x FOR_EACH_52(what, __VA_ARGS__)
+#define FOR_EACH_54(what, x, ...) what x FOR_EACH_53(what, __VA_ARGS__)
+#define FOR_EACH_55(what, x, ...) what x FOR_EACH_54(what, __VA_ARGS__)
+#define FOR_EACH_56(what, x, ...) what x FOR_EACH_55(what, __VA_ARGS__)
+#define FOR_EACH_57(what, x, ...) what x FOR_EACH_56(what, __VA_ARGS__)
+#define FOR_EACH_58(what, x, ...) what x FOR_EACH_57(what, __VA_ARGS__)
+#define FOR_EACH_59(what, x, ...) what x FOR_EACH_58(what, __VA_ARGS__)
+#define FOR_EACH_60(what, x, ...) what x FOR_EACH_59(what, __VA_ARGS__)
+#define FOR_EACH_61(what, x, ...) what x FOR_EACH_60(what, __VA_ARGS__)
+#define FOR_EACH_62(what, x, ...) what x FOR_EACH_61(what, __VA_ARGS__)
+#define FOR_EACH_63(what, x, ...) what x FOR_EACH_62(what, __VA_ARGS__)
+#define FOR_EACH_64(what, x, ...) what x FOR_EACH_63(what, __VA_ARGS__)
 
-#define NTH_ARG(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _N, ...) _N
+#define NTH_ARG(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, _17, _18, _19, _20, _21, _22, _23, _24, _25, _26, _27, _28, _29, _30, _31, _32, _33, _34, _35, _36, _37, _38, _39, _40, _41, _42, _43, _44, _45, _46, _47, _48, _49, _50, _51, _52, _53, _54, _55, _56, _57, _58, _59, _60, _61, _62, _63, _64, _N, ...) _N
 
-#define FOR_EACH(what, ...) NTH_ARG(__VA_ARGS__, FOR_EACH_15, FOR_EACH_14, FOR_EACH_13, FOR_EACH_12, FOR_EACH_11, FOR_EACH_10, FOR_EACH_9, FOR_EACH_8, FOR_EACH_7, FOR_EACH_6, FOR_EACH_5, FOR_EACH_4, FOR_EACH_3,FOR_EACH_2, FOR_EACH_1)(what, __VA_ARGS__)
+#define FOR_EACH(what, ...) NTH_ARG(__VA_ARGS__, FOR_EACH_64, FOR_EACH_63, FOR_EACH_62, FOR_EACH_61, FOR_EACH_60, FOR_EACH_59, FOR_EACH_58, FOR_EACH_57, FOR_EACH_56, FOR_EACH_55, FOR_EACH_54, FOR_EACH_53, FOR_EACH_52, FOR_EACH_51, FOR_EACH_50, FOR_EACH_49, FOR_EACH_48, FOR_EACH_47, FOR_EACH_46, FOR_EACH_45, FOR_EACH_44, FOR_EACH_43, FOR_EACH_42, FOR_EACH_41, FOR_EACH_40, FOR_EACH_39, FOR_EACH_38, FOR_EACH_37, FOR_EACH_36, FOR_EACH_35, FOR_EACH_34, FOR_EACH_33, FOR_EACH_32, FOR_EACH_31, FOR_EACH_30, FOR_EACH_29, FOR_EACH_28, FOR_EACH_27, FOR_EACH_26, FOR_EACH_25, FOR_EACH_24, FOR_EACH_23, FOR_EACH_22, FOR_EACH_21, FOR_EACH_20, FOR_EACH_19, FOR_EACH_18, FOR_EACH_17, FOR_EACH_16, FOR_EACH_15, FOR_EACH_14, FOR_EACH_13, FOR_EACH_12, FOR_EACH_11, FOR_EACH_10, FOR_EACH_9, FOR_EACH_8, FOR_EACH_7, FOR_EACH_6, FOR_EACH_5, FOR_EACH_4, FOR_EACH_3, FOR_EACH_2, FOR_EACH_1)(what, __VA_ARGS__)
 
 #define GET_1(x, ...) x
 #define GET_2(x, ...) GET_1(__VA_ARGS__)
@@ -36,4 +85,4 @@
 #define STRING(x) #x
 #define EVAL_STRING(x) STRING(x)
 
-#define COUNT_ARGS(...) NTH_ARG(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define COUNT_ARGS(...) NTH_ARG(__VA_ARGS__, 64, 63, 62, 61, 60, 59, 58, 57, 56, 55, 54, 53, 52, 51, 50, 49, 48, 47, 46, 45, 44, 43, 42, 41, 40, 39, 38, 37, 36, 35, 34, 33, 32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
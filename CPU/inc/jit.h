@@ -0,0 +1,28 @@
+#pragma once
+
+#include "cpu.h"
+
+struct JitCode;
+
+typedef struct JitCode JitCode;
+
+/*! Translates decoded commands into x86-64 machine code.
+ * Arithmetic, memory regions and control flow are translated,
+ * other commands call interpreter executors
+ * @param [in] code Decoded commands with halt sentinel
+ * @param [in] ncommands Number of commands without sentinel
+ * @param [in] check_memory Accesses by indices from stack and registers
+ * call executors, which check them against checked memory
+ * @return Compiled code or NULL if jit is not supported
+ */
+JitCode* JitCompile(const DecodedCommand* code, size_t ncommands, 
+					int check_memory);
+
+/*! Runs compiled code from cpu->fetcher
+ * @param [in] jit Compiled code of cpu
+ * @param [in] cpu CPU with unchecked stacks
+ * @return Same as CPUExecute
+ */
+int JitExecute(JitCode* jit, CPU* cpu);
+
+void JitDeInit(JitCode* jit);
@@ -2,18 +2,110 @@
 
 #include "stack.h"
 
-struct Memory;
+// Number of memory regions, ids of CONSTANT, IN, OUT, 
+// IN_F64 and OUT_F64 follow them
+#define MEMORY_REGIONS (4)
+
+// Regions of at least this size in bytes are mapped lazily, 
+// pages are allocated and zeroed on first access
+#define MEMORY_LAZY_SIZE (1 << 16)
+
+// Largest region in elements, offsets in code are int
+#define MEMORY_MAX_REGION (1u << 30)
+
+// Elements in page of snapshot, only pages that are not zero are written
+#define MEMORY_PAGE (512)
+
+struct Memory {
+	// Base of every region indexed by mem id
+	stack_el_t* bases[MEMORY_REGIONS];
+	
+	// Number of elements of every region
+	size_t sizes[MEMORY_REGIONS];
+	
+	// Check bounds of every access
+	int checked;
+};
 
 typedef struct Memory Memory;
 
-Memory* MemoryInit();
+/*! Memory initialization, all regions are zeroed
+ * @param [in] sizes Number of elements of every region, NULL for defaults
+ * @param [in] checked Check bounds of every access
+ * @return Memory or NULL if regions can't be allocated
+ */
+Memory* MemoryInit(const size_t* sizes, int checked);
 				
 int get_mem_id(const char* name);
+int get_mem_id(const char* name, size_t len);
 
 int get_not_mem_id();
 
-int MemorySet(Memory* mem, int mem_id, int offset, stack_el_t val);
+const char* get_mem_name(int mem_id);
+
+// Number of elements of region when .bin doesn't set it
+size_t get_mem_default_size(int mem_id);
+
+// Reports access out of region bounds, returns 1
+int MemoryFault(const Memory* mem, int mem_id, int64_t offset);
+
+inline int MemorySet(Memory* mem, int mem_id, int64_t offset, stack_el_t val)
+{
+	if (unsigned(mem_id) >= MEMORY_REGIONS)
+		return 1;
+	
+	if (mem->checked && (offset < 0 || uint64_t(offset) >= mem->sizes[mem_id]))
+		return MemoryFault(mem, mem_id, offset);
+	
+	mem->bases[mem_id][offset] = val;
+	
+	return 0;
+}
+
+inline int MemoryGet(Memory* mem, int mem_id, int64_t offset, stack_el_t* val)
+{
+	if (unsigned(mem_id) >= MEMORY_REGIONS)
+		return 1;
+	
+	if (mem->checked && (offset < 0 || uint64_t(offset) >= mem->sizes[mem_id]))
+		return MemoryFault(mem, mem_id, offset);
+	
+	*val = mem->bases[mem_id][offset];
+	
+	return 0;
+}
+
+// Base of memory region, NULL if mem_id is not a region
+stack_el_t* MemoryRegion(Memory* mem, int mem_id);
+
+// Adds elements to checksum like BinaryFileChecksum does
+inline void hash_elements(uint64_t* hash, const stack_el_t* data, size_t size)
+{
+	for (size_t i = 0; i < size; ++i) {
+		*hash = (*hash ^ uint64_t(data[i])) * 0x9E3779B97F4A7C15ull;
+		*hash ^= *hash >> 29;
+	}
+}
+
+/*! Writes every region as its pages that are not zero, 
+ * every page follows its index
+ * @param [in] mem Memory
+ * @param [in] fp Opened binary file
+ * @param [in, out] hash Written indices and pages are added to it
+ * @return 0 on success
+ */
+int MemoryWrite(const Memory* mem, FILE* fp, uint64_t* hash);
+
+/*! Reads all regions written by MemoryWrite, pages that are not
+ * in file are zeroed and lazy regions leave them unmapped
+ * @param [out] mem Memory of the same sizes
+ * @param [in] fp Opened binary file
+ * @param [in, out] hash Read indices and pages are added to it
+ * @return 0 on success
+ */
+int MemoryRead(Memory* mem, FILE* fp, uint64_t* hash);
 
-int MemoryGet(Memory* mem, int mem_id, int offset, stack_el_t* val);
+// Size of all regions in bytes
+size_t MemorySize(const Memory* mem);
 
 void MemoryDeInit(Memory* mem);
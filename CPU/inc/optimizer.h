@@ -0,0 +1,12 @@
+#pragma once
+
+#include "binaryfile.h"
+
+/*! Peephole pass over assembled commands, fuses frequent
+ * sequences into superinstructions and CALL followed by RETURN
+ * into TAILCALL. Must be called before
+ * CContainerPushLabels, labels are remapped to new positions
+ * @param [in, out] container Container with assembled commands
+ * @return 0 on success
+ */
+int OptimizeCommands(CommandsContainer* container);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "cpu.h"
+
+struct Profile;
+
+typedef struct Profile Profile;
+
+/*! Creates empty profile of code
+ * @param [in] code Binary file, labels section is used for names
+ * @return Profile, should be deinited
+ */
+Profile* ProfileInit(const BinaryFile* code);
+
+/*! Runs cpu like CPUExecute, counting every executed command
+ * per opcode and per address and timing it with cycle counter
+ * @param [in] profile Profile of cpu code
+ * @param [in] cpu CPU to run
+ * @return Same as CPUExecute
+ */
+int ProfileExecute(Profile* profile, CPU* cpu);
+
+/*! Writes PREFIX.txt report with opcode, label region and hot command
+ * tables and PREFIX.folded collapsed call stacks for flamegraph.pl
+ * @param [in] profile Profile after execution
+ * @param [in] prefix Prefix of file names
+ * @return 0 on success
+ */
+int ProfileWrite(const Profile* profile, const char* prefix);
+
+void ProfileDeInit(Profile* profile);
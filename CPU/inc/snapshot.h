@@ -0,0 +1,47 @@
+#pragma once
+
+#include "cpu.h"
+
+#define SNAPSHOT_MAGIC (0x4E534D56) // "VMSN"
+#define SNAPSHOT_VERSION (4)
+
+// Snapshot file is this header, pages of memory regions that are
+// not zero, operand stack and return stack
+struct SnapshotHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+	
+	// Checksum and size of code snapshot was taken on
+	uint32_t code_checksum;
+	
+	// Checksum of memory pages and stacks following header
+	uint32_t checksum;
+	
+	uint64_t code_ncommands;
+	
+	uint64_t fetcher;
+	
+	// Sizes in bytes and elements
+	uint64_t memory_size;
+	uint64_t stack_size;
+	uint64_t rstack_size;
+};
+
+typedef struct SnapshotHeader SnapshotHeader;
+
+/*! Writes state of cpu to file, file is replaced atomically,
+ * so it is never left half written. Pending output is flushed
+ * @param [in] cpu CPU stopped between commands
+ * @param [in] fname Name of file
+ * @return 0 on success
+ */
+int SnapshotWrite(CPU* cpu, const char* fname);
+
+/*! Restores state of cpu, cpu must run the same code
+ * @param [in, out] cpu Initialized CPU, its code must not be shared
+ * unless it is interpreted with checked memory
+ * @param [in] fname Name of file written by SnapshotWrite
+ * @return 0 on success
+ */
+int SnapshotRead(CPU* cpu, const char* fname);
@@ -8,7 +8,7 @@
 #include <string.h>
 
 // typedef типа элемента стэка
-typedef int stack_el_t;
+typedef int64_t stack_el_t;
 
 // "Мёртвый" и "защитный" байты
 #ifndef PS_NDEBUG
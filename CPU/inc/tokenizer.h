@@ -2,6 +2,51 @@
 
 #include <stdlib.h>
 
-int tokenize_lines(	char *data, const char *delim,
-					int (*ptk)(const char**, size_t, size_t, void*),
+// View of token in input buffer, not null terminated
+struct Token {
+	const char* ptr;
+	size_t len;
+};
+
+typedef struct Token Token;
+
+// Size of chunks input is read by
+#define TOKENIZER_CHUNK (1 << 16)
+
+// Tokens after this number on one line are an error
+#define TOKENIZER_MAX_TOKENS (16)
+
+/*! Reads file by chunks and calls ptk for every line with its tokens.
+ * Tokens are separated by spaces, tabs and carriage returns,
+ * ';' starts a comment until the end of line
+ * @param [in] filename Name of file, "-" for stdin
+ * @param [in] ptk Called for every line with tokens, number of tokens,
+ * number of line and arg, tokens are valid only during the call
+ * @param [in] arg Passed to ptk
+ * @return 0 on success, first non zero result of ptk or 1 on read error
+ */
+int tokenize_file(	const char* filename,
+					int (*ptk)(const Token*, size_t, size_t, void*),
 					void* arg );
+
+/*! Same as tokenize_file for lines in memory
+ * @param [in] data Lines, the last one may have no newline
+ * @param [in] size Size of data in bytes
+ * @param [in] first_line Number of the first line
+ * @param [in] ptk Called for every line
+ * @param [in] arg Passed to ptk
+ * @return 0 on success or first non zero result of ptk
+ */
+int tokenize_buffer(const char* data, size_t size, size_t first_line,
+					int (*ptk)(const Token*, size_t, size_t, void*),
+					void* arg );
+
+// Compares token with null terminated string
+int token_equals(Token token, const char* str);
+
+/*! Parses whole token as decimal integer with optional sign
+ * @param [in] token Token
+ * @param [out] val Parsed value
+ * @return 0 on success, 1 if token is not an integer or doesn't fit int
+ */
+int token_to_int(Token token, int* val);
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "cpu.h"
+
+#define TRACE_MAGIC (0x52544D56) // "VMTR"
+#define TRACE_VERSION (1)
+
+// Trace file is this header and records of executed commands.
+// Record starts with byte of command id and flags, then go
+//	varint of zigzag(pc - previous pc - 1) if TRACE_PC is set,
+//	varint of zigzag(tos - previous tos) if TRACE_TOS is set,
+//	varint of zigzag(value) for every value read by PUSH IN or IN_F64.
+// Top of empty stack is 0. Failed command is not recorded, trace
+// ends with TRACE_END byte, varints of pc and zigzag(status) of cpu.
+// Status is 0 on halt and CPU_BUDGET if cpu was stopped before it
+struct TraceHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size;
+
+	// Checksum and size of traced code
+	uint32_t code_checksum;
+	uint32_t reserved;
+	uint64_t code_ncommands;
+};
+
+typedef struct TraceHeader TraceHeader;
+
+#define TRACE_ID_MASK (0x3F)
+#define TRACE_PC (1 << 6)
+#define TRACE_TOS (1 << 7)
+#define TRACE_END (TRACE_ID_MASK)
+
+struct Trace;
+
+typedef struct Trace Trace;
+
+/*! Creates trace file and starts thread writing it
+ * @param [in] code Traced code
+ * @param [in] fname Name of file
+ * @return Trace or NULL if file can't be created
+ */
+Trace* TraceInit(const BinaryFile* code, const char* fname);
+
+/*! Runs cpu like CPUExecute, recording every executed command.
+ * Records go to ring buffer of chunks, writer thread drains it
+ * @param [in] trace Trace of cpu code
+ * @param [in] cpu CPU to run, trace is continued by next calls
+ * @return Same as CPUExecute
+ */
+int TraceExecute(Trace* trace, CPU* cpu);
+
+// Ends trace, writes the rest of records and stops writer thread,
+// error is printed if file was not fully written
+void TraceDeInit(Trace* trace);
+
+//======================================================================
+
+struct TraceRecord {
+	size_t pc;
+	int id;
+	stack_el_t tos;
+
+	// Record is the end of trace, status is result of cpu
+	int end;
+	int status;
+};
+
+typedef struct TraceRecord TraceRecord;
+
+struct TraceReader;
+
+typedef struct TraceReader TraceReader;
+
+/*! Opens trace file for reading
+ * @param [in] fname Name of file
+ * @param [out] header Header of trace
+ * @return Reader or NULL if file is not a trace
+ */
+TraceReader* TraceOpen(const char* fname, TraceHeader* header);
+
+/*! Reads record, values read by PUSH IN follow it
+ * @param [in] reader Reader
+ * @param [out] record Record
+ * @return 0 on success, 1 if trace is damaged or cut
+ */
+int TraceRead(TraceReader* reader, TraceRecord* record);
+
+// Reads value read by PUSH IN, returns 0 on success
+int TraceReadIn(TraceReader* reader, stack_el_t* val);
+
+void TraceClose(TraceReader* reader);
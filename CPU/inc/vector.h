@@ -0,0 +1,36 @@
+#pragma once
+
+#include "stack.h"
+
+// Kernels of vector commands over n elements. Types are the ones
+// of arithmetic, results are the same as of ADD, MUL and so on
+// applied to every element. F64 reductions keep 4 partial sums,
+// element i goes to sum i % 4, result is (s0 + s2) + (s1 + s3),
+// so every instruction set gives the same bits.
+// Instruction set is chosen on the first call by CPUID
+
+/*! dst[i] = a[i] + b[i], computed in increasing order of i
+ * when dst overlaps source from above
+ * @param [in] type TYPE_I32, TYPE_I64 or TYPE_F64
+ */
+void VectorAdd(	int type, stack_el_t* dst,
+				const stack_el_t* a, const stack_el_t* b, size_t n);
+
+// dst[i] = a[i] * b[i], same as VectorAdd
+void VectorMul(	int type, stack_el_t* dst,
+				const stack_el_t* a, const stack_el_t* b, size_t n);
+
+// Sum of a[i] * b[i]
+stack_el_t VectorDot(int type, const stack_el_t* a, const stack_el_t* b, size_t n);
+
+// Sum of a[i]
+stack_el_t VectorSum(int type, const stack_el_t* a, size_t n);
+
+// Fills n elements with val
+void VectorFill(stack_el_t* dst, stack_el_t val, size_t n);
+
+// Copies n elements, ranges can overlap
+void VectorCopy(stack_el_t* dst, const stack_el_t* src, size_t n);
+
+// Name of chosen instruction set: "avx2", "sse2" or "scalar"
+const char* VectorIsa();
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "binaryfile.h"
+#include "blocks.h"
+
+/*! Checks code once before it is run, so verified code can be
+ * executed without checks of every command. Checked are opcodes,
+ * jump conditions, targets of jumps and calls, memory ids, types,
+ * static indices against region sizes and depth of operand stack.
+ * Depth is found for every basic block from the start of code and
+ * from every CALL target: every block must be entered with the same
+ * depth, every function must leave the same number of elements on
+ * every RETURN and RETURN can't be reached without CALL
+ * @param [in] file Code
+ * @param [in] blocks Blocks of code, NULL if they can't be built
+ * @param [in] sizes Number of elements of every memory region
+ * @param [in] verbose Print reason if code is not verified
+ * @return 0 if code is verified
+ */
+int VerifyCode(const BinaryFile* file, const CodeBlocks* blocks,
+				const size_t* sizes, int verbose);
+
+/*! Checks that static indices of memory accesses fit their regions.
+ * Code failing it is not loaded at all, even if it is not verified
+ * @param [in] file Code
+ * @param [in] sizes Number of elements of every memory region
+ * @param [out] dynamic Set to 1 if code has accesses by indices
+ * from stack or registers, NULL if not needed
+ * @return 0 if all static indices fit, error is printed otherwise
+ */
+int VerifyIndices(const BinaryFile* file, const size_t* sizes, int* dynamic);
@@ -0,0 +1,138 @@
+#pragma once
+
+// C interface of libvm.a and libvm.so for running code in host program.
+// Library is built by g++, so C programs link it with -lstdc++ -pthread.
+// Diagnostics are printed to stdout like in cpu, unless VMSetDiagnostics
+// sends them to host
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VM_API_VERSION (2)
+
+#if defined(__GNUC__)
+#define VM_API __attribute__((visibility("default")))
+#else
+#define VM_API
+#endif
+
+// Results of VMCpuRun
+#define VM_HALT (0)
+#define VM_ERROR (1)
+// Budget is spent, run can be continued
+#define VM_BUDGET (-1)
+// SNAPSHOT command was executed, run can be continued
+#define VM_SNAPSHOT (-2)
+
+// No limit of commands for VMCpuRun
+#define VM_NO_BUDGET (UINT64_MAX)
+
+// Flags of VMCpuInit
+#define VM_CHECKED (1 << 0)		// Check stacks and memory on every access
+#define VM_JIT (1 << 1)			// Translate to native code, budget is ignored
+#define VM_NO_VERIFY (1 << 2)	// Run with checks of every command
+// Don't check indices from stack and registers of verified code,
+// code that is not verified always checks them
+#define VM_NO_CHECK_MEMORY (1 << 3)
+
+// Types of elements in callbacks, F64 values are passed as their bits
+#define VM_TYPE_I64 (1)
+#define VM_TYPE_F64 (2)
+
+/*! Reads element for PUSH IN
+ * @param [in] ctx Context given to VMCpuSetIO
+ * @param [in] type VM_TYPE_I64 or VM_TYPE_F64
+ * @param [out] val Read element
+ * @return 0 on success, non zero on end of input, command fails then
+ */
+typedef int (*VMReadFunc)(void* ctx, int type, int64_t* val);
+
+// Writes element of POP OUT, non zero result fails command
+typedef int (*VMWriteFunc)(void* ctx, int type, int64_t val);
+
+/*! Receives diagnostics, such as assembly errors and memory faults
+ * @param [in] ctx Context given to VMSetDiagnostics
+ * @param [in] message Message as cpu prints it, with its newline
+ */
+typedef void (*VMDiagFunc)(void* ctx, const char* message);
+
+struct VMProgram;
+struct VMCpu;
+
+typedef struct VMProgram VMProgram;
+typedef struct VMCpu VMCpu;
+
+// Version of library, compare with VM_API_VERSION
+VM_API int VMApiVersion(void);
+
+/*! Sends diagnostics of all programs and cpus to func instead of
+ * stdout, must be called before programs are loaded or run
+ * @param [in] func Function, NULL to print to stdout
+ * @param [in] ctx Passed to func
+ */
+VM_API void VMSetDiagnostics(VMDiagFunc func, void* ctx);
+
+/*! Loads program from contents of .bin file, data is copied
+ * @param [in] data Contents of file
+ * @param [in] size Size of data in bytes
+ * @return Program or NULL if data is not a valid binary file or
+ * memory can't be allocated
+ */
+VM_API VMProgram* VMProgramFromBin(const void* data, size_t size);
+
+/*! Assembles program from .vm text
+ * @param [in] text Lines of assembly, not null terminated
+ * @param [in] size Size of text in bytes
+ * @param [in] optimize Fuse commands into superinstructions
+ * @return Program or NULL on assembly error or if memory can't
+ * be allocated
+ */
+VM_API VMProgram* VMProgramFromText(const char* text, size_t size, int optimize);
+
+// Program may be shared by many cpus and must outlive them
+VM_API void VMProgramDeInit(VMProgram* program);
+
+/*! Creates cpu at the start of program. IN has no input and OUT
+ * is dropped until VMCpuSetIO
+ * @param [in] program Program
+ * @param [in] flags VM_CHECKED, VM_JIT, VM_NO_VERIFY and VM_NO_CHECK_MEMORY
+ * @param [in] max_depth Maximum depth of stacks, 0 for default
+ * @return Cpu or NULL on error
+ */
+VM_API VMCpu* VMCpuInit(const VMProgram* program, int flags, size_t max_depth);
+
+/*! Sets callbacks of IN and OUT
+ * @param [in] cpu Cpu
+ * @param [in] read Function for PUSH IN, NULL for no input
+ * @param [in] write Function for POP OUT, NULL to drop output
+ * @param [in] ctx Passed to functions
+ */
+VM_API void VMCpuSetIO(VMCpu* cpu, VMReadFunc read, VMWriteFunc write, void* ctx);
+
+/*! Executes at most budget commands from where cpu stopped
+ * @param [in] cpu Cpu
+ * @param [in] budget Number of commands or VM_NO_BUDGET
+ * @return VM_HALT, VM_BUDGET, VM_SNAPSHOT or VM_ERROR
+ */
+VM_API int VMCpuRun(VMCpu* cpu, uint64_t budget);
+
+// Number of elements on operand stack
+VM_API size_t VMCpuStackSize(const VMCpu* cpu);
+
+/*! Reads operand stack
+ * @param [in] cpu Cpu
+ * @param [in] depth Index of element, 0 is the top
+ * @param [out] val Element
+ * @return 0 on success, 1 if stack is not that deep
+ */
+VM_API int VMCpuStackGet(const VMCpu* cpu, size_t depth, int64_t* val);
+
+VM_API void VMCpuDeInit(VMCpu* cpu);
+
+#ifdef __cplusplus
+}
+#endif
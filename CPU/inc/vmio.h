@@ -0,0 +1,161 @@
+#pragma once
+
+#include "stack.h"
+
+#define VMIO_BUFFER_SIZE (1 << 16)
+
+// Longest text element: sign, 20 digits and newline, or
+// %.17g double with exponent and newline
+#define VMIO_MAX_TEXT (32)
+
+// Stream formats
+#define VMIO_TEXT (0)
+// Raw little endian stack_el_t
+#define VMIO_BINARY (1)
+// Elements are passed to functions of host program
+#define VMIO_CALLBACK (2)
+
+/*! Reads element for IN or IN_F64
+ * @param [in] ctx Context given with callbacks
+ * @param [in] type TYPE_I64 for IN, TYPE_F64 for IN_F64 with bits of value
+ * @param [out] val Read element
+ * @return 0 on success, non zero on end of input
+ */
+typedef int (*VMIOReadFunc)(void* ctx, int type, stack_el_t* val);
+
+// Writes element of OUT or OUT_F64, returns 0 on success
+typedef int (*VMIOWriteFunc)(void* ctx, int type, stack_el_t val);
+
+// Buffered input and output of IN and OUT memory regions.
+// Text input is parsed by hand, without scanf and locale,
+// output is formatted into buffer and written by big chunks
+struct VMIO {
+	int in_fd;
+	int in_format;
+
+	char* in_buffer;
+	size_t in_pos;
+	size_t in_size;
+	int in_eof;
+
+	int out_fd;
+	int out_format;
+
+	char* out_buffer;
+	size_t out_size;
+
+	// Functions of VMIO_CALLBACK formats
+	VMIOReadFunc read_func;
+	VMIOWriteFunc write_func;
+	void* func_ctx;
+};
+
+typedef struct VMIO VMIO;
+
+/*! Buffered io initialization
+ * @param [out] io Pointer to io
+ * @param [in] in_fd Input file descriptor
+ * @param [in] in_format VMIO_TEXT or VMIO_BINARY
+ * @param [in] out_fd Output file descriptor
+ * @param [in] out_format VMIO_TEXT or VMIO_BINARY
+ */
+void VMIOInit(VMIO* io, int in_fd, int in_format, int out_fd, int out_format);
+
+/*! Switches IN and OUT to functions of host program, pending output
+ * is flushed. Callback output keeps buffer full, so every VMIOWrite
+ * goes to VMIOFlushWrite
+ * @param [in] io Pointer to io
+ * @param [in] read_func Function for IN, NULL to keep descriptor
+ * @param [in] write_func Function for OUT, NULL to keep descriptor
+ * @param [in] ctx Passed to functions
+ */
+void VMIOSetCallbacks(VMIO* io, VMIOReadFunc read_func, 
+						VMIOWriteFunc write_func, void* ctx);
+
+/*! Reads one element, pending output is flushed before blocking
+ * @param [in] io Pointer to io
+ * @param [out] val Read element
+ * @return 0 on success, 1 on end of input or malformed input
+ */
+int VMIORead(VMIO* io, stack_el_t* val);
+
+/*! Reads one F64 element as its bits, text is parsed by
+ * from_chars without locale
+ * @param [in] io Pointer to io
+ * @param [out] val Read element
+ * @return 0 on success, 1 on end of input or malformed input
+ */
+int VMIOReadF64(VMIO* io, stack_el_t* val);
+
+/*! Writes one F64 element given by its bits, text is the shortest
+ * of %.15g and %.17g that reads back exactly
+ * @param [in] io Pointer to io
+ * @param [in] val Written element
+ * @return 0 on success, 1 on write error
+ */
+int VMIOWriteF64(VMIO* io, stack_el_t val);
+
+/*! Writes one element, slow path of VMIOWrite
+ * @param [in] io Pointer to io with full buffer
+ * @param [in] val Written element
+ * @return 0 on success, 1 on write error
+ */
+int VMIOFlushWrite(VMIO* io, stack_el_t val);
+
+/*! Writes buffered output
+ * @param [in] io Pointer to io
+ * @return 0 on success, 1 on write error
+ */
+int VMIOFlush(VMIO* io);
+
+// Flushes output and frees buffers
+void VMIODeInit(VMIO* io);
+
+// Formats element into buffer, returns number of written bytes
+inline size_t vmio_format(char* buffer, int format, stack_el_t val)
+{
+	if (format == VMIO_BINARY) {
+		unsigned long long raw = (unsigned long long)val;
+		for (size_t i = 0; i < sizeof(stack_el_t); ++i)
+			buffer[i] = char(raw >> (8 * i));
+
+		return sizeof(stack_el_t);
+	}
+
+	// Unsigned, so minimal value doesn't overflow
+	unsigned long long abs = (unsigned long long)val;
+	if (val < 0)
+		abs = -abs;
+
+	char digits[VMIO_MAX_TEXT] = {};
+	size_t ndigits = 0;
+	do {
+		digits[ndigits++] = '0' + abs % 10;
+		abs /= 10;
+	} while (abs);
+
+	size_t size = 0;
+	if (val < 0)
+		buffer[size++] = '-';
+	while (ndigits)
+		buffer[size++] = digits[--ndigits];
+	buffer[size++] = '\n';
+
+	return size;
+}
+
+/*! Writes one element
+ * @param [in] io Pointer to io
+ * @param [in] val Written element
+ * @return 0 on success, 1 on write error
+ */
+inline int VMIOWrite(VMIO* io, stack_el_t val)
+{
+	if (VMIO_BUFFER_SIZE - io->out_size < VMIO_MAX_TEXT)
+		return VMIOFlushWrite(io, val);
+
+	io->out_size += vmio_format(io->out_buffer + io->out_size,
+								io->out_format, val);
+
+	return 0;
+}
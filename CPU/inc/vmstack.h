@@ -0,0 +1,112 @@
+#pragma once
+
+#include "stack.h"
+
+// Stack of the virtual machine. In release mode it is a plain
+// contiguous array with cached top pointer, that grows geometrically
+// up to max elements. In checked mode every operation goes to
+// guarded PStack_t
+struct VMStack {
+	// Next free element
+	stack_el_t* top;
+	
+	stack_el_t* base;
+	stack_el_t* end;
+	
+	// Maximum number of elements stack can grow to
+	size_t max;
+	
+	// Depth push or reserve tried to reach above max, 0 if none did
+	size_t overflow;
+	
+	// Guarded stack for checked mode, NULL otherwise
+	PStack_t* checked;
+};
+
+typedef struct VMStack VMStack;
+
+/*! Stack initialization
+ * @param [out] stack Pointer to stack
+ * @param [in] capacity Initial capacity in elements
+ * @param [in] max Maximum size in elements
+ * @param [in] checked Use guarded PStack_t for every operation
+ * @return Stack error
+ */
+PS_ERROR VMStackInit(VMStack* stack, size_t capacity, size_t max, int checked);
+
+/*! Makes sure stack can hold capacity elements
+ * @param [in] stack Pointer to stack
+ * @param [in] capacity Required capacity in elements
+ * @return Stack error, TOO_BIG_SIZE if capacity is above maximum,
+ * then capacity is kept in overflow
+ */
+PS_ERROR VMStackReserve(VMStack* stack, size_t capacity);
+
+/*! Doubles stack capacity, but not above maximum
+ * @param [in] stack Pointer to stack
+ * @return Stack error, TOO_BIG_SIZE if stack is already at maximum
+ */
+PS_ERROR VMStackGrow(VMStack* stack);
+
+/*! Makes sure n more elements can be pushed without checks
+ * @param [in] stack Pointer to unchecked stack
+ * @param [in] n Number of elements
+ * @return Stack error, TOO_BIG_SIZE if stack would be above maximum
+ */
+PS_ERROR VMStackEnsure(VMStack* stack, size_t n);
+
+/*! Grows stack and pushes element, slow path of VMStackPush
+ * @param [in] stack Pointer to full stack
+ * @param [in] elem Pushed element
+ * @return Stack error
+ */
+PS_ERROR VMStackGrowPush(VMStack* stack, stack_el_t elem);
+
+/*! Stack size
+ * @param [in] stack Pointer to stack
+ * @return Number of elements in stack
+ */
+size_t VMStackSize(const VMStack* stack);
+
+/*! Stack elements from bottom to top
+ * @param [in] stack Pointer to stack
+ * @return Pointer to VMStackSize elements
+ */
+const stack_el_t* VMStackData(const VMStack* stack);
+
+/*! Stack deinitialization
+ * @param [in] stack Pointer to stack
+ */
+void VMStackDeInit(VMStack* stack);
+
+inline PS_ERROR VMStackPush(VMStack* stack, stack_el_t elem)
+{
+	if (stack->checked) {
+		if (stack->checked->size >= stack->max) {
+			stack->overflow = stack->checked->size + 1;
+			return TOO_BIG_SIZE;
+		}
+		
+		return PStackPush(stack->checked, elem);
+	}
+	
+	if (stack->top == stack->end)
+		return VMStackGrowPush(stack, elem);
+	
+	*stack->top++ = elem;
+	
+	return NO_ERROR;
+}
+
+inline PS_ERROR VMStackPop(VMStack* stack, stack_el_t* elem)
+{
+	if (stack->checked)
+		return PStackPop(stack->checked, elem);
+	
+	if (stack->top == stack->base)
+		return TOO_SMALL_SIZE;
+	
+	*elem = *--stack->top;
+	
+	return NO_ERROR;
+}
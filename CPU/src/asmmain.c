@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 
 #include "binaryfile.h"
 
@@ -7,26 +8,67 @@ inline int print_usage(const char* name)
 {
 	printf("## Aassembler for .vm files\n");
 	printf("## By InversionSpaces\n");
-	printf("## Translates VM_FILE and writes BIN_FILE\n");
-	printf("## Usage: %s VM_FILE BIN_FILE\n", name);
+	printf("## Translates VM_FILE (\"-\" for stdin) and writes BIN_FILE\n");
+	printf("## Usage: %s [OPTIONS] VM_FILE BIN_FILE\n", name);
+	printf("##        %s --convert [--format N] OLD_BIN_FILE BIN_FILE\n", name);
+	printf("## Options:\n");
+	printf("##   --no-opt\tdon't fuse commands into superinstructions\n");
+	printf("##   --format N\twrite binary format version N (1 or 2)\n");
+	printf("##   --convert\tconvert binary file to another format version\n");
+	printf("##   -j N\t\tassemble with N threads\n");
 	
 	return 0;
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc != 3)
+	int optimize = 1;
+	int convert = 0;
+	int version = BINARY_VERSION;
+	int njobs = 1;
+	
+	const char* files[2] = {};
+	int nfiles = 0;
+	
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--no-opt") == 0)
+			optimize = 0;
+		else if (strcmp(argv[i], "--convert") == 0)
+			convert = 1;
+		else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			version = atoi(argv[++i]);
+			if (version != BINARY_VERSION && 
+				version != BINARY_VERSION_V1)
+				return print_usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			njobs = atoi(argv[++i]);
+			if (njobs < 1)
+				return print_usage(argv[0]);
+		}
+		else if ((argv[i][0] != '-' || strcmp(argv[i], "-") == 0) && 
+				nfiles < 2)
+			files[nfiles++] = argv[i];
+		else
+			return print_usage(argv[0]);
+	}
+	
+	if (nfiles != 2)
 		return print_usage(argv[0]);
 	
-	BinaryFile* file = BinaryFileFromVMFile(argv[1]);
+	BinaryFile* file = convert ? 
+		BinaryFileFromBinFile(files[0]) :
+		BinaryFileFromVMFileParallel(files[0], optimize, njobs);
 	
 	if (!file) {
-		printf("## Error converting vm file...\n");
+		printf("## Error converting %s file...\n", convert ? "bin" : "vm");
 		
 		return 1;
 	}
 	
-	int error = BinaryFileToFile(file, argv[2]);
+	int error = (version == BINARY_VERSION) ?
+		BinaryFileToFile(file, files[1]) :
+		BinaryFileToFileVersion(file, files[1], version);
 	
 	if (error) {
 		printf("## Error writing file\n");
@@ -0,0 +1,318 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+#include "tokenizer.h"
+#include "exitingalloc.h"
+
+struct BatchJob {
+	char* bin_name;
+	char* in_name;
+	char* out_name;
+	
+	// check_memory of cpu config or -1 to keep it
+	int check_memory;
+	
+	// Shared with other jobs of the same .bin and check_memory,
+	// NULL if it failed to load
+	const CPUCode* code;
+	int error;
+};
+
+typedef struct BatchJob BatchJob;
+
+struct Batch {
+	BatchJob* jobs;
+	size_t njobs;
+	size_t capacity;
+	
+	// Distinct mapped files and their decoded code
+	BinaryFile** files;
+	size_t nfiles;
+	CPUCode** codes;
+	size_t ncodes;
+	
+	const CPUConfig* config;
+	
+	// Index of next job to take, updated atomically
+	size_t next;
+};
+
+typedef struct Batch Batch;
+
+inline char* token_dup(Token token)
+{
+	char* retval = reinterpret_cast<char*>(exiting_malloc(token.len + 1));
+	memcpy(retval, token.ptr, token.len);
+	retval[token.len] = '\0';
+	
+	return retval;
+}
+
+int parse_job(const Token* tokens, size_t ntokens, size_t nline, void* arg)
+{
+	Batch* batch = reinterpret_cast<Batch*>(arg);
+	
+	if (ntokens == 0)
+		return 0;
+	
+	int check_memory = -1;
+	if (ntokens == 4 && token_equals(tokens[3], "--check-memory"))
+		check_memory = 1;
+	else if (ntokens == 4 && token_equals(tokens[3], "--no-check-memory"))
+		check_memory = 0;
+	else if (ntokens != 3) {
+		printf("## ERROR: Expected BIN_FILE IN_FILE OUT_FILE "
+				"[--check-memory | --no-check-memory] on line %lu\n", nline);
+		
+		return 1;
+	}
+	
+	if (batch->njobs == batch->capacity) {
+		batch->capacity = batch->capacity ? 2 * batch->capacity : 64;
+		batch->jobs = reinterpret_cast<BatchJob*>(
+			exiting_realloc(batch->jobs, batch->capacity * sizeof(BatchJob))
+		);
+	}
+	
+	BatchJob* job = batch->jobs + batch->njobs++;
+	job->bin_name = token_dup(tokens[0]);
+	job->in_name = token_dup(tokens[1]);
+	job->out_name = token_dup(tokens[2]);
+	job->check_memory = check_memory;
+	job->code = 0;
+	job->error = 0;
+	
+	return 0;
+}
+
+int compare_bin_names(const void* a, const void* b)
+{
+	const BatchJob* first = *reinterpret_cast<BatchJob* const*>(a);
+	const BatchJob* second = *reinterpret_cast<BatchJob* const*>(b);
+	
+	int cmp = strcmp(first->bin_name, second->bin_name);
+	if (cmp)
+		return cmp;
+	
+	return first->check_memory - second->check_memory;
+}
+
+// Maps every distinct .bin once and decodes it once for every
+// check_memory, jobs sorted by name and check_memory share it
+void map_codes(Batch* batch)
+{
+	BatchJob** sorted = reinterpret_cast<BatchJob**>(
+		exiting_malloc(batch->njobs * sizeof(BatchJob*))
+	);
+	
+	for (size_t i = 0; i < batch->njobs; ++i)
+		sorted[i] = batch->jobs + i;
+	
+	qsort(sorted, batch->njobs, sizeof(BatchJob*), compare_bin_names);
+	
+	batch->files = reinterpret_cast<BinaryFile**>(
+		exiting_malloc(batch->njobs * sizeof(BinaryFile*))
+	);
+	batch->nfiles = 0;
+	batch->codes = reinterpret_cast<CPUCode**>(
+		exiting_malloc(batch->njobs * sizeof(CPUCode*))
+	);
+	batch->ncodes = 0;
+	
+	const BinaryFile* file = 0;
+	const CPUCode* code = 0;
+	for (size_t i = 0; i < batch->njobs; ++i) {
+		BatchJob* job = sorted[i];
+		
+		int new_file = (i == 0 || strcmp(sorted[i - 1]->bin_name, job->bin_name));
+		if (new_file) {
+			BinaryFile* mapped = BinaryFileMap(job->bin_name);
+			if (mapped)
+				batch->files[batch->nfiles++] = mapped;
+			else
+				printf("## Error loading binary file %s\n", job->bin_name);
+			
+			file = mapped;
+		}
+		
+		if (new_file || sorted[i - 1]->check_memory != job->check_memory) {
+			CPUConfig config = *batch->config;
+			if (job->check_memory >= 0)
+				config.check_memory = job->check_memory;
+			
+			CPUCode* decoded = file ? CPUCodeInit(file, &config) : 0;
+			if (decoded)
+				batch->codes[batch->ncodes++] = decoded;
+			
+			code = decoded;
+		}
+		
+		job->code = code;
+		job->error = !code;
+	}
+	
+	free(sorted);
+}
+
+// Writes remaining stack after OUT like single cpu does
+int write_stack(CPU* cpu, int fd)
+{
+	int i = 0;
+	while (VMStackSize(&cpu->stack)) {
+		stack_el_t a = 0;
+		VMStackPop(&cpu->stack, &a);
+		
+		if (dprintf(fd, "## %d:\t|%" PRId64 "|\n", i++, a) < 0)
+			return 1;
+	}
+	
+	return 0;
+}
+
+int run_job(const BatchJob* job, const CPUConfig* config)
+{
+	const char* in_name = strcmp(job->in_name, "-") ? 
+							job->in_name : "/dev/null";
+	
+	CPUConfig job_config = *config;
+	if (job->check_memory >= 0)
+		job_config.check_memory = job->check_memory;
+	
+	job_config.in_fd = open(in_name, O_RDONLY);
+	if (job_config.in_fd < 0) {
+		printf("## Error: failed to open %s\n", in_name);
+		
+		return 1;
+	}
+	
+	job_config.out_fd = open(job->out_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (job_config.out_fd < 0) {
+		printf("## Error: failed to open %s\n", job->out_name);
+		
+		close(job_config.in_fd);
+		return 1;
+	}
+	
+	int error = 1;
+	
+	CPU* cpu = CPUInitShared(job->code, &job_config);
+	if (cpu) {
+		// Snapshots are not taken in batch
+		do
+			error = CPUExecute(cpu);
+		while (error == CPU_SNAPSHOT);
+		
+		if (!error)
+			error = write_stack(cpu, job_config.out_fd);
+		
+		CPUDeInit(cpu);
+	}
+	
+	close(job_config.in_fd);
+	if (close(job_config.out_fd))
+		error = 1;
+	
+	return error;
+}
+
+void* batch_worker(void* arg)
+{
+	Batch* batch = reinterpret_cast<Batch*>(arg);
+	
+	for (;;) {
+		size_t i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+		if (i >= batch->njobs)
+			break;
+		
+		BatchJob* job = batch->jobs + i;
+		if (job->code)
+			job->error = run_job(job, batch->config);
+	}
+	
+	return 0;
+}
+
+#ifdef __unix__
+
+#include <pthread.h>
+
+// Workers take jobs until there are none, so long jobs don't hold others
+void run_workers(Batch* batch, size_t nthreads)
+{
+	pthread_t* threads = reinterpret_cast<pthread_t*>(
+		exiting_malloc(nthreads * sizeof(pthread_t))
+	);
+	
+	size_t started = 0;
+	for (; started < nthreads; ++started)
+		if (pthread_create(&threads[started], 0, batch_worker, batch))
+			break;
+	
+	// Jobs left by not started threads are done here
+	if (started < nthreads)
+		batch_worker(batch);
+	
+	for (size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], 0);
+	
+	free(threads);
+}
+
+#else
+
+void run_workers(Batch* batch, size_t nthreads)
+{
+	batch_worker(batch);
+}
+
+#endif
+
+int BatchRun(const char* manifest, const CPUConfig* config, size_t nthreads)
+{
+	assert(manifest);
+	assert(config);
+	
+	Batch batch = {};
+	batch.config = config;
+	
+	int retval = -1;
+	
+	if (tokenize_file(manifest, parse_job, &batch) == 0) {
+		map_codes(&batch);
+		run_workers(&batch, nthreads ? nthreads : 1);
+		
+		retval = 0;
+		for (size_t i = 0; i < batch.njobs; ++i) {
+			if (!batch.jobs[i].error)
+				continue;
+			
+			printf("## Error: job %lu (%s %s %s) failed\n", i,
+					batch.jobs[i].bin_name, batch.jobs[i].in_name,
+					batch.jobs[i].out_name);
+			++retval;
+		}
+	}
+	
+	for (size_t i = 0; i < batch.ncodes; ++i)
+		CPUCodeDeInit(batch.codes[i]);
+	free(batch.codes);
+	
+	for (size_t i = 0; i < batch.nfiles; ++i)
+		BinaryFileUnmap(batch.files[i]);
+	free(batch.files);
+	
+	for (size_t i = 0; i < batch.njobs; ++i) {
+		free(batch.jobs[i].bin_name);
+		free(batch.jobs[i].in_name);
+		free(batch.jobs[i].out_name);
+	}
+	free(batch.jobs);
+	
+	return retval;
+}
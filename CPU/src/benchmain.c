@@ -0,0 +1,412 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "tokenizer.h"
+#include "exitingalloc.h"
+
+// Runs of cpu are separate processes, so every measurement includes
+// loading of .bin, programs should run for at least 0.1 second
+
+#define MAX_NAME (256)
+
+// Longest line of cpu output that is looked at
+#define MAX_LINE (256)
+
+struct Benchmark {
+	char name[MAX_NAME];
+	char bin_name[MAX_NAME];
+	char in_name[MAX_NAME];
+
+	// Executed commands, the same for every run
+	uint64_t commands;
+
+	// Seconds of every run
+	double* wall;
+	double user;
+	double sys;
+
+	// Largest of runs, in kilobytes
+	long peak_rss;
+
+	int error;
+};
+
+typedef struct Benchmark Benchmark;
+
+struct Suite {
+	Benchmark* benchmarks;
+	size_t nbenchmarks;
+	size_t capacity;
+};
+
+typedef struct Suite Suite;
+
+struct BenchConfig {
+	const char* cpu;
+	int jit;
+	size_t runs;
+};
+
+typedef struct BenchConfig BenchConfig;
+
+inline int print_usage(const char* name)
+{
+	printf("## Benchmark of cpu\n");
+	printf("## By InversionSpaces\n");
+	printf("## Runs every line NAME BIN_FILE IN_FILE of MANIFEST several times\n");
+	printf("## Usage: %s [OPTIONS] MANIFEST\n", name);
+	printf("## Options:\n");
+	printf("##   -n N\tnumber of timed runs, 5 by default\n");
+	printf("##   -o FILE\twrite results to FILE as JSON\n");
+	printf("##   --cpu PATH\tcpu to run, ./cpu by default\n");
+	printf("##   --jit\trun cpu with --jit\n");
+
+	return 0;
+}
+
+inline int token_copy(char* dest, Token token)
+{
+	if (token.len >= MAX_NAME)
+		return 1;
+
+	memcpy(dest, token.ptr, token.len);
+	dest[token.len] = '\0';
+
+	return 0;
+}
+
+int parse_benchmark(const Token* tokens, size_t ntokens, size_t nline, void* arg)
+{
+	Suite* suite = reinterpret_cast<Suite*>(arg);
+
+	if (ntokens == 0)
+		return 0;
+
+	if (suite->nbenchmarks == suite->capacity) {
+		suite->capacity = suite->capacity ? 2 * suite->capacity : 16;
+		suite->benchmarks = reinterpret_cast<Benchmark*>(
+			exiting_realloc(suite->benchmarks,
+							suite->capacity * sizeof(Benchmark))
+		);
+	}
+
+	Benchmark* bench = suite->benchmarks + suite->nbenchmarks;
+	memset(bench, 0, sizeof(Benchmark));
+
+	if (ntokens != 3 ||
+		token_copy(bench->name, tokens[0]) ||
+		token_copy(bench->bin_name, tokens[1]) ||
+		token_copy(bench->in_name, tokens[2])) {
+		printf("## ERROR: Expected NAME BIN_FILE IN_FILE on line %lu\n", nline);
+
+		return 1;
+	}
+
+	suite->nbenchmarks++;
+
+	return 0;
+}
+
+//======================================================================
+
+inline double now()
+{
+	struct timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+inline double seconds(struct timeval tv)
+{
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/*! Runs cpu on benchmark and waits for it
+ * @param [in] out_fd Descriptor for output of cpu
+ * @param [out] usage Resource usage of cpu process
+ * @param [out] wall Wall time of run in seconds
+ * @return 0 if cpu exited with 0
+ */
+int run_cpu(const BenchConfig* config, const Benchmark* bench, int stats,
+			int out_fd, struct rusage* usage, double* wall)
+{
+	const char* in_name = strcmp(bench->in_name, "-") ?
+							bench->in_name : "/dev/null";
+
+	int in_fd = open(in_name, O_RDONLY);
+	if (in_fd < 0) {
+		printf("## Error: failed to open %s\n", in_name);
+
+		return 1;
+	}
+
+	const char* argv[5] = {config->cpu};
+	int argc = 1;
+	if (stats)
+		argv[argc++] = "--stats";
+	else if (config->jit)
+		argv[argc++] = "--jit";
+	argv[argc++] = bench->bin_name;
+
+	// Messages of harness go before output of child
+	fflush(stdout);
+
+	double start = now();
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		dup2(in_fd, STDIN_FILENO);
+		dup2(out_fd, STDOUT_FILENO);
+		execv(config->cpu, const_cast<char* const*>(argv));
+
+		_exit(127);
+	}
+
+	close(in_fd);
+
+	if (pid < 0) {
+		printf("## Error: failed to start %s\n", config->cpu);
+
+		return 1;
+	}
+
+	int status = 0;
+	if (wait4(pid, &status, 0, usage) != pid)
+		return 1;
+
+	*wall = now() - start;
+
+	return !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+// Gets number of commands from output of cpu --stats
+int count_commands(const BenchConfig* config, Benchmark* bench)
+{
+	FILE* output = tmpfile();
+	if (!output)
+		return 1;
+
+	struct rusage usage = {};
+	double wall = 0;
+	int error = run_cpu(config, bench, 1, fileno(output), &usage, &wall);
+
+	// Output of program is mixed with the line
+	if (!error) {
+		error = 1;
+		rewind(output);
+
+		char line[MAX_LINE] = "";
+		while (fgets(line, sizeof(line), output))
+			if (sscanf(line, "## Commands: %" SCNu64, &bench->commands) == 1)
+				error = 0;
+	}
+
+	fclose(output);
+
+	return error;
+}
+
+int run_benchmark(const BenchConfig* config, Benchmark* bench, int null_fd)
+{
+	if (count_commands(config, bench)) {
+		printf("## Error: counting run of %s failed\n", bench->name);
+
+		return 1;
+	}
+
+	bench->wall = reinterpret_cast<double*>(
+		exiting_calloc(config->runs, sizeof(double))
+	);
+
+	// Warm up page cache
+	struct rusage usage = {};
+	double wall = 0;
+	if (run_cpu(config, bench, 0, null_fd, &usage, &wall)) {
+		printf("## Error: run of %s failed\n", bench->name);
+
+		return 1;
+	}
+
+	for (size_t i = 0; i < config->runs; ++i) {
+		if (run_cpu(config, bench, 0, null_fd, &usage, bench->wall + i)) {
+			printf("## Error: run of %s failed\n", bench->name);
+
+			return 1;
+		}
+
+		bench->user += seconds(usage.ru_utime);
+		bench->sys += seconds(usage.ru_stime);
+		if (usage.ru_maxrss > bench->peak_rss)
+			bench->peak_rss = usage.ru_maxrss;
+	}
+
+	return 0;
+}
+
+//======================================================================
+
+struct Summary {
+	double mean;
+	double min;
+	double max;
+	double stddev;
+};
+
+typedef struct Summary Summary;
+
+Summary summarize(const double* values, size_t n)
+{
+	Summary retval = {0, values[0], values[0], 0};
+
+	for (size_t i = 0; i < n; ++i) {
+		retval.mean += values[i];
+		if (values[i] < retval.min)
+			retval.min = values[i];
+		if (values[i] > retval.max)
+			retval.max = values[i];
+	}
+	retval.mean /= n;
+
+	// Sample deviation
+	if (n > 1) {
+		for (size_t i = 0; i < n; ++i)
+			retval.stddev += (values[i] - retval.mean) * (values[i] - retval.mean);
+		retval.stddev = sqrt(retval.stddev / (n - 1));
+	}
+
+	return retval;
+}
+
+void print_benchmark(const Benchmark* bench, size_t runs)
+{
+	Summary s = summarize(bench->wall, runs);
+
+	printf("## %-12s %12" PRIu64 " commands %8.3f s +- %5.1f%% "
+			"%8.2f ns/command %9.1f M/s %8ld KB\n",
+			bench->name, bench->commands, s.mean, 100 * s.stddev / s.mean,
+			1e9 * s.mean / bench->commands,
+			bench->commands / s.mean * 1e-6, bench->peak_rss);
+}
+
+int write_json(const Suite* suite, const BenchConfig* config, const char* name)
+{
+	FILE* fp = fopen(name, "w");
+	if (!fp)
+		return 1;
+
+	fprintf(fp, "{\n");
+	fprintf(fp, "  \"cpu\": \"%s\",\n", config->cpu);
+	fprintf(fp, "  \"jit\": %s,\n", config->jit ? "true" : "false");
+	fprintf(fp, "  \"runs\": %zu,\n", config->runs);
+	fprintf(fp, "  \"benchmarks\": [");
+
+	int first = 1;
+	for (size_t i = 0; i < suite->nbenchmarks; ++i) {
+		const Benchmark* bench = suite->benchmarks + i;
+		if (bench->error)
+			continue;
+
+		Summary s = summarize(bench->wall, config->runs);
+
+		fprintf(fp, "%s\n    {\n", first ? "" : ",");
+		fprintf(fp, "      \"name\": \"%s\",\n", bench->name);
+		fprintf(fp, "      \"commands\": %" PRIu64 ",\n", bench->commands);
+		fprintf(fp, "      \"wall_mean_s\": %.6f,\n", s.mean);
+		fprintf(fp, "      \"wall_min_s\": %.6f,\n", s.min);
+		fprintf(fp, "      \"wall_max_s\": %.6f,\n", s.max);
+		fprintf(fp, "      \"wall_stddev_s\": %.6f,\n", s.stddev);
+		fprintf(fp, "      \"wall_variance_s2\": %.9f,\n", s.stddev * s.stddev);
+		fprintf(fp, "      \"user_mean_s\": %.6f,\n", bench->user / config->runs);
+		fprintf(fp, "      \"sys_mean_s\": %.6f,\n", bench->sys / config->runs);
+		fprintf(fp, "      \"commands_per_s\": %.0f,\n", bench->commands / s.mean);
+		fprintf(fp, "      \"ns_per_command\": %.4f,\n", 1e9 * s.mean / bench->commands);
+		fprintf(fp, "      \"peak_rss_kb\": %ld\n", bench->peak_rss);
+		fprintf(fp, "    }");
+
+		first = 0;
+	}
+
+	fprintf(fp, "\n  ]\n}\n");
+
+	return fclose(fp) != 0;
+}
+
+//======================================================================
+
+int main(int argc, char* argv[])
+{
+	BenchConfig config = {"./cpu", 0, 5};
+	const char* json_name = 0;
+	const char* manifest = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--jit") == 0)
+			config.jit = 1;
+		else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc)
+			config.cpu = argv[++i];
+		else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			json_name = argv[++i];
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			char* end = 0;
+			config.runs = strtoull(argv[++i], &end, 10);
+			if (*end || config.runs == 0)
+				return print_usage(argv[0]);
+		}
+		else if (argv[i][0] != '-' && !manifest)
+			manifest = argv[i];
+		else
+			return print_usage(argv[0]);
+	}
+
+	if (!manifest)
+		return print_usage(argv[0]);
+
+	Suite suite = {};
+	if (tokenize_file(manifest, parse_benchmark, &suite)) {
+		printf("## Error reading manifest\n");
+
+		free(suite.benchmarks);
+		return 1;
+	}
+
+	int null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0) {
+		free(suite.benchmarks);
+
+		return 1;
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < suite.nbenchmarks; ++i) {
+		Benchmark* bench = suite.benchmarks + i;
+
+		bench->error = run_benchmark(&config, bench, null_fd);
+		if (bench->error)
+			failed = 1;
+		else
+			print_benchmark(bench, config.runs);
+	}
+
+	close(null_fd);
+
+	if (json_name && write_json(&suite, &config, json_name)) {
+		printf("## Error writing %s\n", json_name);
+
+		failed = 1;
+	}
+
+	for (size_t i = 0; i < suite.nbenchmarks; ++i)
+		free(suite.benchmarks[i].wall);
+	free(suite.benchmarks);
+
+	return failed;
+}
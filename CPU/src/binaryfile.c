@@ -1,17 +1,30 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
 #include <assert.h>
 
 #include "binaryfile.h"
 
 #include "tokenizer.h"
+#include "diag.h"
 #include "exitingalloc.h"
 #include "files.h"
 #include "command.h"
+#include "memory.h"
+#include "optimizer.h"
 
-inline size_t binfile_size(const BinaryFile* file)
+#define HEADER_SIZE (offsetof(BinaryFile, commands))
+
+inline size_t command_size(int version)
+{
+	return 	(version == BINARY_VERSION_V1) ? 
+			sizeof(BinCommandV1) : sizeof(BinCommand);
+}
+
+// Sections start right after commands
+inline size_t commands_end(const BinaryFile* file)
 {
-	return (sizeof(BinaryFile) + 
-			(file->ncommands - 1) * sizeof(BinCommand));
+	return HEADER_SIZE + file->ncommands * command_size(file->version);
 }
 
 CommandsContainer* CContainerInit() 
@@ -26,10 +39,27 @@ CommandsContainer* CContainerInit()
 		exiting_malloc(sizeof(LabelEntry) * retval->lcapacity)
 	);
 	
+	retval->lslots = 2 * retval->lcapacity;
+	retval->lindex = reinterpret_cast<LabelSlot*>(
+		exiting_malloc(sizeof(LabelSlot) * retval->lslots)
+	);
+	for (size_t i = 0; i < retval->lslots; ++i)
+		retval->lindex[i] = {0, -1};
+	
+	retval->arena = 0;
+	
+	memset(retval->rsizes, 0, sizeof(retval->rsizes));
+	
 	retval->ccapacity = 1;
 	retval->file = reinterpret_cast<BinaryFile*>(
 		exiting_malloc(sizeof(BinaryFile))
 	);
+	retval->file->magic = BINARY_MAGIC;
+	retval->file->version = BINARY_VERSION;
+	retval->file->header_size = HEADER_SIZE;
+	retval->file->checksum = 0;
+	retval->file->flags = 0;
+	retval->file->size = 0;
 	retval->file->ncommands = 0;
 	
 	return retval;
@@ -43,7 +73,7 @@ int CContainerReserve(CommandsContainer* container, size_t size)
 	if (container->ccapacity == size)
 		return 0;
 	
-	size_t bsize = sizeof(BinaryFile) + (size - 1) * sizeof(BinCommand);
+	size_t bsize = HEADER_SIZE + size * sizeof(BinCommand);
 	container->file = reinterpret_cast<BinaryFile*>(
 		exiting_realloc(container->file, bsize)
 	);
@@ -69,19 +99,97 @@ int CContainerShrink(CommandsContainer* container)
 {
 	assert(container != nullptr);
 	
+	// Empty code keeps its initial capacity
 	size_t size = container->file->ncommands;
+	if (!size)
+		return 0;
 	
 	return CContainerReserve(container, size);
 }
 
+#define ARENA_CHUNK (1 << 16)
+
+struct LabelArena {
+	LabelArena* next;
+	size_t size;
+	size_t capacity;
+	char data[1];
+};
+
 void CContainerDeInit(CommandsContainer* container)
 {
 	assert(container);
 	
+	while (container->arena) {
+		LabelArena* next = container->arena->next;
+		free(container->arena);
+		container->arena = next;
+	}
+	
+	free(container->lindex);
 	free(container->labels);
 	free(container);
 }
 
+//======================================================================
+
+// Copies name to arena, so labels outlive source text
+const char* LabelsIntern(CommandsContainer* container, Token name)
+{
+	size_t len = name.len;
+	
+	LabelArena* arena = container->arena;
+	
+	if (!arena || arena->capacity - arena->size < len + 1) {
+		size_t capacity = (len + 1 > ARENA_CHUNK) ? len + 1 : ARENA_CHUNK;
+		
+		arena = reinterpret_cast<LabelArena*>(
+			exiting_malloc(offsetof(LabelArena, data) + capacity)
+		);
+		arena->next = container->arena;
+		arena->size = 0;
+		arena->capacity = capacity;
+		
+		container->arena = arena;
+	}
+	
+	char* retval = arena->data + arena->size;
+	memcpy(retval, name.ptr, len);
+	retval[len] = '\0';
+	arena->size += len + 1;
+	
+	return retval;
+}
+
+// FNV-1a
+inline uint32_t LabelsHash(Token name)
+{
+	uint32_t hash = 2166136261u;
+	
+	for (size_t i = 0; i < name.len; ++i)
+		hash = (hash ^ uint8_t(name.ptr[i])) * 16777619u;
+	
+	return hash;
+}
+
+// Slot with label or empty slot where it should be inserted
+inline LabelSlot* LabelsSlot(CommandsContainer* container, Token name, uint32_t hash)
+{
+	size_t mask = container->lslots - 1;
+	
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		LabelSlot* slot = &container->lindex[i];
+		
+		if (slot->index < 0)
+			return slot;
+		
+		if (slot->hash == hash && 
+			token_equals(name, container->labels[slot->index].name))
+			return slot;
+	}
+}
+
+// Keeps room for one more label and load factor of table below 1/2
 inline void LabelsReserve(CommandsContainer* container)
 {
 	assert(container);
@@ -89,38 +197,66 @@ inline void LabelsReserve(CommandsContainer* container)
 	if (container->lcapacity == container->lsize) {
 		container->lcapacity *= 2;
 		container->labels = reinterpret_cast<LabelEntry*>(
-			exiting_realloc(container->labels, container->lcapacity)
+			exiting_realloc(container->labels, 
+							container->lcapacity * sizeof(LabelEntry))
 		);
 	}
+	
+	if (2 * (container->lsize + 1) <= container->lslots)
+		return;
+	
+	free(container->lindex);
+	
+	container->lslots *= 2;
+	container->lindex = reinterpret_cast<LabelSlot*>(
+		exiting_malloc(sizeof(LabelSlot) * container->lslots)
+	);
+	for (size_t i = 0; i < container->lslots; ++i)
+		container->lindex[i] = {0, -1};
+	
+	for (size_t i = 0; i < container->lsize; ++i) {
+		const char* str = container->labels[i].name;
+		Token name = {str, strlen(str)};
+		uint32_t hash = LabelsHash(name);
+		
+		*LabelsSlot(container, name, hash) = {hash, int(i)};
+	}
 }
 
-inline int LabelsFind(CommandsContainer* container, const char* name)
+// Index of label, new labels are added with ncommand
+inline int LabelsFind(CommandsContainer* container, Token name, int ncommand)
 {
 	assert(container);
 	assert(container->labels);
-	assert(name);
+	assert(name.ptr);
 	
-	for (int i = 0; i < container->lsize; ++i)
-		if (strcmp(container->labels[i].name, name) == 0) 
-			return i;
+	uint32_t hash = LabelsHash(name);
+	
+	LabelSlot* slot = LabelsSlot(container, name, hash);
+	if (slot->index >= 0)
+		return slot->index;
+	
+	LabelsReserve(container);
 	
-	return -1;
+	// Table could be rebuilt
+	slot = LabelsSlot(container, name, hash);
+	
+	int i = container->lsize++;
+	container->labels[i] = {LabelsIntern(container, name), ncommand};
+	*slot = {hash, i};
+	
+	return i;
 }
 
-int CContainerLabelSet(CommandsContainer* container, const char* name, int ncommand)
+int CContainerLabelSet(CommandsContainer* container, Token name, int ncommand)
 {
 	assert(container);
-	assert(container->labels);
-	assert(name);
 	
-	int i = LabelsFind(container, name);
-	if (i < 0) {
-		LabelsReserve(container);
-		
-		container->labels[container->lsize++] = {name, ncommand};
-		
+	size_t lsize = container->lsize;
+	int i = LabelsFind(container, name, ncommand);
+	
+	if (size_t(i) == lsize)
 		return 0;
-	}
 	
 	if (container->labels[i].ncommand == -1) {
 		container->labels[i].ncommand = ncommand;
@@ -131,22 +267,11 @@ int CContainerLabelSet(CommandsContainer* container, const char* name, int ncomm
 	return 1;
 }
 
-int CContainerLabelGet(CommandsContainer* container, const char* name)
+int CContainerLabelGet(CommandsContainer* container, Token name)
 {
 	assert(container);
-	assert(container->labels);
-	assert(name);
 	
-	int i = LabelsFind(container, name);
-	if (i < 0) {
-		LabelsReserve(container);
-		
-		i = container->lsize++;
-		
-		container->labels[i] = {name, -1};
-	}
-	
-	return i;
+	return LabelsFind(container, name, -1);
 }
 
 int CContainerPushLabels(CommandsContainer* container)
@@ -155,19 +280,141 @@ int CContainerPushLabels(CommandsContainer* container)
 		if (container->labels[i].ncommand == -1)
 			return 1;
 	
+	const int jump_id = get_command_id("JUMP");
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+	
 	for (int i = 0; i < container->file->ncommands; ++i) {
 		BinCommand* cmd = &container->file->commands[i];
 		
 		int id = get_command_id(cmd->type);
-		if (id == get_command_id("JUMP") || 
-			id == get_command_id("CALL"))
+		if (id == jump_id || id == call_id || id == tailcall_id)
 			cmd->arg2 = container->labels[cmd->arg2].ncommand;
 	}
 	
 	return 0;		
 }
 
-int process_tokens(	const char **tokens, 
+int compare_labels(const void* a, const void* b)
+{
+	const LabelEntry* first = reinterpret_cast<const LabelEntry*>(a);
+	const LabelEntry* second = reinterpret_cast<const LabelEntry*>(b);
+	
+	if (first->ncommand != second->ncommand)
+		return (first->ncommand > second->ncommand) - 
+				(first->ncommand < second->ncommand);
+	
+	return strcmp(first->name, second->name);
+}
+
+// Appends section of size bytes after file->size,
+// returns pointer to its data
+uint8_t* CContainerSection(CommandsContainer* container, uint32_t tag, size_t size)
+{
+	size_t end = container->file->size;
+	BinarySection section = {tag, uint32_t(size)};
+	
+	container->file = reinterpret_cast<BinaryFile*>(
+		exiting_realloc(container->file, end + sizeof(section) + size)
+	);
+	container->file->size = end + sizeof(section) + size;
+	
+	uint8_t* data = reinterpret_cast<uint8_t*>(container->file) + end;
+	memcpy(data, &section, sizeof(section));
+	
+	return data + sizeof(section);
+}
+
+int CContainerRegion(CommandsContainer* container, Token name, Token size)
+{
+	assert(container);
+	
+	int mem_id = get_mem_id(name.ptr, name.len);
+	if (mem_id < 0 || mem_id >= get_not_mem_id())
+		return 1;
+	
+	int val = 0;
+	if (token_to_int(size, &val) || val <= 0 || 
+		uint32_t(val) > MEMORY_MAX_REGION)
+		return 1;
+	
+	if (container->rsizes[mem_id]) {
+		diag_printf("## ERROR: Region %s is sized twice\n", get_mem_name(mem_id));
+		
+		return 1;
+	}
+	
+	container->rsizes[mem_id] = val;
+	
+	return 0;
+}
+
+// Appends memory section if any region is sized, must be called
+// after shrink
+int CContainerPushRegions(CommandsContainer* container)
+{
+	assert(container);
+	
+	uint32_t nregions = 0;
+	for (size_t i = 0; i < BINARY_MAX_REGIONS; ++i)
+		nregions += (container->rsizes[i] != 0);
+	
+	if (nregions == 0)
+		return 0;
+	
+	uint8_t* data = CContainerSection(	container, SECTION_MEMORY, 
+										sizeof(nregions) + 
+										nregions * sizeof(BinaryRegion));
+	
+	memcpy(data, &nregions, sizeof(nregions));
+	data += sizeof(nregions);
+	
+	for (uint32_t i = 0; i < BINARY_MAX_REGIONS; ++i) {
+		if (!container->rsizes[i])
+			continue;
+		
+		BinaryRegion region = {i, container->rsizes[i]};
+		memcpy(data, &region, sizeof(region));
+		data += sizeof(region);
+	}
+	
+	return 0;
+}
+
+// Appends labels section, must be called after shrink and
+// CContainerPushLabels, label indices are not valid after it
+int CContainerPushDebug(CommandsContainer* container)
+{
+	assert(container);
+	
+	// Sorted by address and name, so section doesn't depend
+	// on order labels were mentioned in
+	qsort(container->labels, container->lsize, sizeof(LabelEntry), compare_labels);
+	
+	size_t size = sizeof(uint32_t);
+	for (size_t i = 0; i < container->lsize; ++i)
+		size += sizeof(int32_t) + strlen(container->labels[i].name) + 1;
+	
+	uint8_t* data = CContainerSection(container, SECTION_LABELS, size);
+	
+	uint32_t nlabels = container->lsize;
+	memcpy(data, &nlabels, sizeof(nlabels));
+	data += sizeof(nlabels);
+	
+	for (size_t i = 0; i < container->lsize; ++i) {
+		int32_t ncommand = container->labels[i].ncommand;
+		memcpy(data, &ncommand, sizeof(ncommand));
+		data += sizeof(ncommand);
+		
+		size_t len = strlen(container->labels[i].name) + 1;
+		memcpy(data, container->labels[i].name, len);
+		data += len;
+	}
+	
+	return 0;
+}
+
+int process_tokens(	const Token* tokens, 
                     size_t ntokens, 
 					size_t nline, 
                     void* arg)
@@ -175,73 +422,584 @@ int process_tokens(	const char **tokens,
     assert(tokens);
     assert(arg);
     
-    for (size_t i = 0; i < ntokens; ++i)
-		if (*(tokens[i]) == ';')
-			ntokens = i;
-    
 	if (ntokens == 0) return 0;
+	
+	CommandsContainer* container = 
+		reinterpret_cast<CommandsContainer*>(arg);
+	
+	// Directive, not a command
+	if (token_equals(tokens[0], "REGION")) {
+		if (ntokens == 3 && !CContainerRegion(container, tokens[1], tokens[2]))
+			return 0;
+		
+		diag_printf("Error on REGION on line %lu\n", nline);
 		
-	int id = get_command_id(tokens[0]);
+		return 1;
+	}
+		
+	int id = get_command_id(tokens[0].ptr, tokens[0].len);
 	
 	if (id < 0) {
-		printf("## ERROR: Unknown command \"%s\" on line %lu\n", 
-			tokens[0], nline);
+		diag_printf("## ERROR: Unknown command \"%.*s\" on line %lu\n", 
+			int(tokens[0].len), tokens[0].ptr, nline);
 		
 		return 1;
 	}
-	
-	CommandsContainer* container = 
-		reinterpret_cast<CommandsContainer*>(arg);
 		
 	int error = get_processor(id)(tokens, ntokens, container);
 	
-	if (error) printf("Error on %s\n", tokens[0]);
+	if (error) diag_printf("Error on %s on line %lu\n", get_command_name(id), nline);
 	
 	return error;
 }
 
-BinaryFile* BinaryFileFromVMFile(const char* fname)
+// Optimizes and links assembled commands, container is deinited
+BinaryFile* CContainerFinish(CommandsContainer* container, int error, int optimize)
 {
-    assert(fname);
-    
-    char* data = read_file_str(fname);
-    
-    CommandsContainer* container = CContainerInit();
+	assert(container);
 	
-	int error = tokenize_lines(	data, 
-								" \t", 
-								process_tokens, 
-								container
-								);
-    
-    if (error) {
-		free(container->file);
-		CContainerDeInit(container);
-		free(data);
-		
-		return NULL;
-	}
+	if (!error && optimize)
+		error = OptimizeCommands(container);
 	
-	error = CContainerPushLabels(container);
+	if (!error)
+		error = CContainerPushLabels(container);
 	
 	if (error) {
 		free(container->file);
 		CContainerDeInit(container);
-		free(data);
 		
 		return NULL;
 	}
     
     CContainerShrink(container);
     
+    // Sections follow commands
+    container->file->size = commands_end(container->file);
+    CContainerPushRegions(container);
+    CContainerPushDebug(container);
+    
     BinaryFile* retval = container->file;
     
-    free(data);                            
     CContainerDeInit(container);
     
     return retval;
 }
 
+BinaryFile* BinaryFileFromVMFile(const char* fname, int optimize)
+{
+    assert(fname);
+    
+    CommandsContainer* container = CContainerInit();
+	
+	int error = tokenize_file(fname, process_tokens, container);
+	
+	return CContainerFinish(container, error, optimize);
+}
+
+BinaryFile* BinaryFileFromVMBuffer(const char* data, size_t size, int optimize)
+{
+	assert(data);
+	
+	CommandsContainer* container = CContainerInit();
+	
+	int error = tokenize_buffer(data, size, 1, process_tokens, container);
+	
+	return CContainerFinish(container, error, optimize);
+}
+
+//======================================================================
+
+/*! Appends commands and labels of from, label indices in commands
+ * are remapped, so result is the same as if from was assembled
+ * right after to
+ * @param [in, out] to Container of preceding lines
+ * @param [in] from Container of following lines, not linked yet
+ * @return 0 on success, 1 if label is defined in both
+ */
+int CContainerMerge(CommandsContainer* to, CommandsContainer* from)
+{
+	assert(to);
+	assert(from);
+	
+	int base = to->file->ncommands;
+	int error = 0;
+	
+	int* remap = reinterpret_cast<int*>(
+		exiting_malloc((from->lsize + 1) * sizeof(int))
+	);
+	
+	// Labels of from go in their first appearance order, 
+	// so global indices match sequential assembling
+	for (size_t i = 0; i < from->lsize; ++i) {
+		const char* str = from->labels[i].name;
+		int ncommand = from->labels[i].ncommand;
+		if (ncommand >= 0)
+			ncommand += base;
+		
+		size_t lsize = to->lsize;
+		int index = LabelsFind(to, {str, strlen(str)}, ncommand);
+		
+		if (size_t(index) < lsize && ncommand >= 0) {
+			if (to->labels[index].ncommand != -1) {
+				diag_printf("## ERROR: Label %s is defined twice\n", str);
+				
+				error = 1;
+			}
+			
+			to->labels[index].ncommand = ncommand;
+		}
+		
+		remap[i] = index;
+	}
+	
+	for (size_t i = 0; i < BINARY_MAX_REGIONS; ++i) {
+		if (!from->rsizes[i])
+			continue;
+		
+		if (to->rsizes[i]) {
+			diag_printf("## ERROR: Region %s is sized twice\n", get_mem_name(i));
+			
+			error = 1;
+		}
+		
+		to->rsizes[i] = from->rsizes[i];
+	}
+	
+	size_t ncommands = to->file->ncommands + from->file->ncommands;
+	if (ncommands > to->ccapacity)
+		CContainerReserve(to, ncommands);
+	
+	const int jump_id = get_command_id("JUMP");
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+	
+	BinCommand* commands = to->file->commands + to->file->ncommands;
+	for (size_t i = 0; i < from->file->ncommands; ++i) {
+		BinCommand cmd = from->file->commands[i];
+		
+		int id = get_command_id(cmd.type);
+		if (id == jump_id || id == call_id || id == tailcall_id)
+			cmd.arg2 = remap[cmd.arg2];
+		
+		commands[i] = cmd;
+	}
+	to->file->ncommands = ncommands;
+	
+	free(remap);
+	
+	return error;
+}
+
+#ifdef __unix__
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+struct AssembleJob {
+	const char* data;
+	size_t size;
+	
+	size_t nlines;
+	size_t first_line;
+	
+	CommandsContainer* container;
+	int error;
+};
+
+typedef struct AssembleJob AssembleJob;
+
+void* count_lines_job(void* arg)
+{
+	AssembleJob* job = reinterpret_cast<AssembleJob*>(arg);
+	
+	const char* cur = job->data;
+	const char* end = job->data + job->size;
+	
+	for (job->nlines = 0; cur < end; ++job->nlines, ++cur) {
+		cur = reinterpret_cast<const char*>(memchr(cur, '\n', end - cur));
+		if (!cur)
+			break;
+	}
+	
+	return 0;
+}
+
+void* assemble_job(void* arg)
+{
+	AssembleJob* job = reinterpret_cast<AssembleJob*>(arg);
+	
+	job->container = CContainerInit();
+	job->error = tokenize_buffer(	job->data, job->size, job->first_line,
+									process_tokens, job->container);
+	
+	return 0;
+}
+
+// Runs func for every job in its own thread, jobs whose thread
+// can't be created are run by caller
+void run_jobs(AssembleJob* jobs, size_t njobs, void* (*func)(void*))
+{
+	pthread_t* threads = reinterpret_cast<pthread_t*>(
+		exiting_malloc(njobs * sizeof(pthread_t))
+	);
+	
+	size_t started = 0;
+	for (; started < njobs; ++started)
+		if (pthread_create(&threads[started], 0, func, &jobs[started]))
+			break;
+	
+	for (size_t i = 0; i < started; ++i)
+		pthread_join(threads[i], 0);
+	
+	// Not started jobs are done here
+	for (size_t i = started; i < njobs; ++i)
+		func(&jobs[i]);
+	
+	free(threads);
+}
+
+BinaryFile* BinaryFileFromVMFileParallel(const char* fname, int optimize, int njobs)
+{
+	assert(fname);
+	
+	if (njobs <= 1 || strcmp(fname, "-") == 0)
+		return BinaryFileFromVMFile(fname, optimize);
+	
+	// Empty file can't be mapped and has nothing to split
+	struct stat st;
+	if (stat(fname, &st) == 0 && st.st_size == 0)
+		return BinaryFileFromVMFile(fname, optimize);
+	
+	FileData data = map_file(fname);
+	if (!data.ptr)
+		return NULL;
+	
+	const char* text = reinterpret_cast<const char*>(data.ptr);
+	
+	AssembleJob* jobs = reinterpret_cast<AssembleJob*>(
+		exiting_calloc(njobs, sizeof(AssembleJob))
+	);
+	
+	// Chunks of equal size, moved to line boundaries
+	size_t begin = 0;
+	for (int i = 0; i < njobs; ++i) {
+		size_t end = data.size;
+		
+		if (i < njobs - 1) {
+			end = data.size / njobs * (i + 1);
+			if (end < begin)
+				end = begin;
+			
+			const char* newline = reinterpret_cast<const char*>(
+				memchr(text + end, '\n', data.size - end)
+			);
+			end = newline ? newline + 1 - text : data.size;
+		}
+		
+		jobs[i].data = text + begin;
+		jobs[i].size = end - begin;
+		
+		begin = end;
+	}
+	
+	run_jobs(jobs, njobs, count_lines_job);
+	
+	for (int i = 1; i < njobs; ++i)
+		jobs[i].first_line = jobs[i - 1].first_line + jobs[i - 1].nlines;
+	
+	run_jobs(jobs, njobs, assemble_job);
+	
+	CommandsContainer* container = jobs[0].container;
+	int error = jobs[0].error;
+	
+	for (int i = 1; i < njobs; ++i) {
+		if (!error)
+			error = jobs[i].error || CContainerMerge(container, jobs[i].container);
+		
+		free(jobs[i].container->file);
+		CContainerDeInit(jobs[i].container);
+	}
+	
+	free(jobs);
+	unmap_file(data);
+	
+	return CContainerFinish(container, error, optimize);
+}
+
+#else
+
+BinaryFile* BinaryFileFromVMFileParallel(const char* fname, int optimize, int njobs)
+{
+	return BinaryFileFromVMFile(fname, optimize);
+}
+
+#endif
+
+uint32_t BinaryFileChecksum(const BinaryFile* file)
+{
+	assert(file);
+	
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(file);
+	const uint8_t* end = data + file->size;
+	data += file->header_size;
+	
+	// Word at a time, so big files are checked at memory speed
+	uint64_t hash = 0;
+	for (; data + sizeof(uint64_t) <= end; data += sizeof(uint64_t)) {
+		uint64_t word = 0;
+		memcpy(&word, data, sizeof(uint64_t));
+		
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+		hash ^= hash >> 29;
+	}
+	
+	for (; data < end; ++data) {
+		hash = (hash ^ *data) * 0x9E3779B97F4A7C15ull;
+		hash ^= hash >> 29;
+	}
+	
+	return uint32_t(hash ^ (hash >> 32));
+}
+
+// Walks sections after commands, returns 0 if they end exactly
+// at size. Data and size of section with tag are stored to found
+int walk_sections(	const BinaryFile* file, size_t size, uint32_t tag, 
+					const uint8_t** found, size_t* found_size)
+{
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(file);
+	size_t pos = commands_end(file);
+	
+	while (pos < size) {
+		if (size - pos < sizeof(BinarySection))
+			return 1;
+		
+		BinarySection section = {};
+		memcpy(&section, data + pos, sizeof(section));
+		pos += sizeof(section);
+		
+		if (section.size > size - pos)
+			return 1;
+		
+		if (found && section.tag == tag && !*found) {
+			*found = data + pos;
+			*found_size = section.size;
+		}
+		
+		pos += section.size;
+	}
+	
+	return 0;
+}
+
+const void* BinaryFileSection(const BinaryFile* file, uint32_t tag, size_t* size)
+{
+	assert(file);
+	assert(tag);
+	assert(size);
+	
+	const uint8_t* found = 0;
+	
+	if (walk_sections(file, file->size, tag, &found, size))
+		return 0;
+	
+	return found;
+}
+
+LabelEntry* BinaryFileLabels(const BinaryFile* file, size_t* nlabels)
+{
+	assert(file);
+	assert(nlabels);
+	
+	size_t size = 0;
+	const char* data = reinterpret_cast<const char*>(
+		BinaryFileSection(file, SECTION_LABELS, &size)
+	);
+	
+	uint32_t count = 0;
+	if (!data || size < sizeof(count))
+		return 0;
+	
+	const char* end = data + size;
+	memcpy(&count, data, sizeof(count));
+	data += sizeof(count);
+	
+	// Every label takes at least 5 bytes
+	if (count > size)
+		return 0;
+	
+	LabelEntry* retval = reinterpret_cast<LabelEntry*>(
+		exiting_malloc((count + 1) * sizeof(LabelEntry))
+	);
+	
+	for (uint32_t i = 0; i < count; ++i) {
+		int32_t ncommand = 0;
+		if (size_t(end - data) <= sizeof(ncommand)) {
+			free(retval);
+			return 0;
+		}
+		
+		memcpy(&ncommand, data, sizeof(ncommand));
+		data += sizeof(ncommand);
+		
+		size_t len = strnlen(data, end - data);
+		if (len == size_t(end - data) || ncommand < 0 || 
+			uint64_t(ncommand) > file->ncommands) {
+			free(retval);
+			return 0;
+		}
+		
+		retval[i] = {data, ncommand};
+		data += len + 1;
+	}
+	
+	*nlabels = count;
+	
+	return retval;
+}
+
+int BinaryFileRegions(const BinaryFile* file, size_t* sizes, size_t nsizes)
+{
+	assert(file);
+	assert(sizes);
+	
+	size_t size = 0;
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(
+		BinaryFileSection(file, SECTION_MEMORY, &size)
+	);
+	
+	if (!data)
+		return 0;
+	
+	uint32_t count = 0;
+	if (size < sizeof(count))
+		return 1;
+	
+	memcpy(&count, data, sizeof(count));
+	data += sizeof(count);
+	
+	if (size != sizeof(count) + size_t(count) * sizeof(BinaryRegion))
+		return 1;
+	
+	for (uint32_t i = 0; i < count; ++i) {
+		BinaryRegion region = {};
+		memcpy(&region, data + i * sizeof(region), sizeof(region));
+		
+		if (region.mem_id >= nsizes || region.size == 0)
+			return 1;
+		
+		sizes[region.mem_id] = region.size;
+	}
+	
+	return 0;
+}
+
+int BinaryFileCheck(const BinaryFile* file, size_t size)
+{
+	if (!file)
+		return 1;
+	
+	if (size < HEADER_SIZE) {
+		diag_printf("## Error reading binary file: too small\n");
+		
+		return 1;
+	}
+	
+	if (file->magic != BINARY_MAGIC) {
+		diag_printf("## Error reading binary file: not a binary file\n");
+		
+		return 1;
+	}
+	
+	if ((file->version != BINARY_VERSION && 
+		 file->version != BINARY_VERSION_V1) ||
+		file->header_size != HEADER_SIZE ||
+		(file->flags & BINARY_IN_MEMORY)) {
+		diag_printf("## Error reading binary file: unsupported version %u\n",
+				file->version);
+		
+		return 1;
+	}
+	
+	size_t csize = command_size(file->version);
+	
+	if (file->size != size ||
+		file->ncommands > (size - HEADER_SIZE) / csize ||
+		commands_end(file) > size ||
+		walk_sections(file, size, 0, 0, 0)) {
+		diag_printf("## Error reading binary file: size doesn't match\n");
+		
+		return 1;
+	}
+	
+	if (BinaryFileChecksum(file) != file->checksum) {
+		diag_printf("## Error reading binary file: checksum doesn't match\n");
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+BinaryFile* BinaryFileConvert(const BinaryFile* file, int version)
+{
+	assert(file);
+	assert(	version == BINARY_VERSION || 
+			version == BINARY_VERSION_V1);
+	
+	size_t ncommands = file->ncommands;
+	size_t sections = file->size - commands_end(file);
+	size_t size = HEADER_SIZE + ncommands * command_size(version) + sections;
+	
+	BinaryFile* retval = reinterpret_cast<BinaryFile*>(
+		exiting_malloc(size)
+	);
+	
+	memcpy(retval, file, HEADER_SIZE);
+	retval->version = version;
+	retval->flags |= BINARY_IN_MEMORY;
+	retval->size = size;
+	
+	const uint8_t* from = reinterpret_cast<const uint8_t*>(file) + HEADER_SIZE;
+	uint8_t* to = reinterpret_cast<uint8_t*>(retval) + HEADER_SIZE;
+	
+	for (size_t i = 0; i < ncommands; ++i) {
+		BinCommand cmd = {};
+		
+		if (file->version == BINARY_VERSION_V1) {
+			BinCommandV1 old = {};
+			memcpy(&old, from + i * sizeof(BinCommandV1), sizeof(old));
+			
+			cmd = {old.type, old.arg1, 0, old.arg2};
+		}
+		else memcpy(&cmd, from + i * sizeof(BinCommand), sizeof(cmd));
+		
+		if (version == BINARY_VERSION_V1) {
+			BinCommandV1 old = {cmd.type, cmd.arg1, cmd.arg2};
+			memcpy(to + i * sizeof(BinCommandV1), &old, sizeof(old));
+		}
+		else memcpy(to + i * sizeof(BinCommand), &cmd, sizeof(cmd));
+	}
+	
+	memcpy(	to + ncommands * command_size(version), 
+			from + ncommands * command_size(file->version), sections);
+	
+	retval->checksum = BinaryFileChecksum(retval);
+	
+	return retval;
+}
+
+// Commands in memory are always in current version
+inline BinaryFile* to_current_version(BinaryFile* file)
+{
+	if (file->version == BINARY_VERSION)
+		return file;
+	
+	BinaryFile* retval = BinaryFileConvert(file, BINARY_VERSION);
+	BinaryFileUnmap(file);
+	
+	return retval;
+}
+
 BinaryFile* BinaryFileFromBinFile(const char* fname)
 {
 	assert(fname);
@@ -249,31 +1007,107 @@ BinaryFile* BinaryFileFromBinFile(const char* fname)
 	FileData data = read_file_bin(fname);
     BinaryFile* retval = reinterpret_cast<BinaryFile*>(data.ptr);
 	
-    size_t cmds_size = (retval->ncommands - 1) * sizeof(BinCommand);
-	size_t expected = sizeof(BinaryFile) + cmds_size;
-				
-	if (expected != data.size) {
-		printf("## Error reading binary file: size doesn't match\n");
+	if (BinaryFileCheck(retval, data.size)) {
+		free(data.ptr);
 		
-		retval = 0;
+		return 0;
 	}
 	
-	return retval;
+	retval->flags |= BINARY_IN_MEMORY;
+	
+	return to_current_version(retval);
 }
 
-int BinaryFileToFile(BinaryFile* file, const char* fname)
+BinaryFile* BinaryFileFromBuffer(const void* data, size_t size)
+{
+	assert(data);
+	
+	// Copy is aligned for commands
+	BinaryFile* retval = reinterpret_cast<BinaryFile*>(
+		exiting_malloc(size ? size : 1)
+	);
+	memcpy(retval, data, size);
+	
+	if (BinaryFileCheck(retval, size)) {
+		free(retval);
+		
+		return 0;
+	}
+	
+	retval->flags |= BINARY_IN_MEMORY;
+	
+	return to_current_version(retval);
+}
+
+BinaryFile* BinaryFileMap(const char* fname)
 {
-	assert(file);
 	assert(fname);
 	
+	FileData data = map_file(fname);
+	BinaryFile* retval = reinterpret_cast<BinaryFile*>(data.ptr);
+	
+	if (BinaryFileCheck(retval, data.size)) {
+		unmap_file(data);
+		
+		return 0;
+	}
+	
+	return to_current_version(retval);
+}
+
+void BinaryFileUnmap(BinaryFile* file)
+{
+	if (!file)
+		return;
+	
+	if (file->flags & BINARY_IN_MEMORY)
+		free(file);
+	else
+		unmap_file({file, file->size});
+}
+
+// Writes file as is, without in memory flags
+inline int write_binfile(const BinaryFile* file, const char* fname)
+{
 	FILE* fp = exiting_fopen(fname, "w");
 	
-	size_t size = binfile_size(file);
+	BinaryFile header = {};
+	memcpy(&header, file, HEADER_SIZE);
+	header.flags &= ~BINARY_IN_MEMORY;
+	
+	const uint8_t* data = reinterpret_cast<const uint8_t*>(file);
+	size_t size = file->size - HEADER_SIZE;
 	
-	size_t written = fwrite(file, 1, size, fp);
+	size_t written = fwrite(&header, 1, HEADER_SIZE, fp);
+	written += fwrite(data + HEADER_SIZE, 1, size, fp);
 	
 	fclose(fp);
 	
-	return (written != size);
+	return (written != file->size);
 }
 
+int BinaryFileToFile(BinaryFile* file, const char* fname)
+{
+	assert(file);
+	assert(fname);
+	
+	assert(file->size >= commands_end(file));
+	
+	file->checksum = BinaryFileChecksum(file);
+	
+	return write_binfile(file, fname);
+}
+
+int BinaryFileToFileVersion(const BinaryFile* file, const char* fname, int version)
+{
+	assert(file);
+	assert(fname);
+	
+	BinaryFile* converted = BinaryFileConvert(file, version);
+	
+	int error = write_binfile(converted, fname);
+	
+	free(converted);
+	
+	return error;
+}
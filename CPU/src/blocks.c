@@ -0,0 +1,242 @@
+#include <assert.h>
+#include <string.h>
+
+#include "blocks.h"
+
+#include "command.h"
+#include "memory.h"
+#include "exitingalloc.h"
+
+// Ids of commands with known effect, found once
+struct EffectIds {
+	int push, pop, add, sub, mul, div, sqrt, convert;
+	int jump, call, tailcall, ret, snapshot;
+	int vadd, vmul, vdot, vsum, vfill, vcopy;
+	int loadlocal, storelocal, frameenter, frameleave;
+
+	int constant, in, out, in_f64, out_f64;
+	int jump_un;
+};
+
+typedef struct EffectIds EffectIds;
+
+EffectIds make_effect_ids()
+{
+	EffectIds ids = {};
+
+	ids.push = get_command_id("PUSH");
+	ids.pop = get_command_id("POP");
+	ids.add = get_command_id("ADD");
+	ids.sub = get_command_id("SUB");
+	ids.mul = get_command_id("MUL");
+	ids.div = get_command_id("DIV");
+	ids.sqrt = get_command_id("SQRT");
+	ids.convert = get_command_id("CONVERT");
+	ids.jump = get_command_id("JUMP");
+	ids.call = get_command_id("CALL");
+	ids.tailcall = get_command_id("TAILCALL");
+	ids.ret = get_command_id("RETURN");
+	ids.snapshot = get_command_id("SNAPSHOT");
+	ids.vadd = get_command_id("VADD");
+	ids.vmul = get_command_id("VMUL");
+	ids.vdot = get_command_id("VDOT");
+	ids.vsum = get_command_id("VSUM");
+	ids.vfill = get_command_id("VFILL");
+	ids.vcopy = get_command_id("VCOPY");
+	ids.loadlocal = get_command_id("LOADLOCAL");
+	ids.storelocal = get_command_id("STORELOCAL");
+	ids.frameenter = get_command_id("FRAMEENTER");
+	ids.frameleave = get_command_id("FRAMELEAVE");
+
+	ids.constant = get_mem_id("CONSTANT");
+	ids.in = get_mem_id("IN");
+	ids.out = get_mem_id("OUT");
+	ids.in_f64 = get_mem_id("IN_F64");
+	ids.out_f64 = get_mem_id("OUT_F64");
+
+	ids.jump_un = get_jmp_id("UN");
+
+	return ids;
+}
+
+inline int64_t count(int arg)
+{
+	return (arg > 0) ? arg : 0;
+}
+
+int get_command_effect(BinCommand cmd, CommandEffect* effect)
+{
+	assert(effect);
+
+	static const EffectIds ids = make_effect_ids();
+
+	int id = get_command_id(cmd.type);
+	int region = (cmd.arg1 < MEMORY_REGIONS);
+	int index = (cmd.arg2 == -1);
+
+	*effect = {0, 0, BLOCK_NEXT};
+
+	if (id < 0)
+		return 1;
+
+	if (id == ids.push) {
+		if (cmd.arg1 == ids.constant)
+			effect->net = 1;
+		else if (cmd.arg1 == ids.in || cmd.arg1 == ids.in_f64)
+			effect->net = count(cmd.arg2);
+		else if (region)
+			*effect = {index, 1 - index, BLOCK_NEXT};
+		else
+			return 1;
+	}
+	else if (id == ids.pop) {
+		if (cmd.arg1 == ids.out || cmd.arg1 == ids.out_f64)
+			*effect = {count(cmd.arg2), -count(cmd.arg2), BLOCK_NEXT};
+		else if (region)
+			*effect = {1 + index, -1 - index, BLOCK_NEXT};
+		else
+			return 1;
+	}
+	else if (id == ids.add || id == ids.sub || id == ids.mul || id == ids.div)
+		*effect = {2, -1, BLOCK_NEXT};
+	else if (id == ids.sqrt || id == ids.convert)
+		*effect = {1, 0, BLOCK_NEXT};
+	else if (id == ids.jump) {
+		int jmp = get_jmp_id(cmd.arg1);
+		if (jmp < 0)
+			return 1;
+
+		if (jmp == ids.jump_un)
+			effect->flow = BLOCK_JUMP;
+		else
+			*effect = {1, -1, BLOCK_BRANCH};
+	}
+	else if (id == ids.call)
+		effect->flow = BLOCK_CALL;
+	else if (id == ids.tailcall)
+		effect->flow = BLOCK_TAILCALL;
+	else if (id == ids.ret)
+		effect->flow = BLOCK_RETURN;
+	else if (id == ids.vadd || id == ids.vmul)
+		*effect = {4, -4, BLOCK_NEXT};
+	else if (id == ids.vdot)
+		*effect = {3, -2, BLOCK_NEXT};
+	else if (id == ids.vsum)
+		*effect = {2, -1, BLOCK_NEXT};
+	else if (id == ids.vfill || id == ids.vcopy)
+		*effect = {3, -3, BLOCK_NEXT};
+	else if (id == ids.loadlocal)
+		effect->net = 1;
+	else if (id == ids.storelocal)
+		*effect = {1, -1, BLOCK_NEXT};
+	else if (id != ids.snapshot && id != ids.frameenter && id != ids.frameleave)
+		return 1;
+
+	return 0;
+}
+
+//======================================================================
+
+CodeBlocks* BlocksBuild(const BinaryFile* file)
+{
+	assert(file);
+
+	size_t ncommands = file->ncommands;
+
+	CodeBlocks* retval = reinterpret_cast<CodeBlocks*>(
+		exiting_calloc(1, sizeof(CodeBlocks))
+	);
+	retval->effects = reinterpret_cast<CommandEffect*>(
+		exiting_malloc((ncommands + 1) * sizeof(CommandEffect))
+	);
+	retval->block_of = reinterpret_cast<CodeBlock**>(
+		exiting_calloc(ncommands + 1, sizeof(CodeBlock*))
+	);
+
+	// Leaders are marked by non NULL block_of
+	CodeBlock* const leader = reinterpret_cast<CodeBlock*>(1);
+	retval->block_of[0] = leader;
+
+	for (size_t pc = 0; pc < ncommands; ++pc) {
+		BinCommand cmd = file->commands[pc];
+		CommandEffect* effect = retval->effects + pc;
+
+		if (get_command_effect(cmd, effect)) {
+			BlocksDeInit(retval);
+			return 0;
+		}
+
+		if (effect->flow == BLOCK_NEXT)
+			continue;
+
+		retval->block_of[pc + 1] = leader;
+		if (effect->flow == BLOCK_RETURN)
+			continue;
+
+		if (cmd.arg2 < 0 || size_t(cmd.arg2) > ncommands) {
+			BlocksDeInit(retval);
+			return 0;
+		}
+		retval->block_of[cmd.arg2] = leader;
+	}
+
+	size_t nblocks = 0;
+	for (size_t pc = 0; pc < ncommands; ++pc)
+		nblocks += (retval->block_of[pc] != 0);
+
+	retval->blocks = reinterpret_cast<CodeBlock*>(
+		exiting_calloc(nblocks + 1, sizeof(CodeBlock))
+	);
+
+	for (size_t pc = 0; pc < ncommands; ++pc)
+		if (retval->block_of[pc])
+			retval->block_of[pc] = retval->blocks + retval->nblocks++;
+
+	// Halt sentinel is also entered by jumps and calls
+	CodeBlock* halt = retval->blocks + nblocks;
+	halt->start = ncommands;
+	halt->end = ncommands;
+	halt->flow = BLOCK_HALT;
+	retval->block_of[ncommands] = halt;
+
+	for (size_t i = 0; i < nblocks; ++i) {
+		CodeBlock* block = retval->blocks + i;
+		block->start = (i == 0) ? 0 : block[-1].end;
+
+		size_t pc = block->start;
+		do {
+			const CommandEffect* effect = retval->effects + pc;
+
+			if (effect->need - block->net > block->need)
+				block->need = effect->need - block->net;
+			block->net += effect->net;
+			if (block->net > block->peak)
+				block->peak = block->net;
+
+			++pc;
+		} while (!retval->block_of[pc]);
+
+		block->end = pc;
+		block->flow = retval->effects[pc - 1].flow;
+
+		if (block->flow == BLOCK_NEXT || block->flow == BLOCK_BRANCH ||
+			block->flow == BLOCK_CALL)
+			block->next = retval->block_of[pc];
+		if (block->flow != BLOCK_NEXT && block->flow != BLOCK_RETURN)
+			block->target = retval->block_of[file->commands[pc - 1].arg2];
+	}
+
+	return retval;
+}
+
+void BlocksDeInit(CodeBlocks* blocks)
+{
+	if (!blocks)
+		return;
+
+	free(blocks->blocks);
+	free(blocks->block_of);
+	free(blocks->effects);
+
+	free(blocks);
+}
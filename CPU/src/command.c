@@ -1,5 +1,6 @@
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 #include "foreachmacro.h"
@@ -7,6 +8,9 @@
 
 #include "binaryfile.h"
 #include "cpu.h"
+#include "diag.h"
+#include "exitingalloc.h"
+#include "vector.h"
 
 #define SIZE(x) (sizeof(x) / sizeof(0[x]))
 
@@ -14,6 +18,8 @@
 
 #define NAME_STRING(...) EVAL_STRING(GET_1(__VA_ARGS__)),
 
+#define ARGC_COMMA(...) GET_3(__VA_ARGS__),
+
 #define BINARY(...)	GET_2(__VA_ARGS__)
 #define BINARY_COMMA(...) BINARY(__VA_ARGS__),
 
@@ -29,11 +35,19 @@
 #define PROCESSOR_FUNC(...) 										\
 int PROCESSOR_NAME(__VA_ARGS__)	PROCESSOR_FUNC_ARGS					\
 {																	\
-	if (argc != GET_3(__VA_ARGS__)) return 1;						\
-	uint8_t hex = BINARY(__VA_ARGS__);								\
+	if (!argc_matches(argc, GET_3(__VA_ARGS__))) return 1;			\
+	[[maybe_unused]] uint8_t hex = BINARY(__VA_ARGS__);				\
 	PCODE(__VA_ARGS__)												\
 }
 
+inline int argc_matches(size_t argc, size_t need)
+{
+	if (need == ARGC_TYPED)
+		return argc == 1 || argc == 2;
+	
+	return argc == need;
+}
+
 #define EXECUTOR_FUNC(...)											\
 int EXECUTOR_NAME(__VA_ARGS__) EXECUTOR_FUNC_ARGS					\
 {																	\
@@ -42,21 +56,245 @@ int EXECUTOR_NAME(__VA_ARGS__) EXECUTOR_FUNC_ARGS					\
 
 //======================================================================
 
+// Maps every possible byte to its index in binaries table or -1,
+// built at compile time, so decoding is a single indexed load
+struct DecodeTable {
+	int16_t ids[256];
+};
+
+constexpr DecodeTable make_decode_table(const uint8_t* binaries, size_t size)
+{
+	DecodeTable table = {};
+	
+	for (int i = 0; i < 256; ++i)
+		table.ids[i] = -1;
+	
+	for (size_t i = 0; i < size; ++i)
+		table.ids[binaries[i]] = i;
+	
+	return table;
+}
+
+constexpr bool has_collisions(	const uint8_t* binaries, size_t size,
+								const uint8_t* other = 0, size_t osize = 0)
+{
+	for (size_t i = 0; i < size; ++i) {
+		for (size_t j = i + 1; j < size; ++j)
+			if (binaries[i] == binaries[j])
+				return true;
+				
+		for (size_t j = 0; j < osize; ++j)
+			if (binaries[i] == other[j])
+				return true;
+	}
+	
+	return false;
+}
+
+//======================================================================
+
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+#define CMD_ID(...) EVAL_CONCAT(CMD_, GET_1(__VA_ARGS__))
+#define CMD_ID_COMMA(...) CMD_ID(__VA_ARGS__),
+
+#define TARGET_NAME(...) EVAL_CONCAT(target_, GET_1(__VA_ARGS__))
+#define TARGET_ADDR_COMMA(...) && TARGET_NAME(__VA_ARGS__),
+
+// Block entry of execute_verified follows halt in its targets
+#define TARGET_BLOCK (NOT_CMD_ID + 1)
+
+#define EXECUTE_FETCHED(...)									\
+error = EXECUTOR_NAME(__VA_ARGS__)(cpu, fetched->cmd);			\
+if (error) return error;
+
+// Same, but keeps commands left for resumed execution
+#define EXECUTE_BUDGETED(...)									\
+error = EXECUTOR_NAME(__VA_ARGS__)(cpu, fetched->cmd);			\
+if (error) {													\
+	cpu->budget = budget;										\
+	return error;												\
+}
+
+// Direct threading: every decoded command keeps the address of
+// its handler label, so dispatch is a single indirect jump
+#ifdef COMPUTED_GOTO
+
+#define DISPATCH()												\
+fetched = code + cpu->fetcher;									\
+goto *fetched->target;
+
+// Targets of decoded commands are labels of execute_commands,
+// so budgeted loop dispatches through its own table by id
+#define DISPATCH_BUDGETED()										\
+if (__builtin_expect(budget == 0, 0))							\
+	goto target_budget;											\
+--budget;														\
+fetched = code + cpu->fetcher;									\
+goto *targets[fetched->id];
+
+#define TARGET_CODE(...)										\
+TARGET_NAME(__VA_ARGS__):										\
+	EXECUTE_FETCHED(__VA_ARGS__)								\
+	DISPATCH()
+
+#define TARGET_CODE_BUDGETED(...)								\
+TARGET_NAME(__VA_ARGS__):										\
+	EXECUTE_BUDGETED(__VA_ARGS__)								\
+	DISPATCH_BUDGETED()
+
+// Inside of basic block the next command is the next decoded one,
+// only jumps, calls and returns read fetcher
+#define TARGET_CODE_VERIFIED(...)								\
+TARGET_NAME(__VA_ARGS__):										\
+	error = verified::EXECUTOR_NAME(__VA_ARGS__)(cpu, fetched->cmd);\
+	if (error) return error;									\
+	if (CMD_ID(__VA_ARGS__) == CMD_JUMP ||						\
+		CMD_ID(__VA_ARGS__) == CMD_CALL ||						\
+		CMD_ID(__VA_ARGS__) == CMD_TAILCALL ||					\
+		CMD_ID(__VA_ARGS__) == CMD_RETURN)						\
+		fetched = code + cpu->fetcher;							\
+	else														\
+		++fetched;												\
+	goto *fetched->target;
+
+#define DECLARE_DISPATCH(...)									\
+int execute_budgeted(CPU* cpu)									\
+{																\
+	static const void* const targets[] = {						\
+		FOR_EACH(TARGET_ADDR_COMMA, __VA_ARGS__)				\
+		&& target_halt											\
+	};															\
+	const DecodedCommand* code = cpu->decoded;					\
+	const DecodedCommand* fetched = 0;							\
+	uint64_t budget = cpu->budget;								\
+	int error = 0;												\
+	DISPATCH_BUDGETED()											\
+	FOR_EACH(TARGET_CODE_BUDGETED, __VA_ARGS__)					\
+target_halt:													\
+	cpu->budget = budget;										\
+	return 0;													\
+target_budget:													\
+	cpu->budget = 0;											\
+	return CPU_BUDGET;											\
+}																\
+const void* const* verified_targets = 0;						\
+int execute_verified(CPU* cpu)									\
+{																\
+	static const void* const targets[] = {						\
+		FOR_EACH(TARGET_ADDR_COMMA, __VA_ARGS__)				\
+		&& target_halt,											\
+		&& target_block											\
+	};															\
+	if (!cpu) {													\
+		verified_targets = targets;								\
+		return 0;												\
+	}															\
+	const DecodedCommand* code = cpu->decoded;					\
+	const DecodedCommand* fetched = 0;							\
+	int error = 0;												\
+	DISPATCH()													\
+target_block:													\
+	if (__builtin_expect(size_t(cpu->stack.end - cpu->stack.top) <\
+						fetched->reserve, 0)) {					\
+		error = VMStackEnsure(&cpu->stack, fetched->reserve);	\
+		if (error) return error;								\
+	}															\
+	goto *targets[fetched->id];									\
+	FOR_EACH(TARGET_CODE_VERIFIED, __VA_ARGS__)					\
+target_halt:													\
+	return 0;													\
+}																\
+const void* const* dispatch_targets = 0;						\
+int execute_commands(CPU* cpu)									\
+{																\
+	static const void* const targets[] = {						\
+		FOR_EACH(TARGET_ADDR_COMMA, __VA_ARGS__)				\
+		&& target_halt											\
+	};															\
+	if (!cpu) {													\
+		dispatch_targets = targets;								\
+		return execute_verified(0);								\
+	}															\
+	if (cpu->budget != UINT64_MAX)								\
+		return execute_budgeted(cpu);							\
+	if (cpu->verified)											\
+		return execute_verified(cpu);							\
+	const DecodedCommand* code = cpu->decoded;					\
+	const DecodedCommand* fetched = 0;							\
+	int error = 0;												\
+	DISPATCH()													\
+	FOR_EACH(TARGET_CODE, __VA_ARGS__)							\
+target_halt:													\
+	return 0;													\
+}
+
+#else
+
+#define CASE_CODE(...)											\
+case CMD_ID(__VA_ARGS__):										\
+	EXECUTE_BUDGETED(__VA_ARGS__)								\
+	break;
+
+#define DECLARE_DISPATCH(...)									\
+int execute_commands(CPU* cpu)									\
+{																\
+	const DecodedCommand* code = cpu->decoded;					\
+	const DecodedCommand* fetched = 0;							\
+	uint64_t budget = cpu->budget;								\
+	int error = 0;												\
+	for (;; --budget) {											\
+		if (__builtin_expect(budget == 0, 0)) {					\
+			cpu->budget = 0;									\
+			return CPU_BUDGET;									\
+		}														\
+		fetched = code + cpu->fetcher;							\
+		switch (fetched->id) {									\
+			FOR_EACH(CASE_CODE, __VA_ARGS__)					\
+			default:											\
+				cpu->budget = budget;							\
+				return 0;										\
+		}														\
+	}															\
+}
+
+#endif
+
+//======================================================================
+
 #define DECLARE_COMMANDS(...)							\
 FOR_EACH(PROCESSOR_FUNC, __VA_ARGS__)					\
 FOR_EACH(EXECUTOR_FUNC, __VA_ARGS__)					\
+namespace verified {									\
+	FOR_EACH(EXECUTOR_FUNC, __VA_ARGS__)				\
+}														\
 const char* cmd_names[] = {								\
 	FOR_EACH(NAME_STRING, __VA_ARGS__)					\
 };														\
-const uint8_t cmd_binaries[] = {						\
+const size_t cmd_argcs[] = {							\
+	FOR_EACH(ARGC_COMMA, __VA_ARGS__)					\
+};														\
+constexpr uint8_t cmd_binaries[] = {					\
 	FOR_EACH(BINARY_COMMA, __VA_ARGS__)					\
 };														\
+static_assert(	!has_collisions(cmd_binaries, 			\
+								SIZE(cmd_binaries)),	\
+				"Command binaries collision");			\
+constexpr DecodeTable cmd_decode = 						\
+	make_decode_table(cmd_binaries, SIZE(cmd_binaries));\
 int (*cmd_processors[]) PROCESSOR_FUNC_ARGS = {			\
 	FOR_EACH(PROCESSOR_NAME_COMMA, __VA_ARGS__)			\
 };														\
 int (*cmd_executors[]) EXECUTOR_FUNC_ARGS = {			\
 	FOR_EACH(EXECUTOR_NAME_COMMA, __VA_ARGS__)			\
-};
+};														\
+enum CMD_ID {											\
+	FOR_EACH(CMD_ID_COMMA, __VA_ARGS__)					\
+	NOT_CMD_ID											\
+};														\
+DECLARE_DISPATCH(__VA_ARGS__)
 
 //======================================================================
 
@@ -77,18 +315,89 @@ FOR_EACH(JMP_FUNC, __VA_ARGS__)							\
 const char* jmp_names[] = {								\
 	FOR_EACH(NAME_STRING, __VA_ARGS__)					\
 };														\
-const uint8_t jmp_binaries[] = {						\
+constexpr uint8_t jmp_binaries[] = {					\
 	FOR_EACH(BINARY_COMMA, __VA_ARGS__)					\
 };														\
+static_assert(	!has_collisions(jmp_binaries, 			\
+								SIZE(jmp_binaries)),	\
+				"Jump binaries collision");				\
+constexpr DecodeTable jmp_decode = 						\
+	make_decode_table(jmp_binaries, SIZE(jmp_binaries));\
 int (*jmp_func[])JMP_FUNC_ARGS = {						\
 	FOR_EACH(JMP_FUNC_NAME_COMMA, __VA_ARGS__)			\
+};														\
+namespace verified {									\
+	FOR_EACH(JMP_FUNC, __VA_ARGS__)						\
+	int (*jmp_func[])JMP_FUNC_ARGS = {					\
+		FOR_EACH(JMP_FUNC_NAME_COMMA, __VA_ARGS__)		\
+	};													\
+}
+
+//======================================================================
+
+// Executors of code checked by VerifyCode are compiled once more
+// in this namespace, where unqualified calls find versions without
+// checks the verifier has already done. They are function objects,
+// so argument dependent lookup doesn't bring back checked functions.
+// Space for pushes is reserved on entry of every basic block
+namespace verified {
+
+struct StackPush {
+	PS_ERROR operator()(VMStack* stack, stack_el_t elem) const
+	{
+		*stack->top++ = elem;
+		
+		return NO_ERROR;
+	}
+};
+
+struct StackPop {
+	PS_ERROR operator()(VMStack* stack, stack_el_t* elem) const
+	{
+		*elem = *--stack->top;
+		
+		return NO_ERROR;
+	}
 };
 
+// Verified cpu has valid mem ids, indices from stack and registers
+// are checked only if memory is checked
+struct MemorySetter {
+	int operator()(Memory* mem, int mem_id, int64_t offset, stack_el_t val) const
+	{
+		if (mem->checked && (offset < 0 || uint64_t(offset) >= mem->sizes[mem_id]))
+			return MemoryFault(mem, mem_id, offset);
+		
+		mem->bases[mem_id][offset] = val;
+		
+		return 0;
+	}
+};
+
+struct MemoryGetter {
+	int operator()(Memory* mem, int mem_id, int64_t offset, stack_el_t* val) const
+	{
+		if (mem->checked && (offset < 0 || uint64_t(offset) >= mem->sizes[mem_id]))
+			return MemoryFault(mem, mem_id, offset);
+		
+		*val = mem->bases[mem_id][offset];
+		
+		return 0;
+	}
+};
+
+const StackPush VMStackPush = {};
+const StackPop VMStackPop = {};
+const MemorySetter MemorySet = {};
+const MemoryGetter MemoryGet = {};
+
+}
+
 //======================================================================
 
 #define JUMP_IF_OP(OPERATION) 					\
 stack_el_t a = 0;								\
-int error = PStackPop(cpu->stack, &a);			\
+int error = VMStackPop(&cpu->stack, &a);			\
 if (error) return error;						\
 if (a OPERATION 0) cpu->fetcher = cmd.arg2;		\
 else cpu->fetcher++;							\
@@ -106,7 +415,7 @@ DECLARE_JUMPS(
 	JUMP_UN
 }),
 
-(NEQ, 0xFF, {
+(NEQ, 0x99, {
 	JUMP_IF_OP(!=)
 }), 
  
@@ -126,62 +435,269 @@ DECLARE_JUMPS(
 	JUMP_IF_OP(<=)
 }),
 
-(GEQ, 0xEE, {
+(GEQ, 0x88, {
 	JUMP_IF_OP(>=)
 })
 )
 
 //======================================================================
 
-int get_jmp_id(const char *name)
+int get_jmp_id(const char *name, size_t len)
 {
 	assert(name);
 	
 	for (int i = 0; i < SIZE(jmp_names); ++i) {
-		if (strcmp(jmp_names[i], name) == 0)
+		if (strncmp(jmp_names[i], name, len) == 0 && !jmp_names[i][len])
 			return i;
 	}
 	
 	return -1;
 }
 
+int get_jmp_id(const char *name)
+{
+	return get_jmp_id(name, strlen(name));
+}
+
 int get_jmp_id(const uint8_t hex)
 {
-	for (int i = 0; i < SIZE(jmp_binaries); ++i) {
-		if (jmp_binaries[i] == hex)
-			return i;
-	}
+	return jmp_decode.ids[hex];
+}
+
+const char* get_jmp_name(int id)
+{
+	return jmp_names[id];
+}
+
+namespace verified {
+
+inline int get_jmp_id(const uint8_t hex)
+{
+	int id = jmp_decode.ids[hex];
+	if (id < 0)
+		__builtin_unreachable();
 	
-	return -1;
+	return id;
+}
+
 }
 
 //======================================================================
 
-#define POP_PUSH_FUNC(FUNCTION, VAL)			\
-stack_el_t a = 0;								\
-int error = PStackPop(cpu->stack, &a);			\
-if (error) return error;						\
-error = ! VAL(a);								\
-if (error) return error;						\
-return PStackPush(cpu->stack, (int)FUNCTION(a));
+const char* type_names[] = {"I32", "I64", "F64"};
 
-#define POP_PUSH_OP(OPERATION, VAL1, VAL2)		\
-stack_el_t a = 0;								\
-stack_el_t b = 0;								\
-int error = PStackPop(cpu->stack, &a);			\
-if (error) return error;						\
-error = ! VAL1(a);								\
-if (error) return error;						\
-error = PStackPop(cpu->stack, &b);				\
-if (error) return error;						\
-error = ! VAL2(b);								\
-if (error) return error;						\
-return PStackPush(cpu->stack, a OPERATION b);
+inline stack_el_t f64_bits(double val)
+{
+	stack_el_t retval = 0;
+	memcpy(&retval, &val, sizeof(retval));
+	
+	return retval;
+}
+
+inline double bits_f64(stack_el_t val)
+{
+	double retval = 0;
+	memcpy(&retval, &val, sizeof(retval));
+	
+	return retval;
+}
+
+// Integer operations wrap like machine arithmetic, I32 operations
+// are done on sign extended values and truncated
+inline int64_t i64_add(int64_t a, int64_t b)
+{
+	return int64_t(uint64_t(a) + uint64_t(b));
+}
+
+inline int64_t i64_sub(int64_t a, int64_t b)
+{
+	return int64_t(uint64_t(a) - uint64_t(b));
+}
+
+inline int64_t i64_mul(int64_t a, int64_t b)
+{
+	return int64_t(uint64_t(a) * uint64_t(b));
+}
+
+// Minimal value divided by -1 wraps instead of trap
+inline int64_t i64_div(int64_t a, int64_t b)
+{
+	return (b == -1) ? i64_sub(0, a) : a / b;
+}
+
+// Exact floor of square root of non negative value
+inline int64_t i64_sqrt(int64_t a)
+{
+	int64_t root = int64_t(sqrt(double(a)));
+	
+	while (root > 0 && root > a / root)
+		--root;
+	while (root + 1 <= a / (root + 1))
+		++root;
+	
+	return root;
+}
+
+// Pops a, pushes FUNCTION of it in type of arg1. Integer
+// argument is checked by VAL, F64 follows IEEE 754
+#define TYPED_FUNC(FUNCTION, VAL)								\
+stack_el_t a = 0;												\
+int error = VMStackPop(&cpu->stack, &a);						\
+if (error) return error;										\
+switch (cmd.arg1) {												\
+	case TYPE_I32:												\
+		if (!VAL(int32_t(a))) return 1;							\
+		a = int32_t(EVAL_CONCAT(i64_, FUNCTION)(int32_t(a)));	\
+		break;													\
+	case TYPE_I64:												\
+		if (!VAL(a)) return 1;									\
+		a = EVAL_CONCAT(i64_, FUNCTION)(a);						\
+		break;													\
+	case TYPE_F64:												\
+		a = f64_bits(FUNCTION(bits_f64(a)));					\
+		break;													\
+	default:													\
+		return 1;												\
+}																\
+return VMStackPush(&cpu->stack, a);
+
+// Pops a and b, pushes a OPERATION b in type of arg1. Integer
+// b is checked by VAL, F64 follows IEEE 754
+#define TYPED_OP(FUNCTION, OPERATION, VAL)						\
+stack_el_t a = 0;												\
+stack_el_t b = 0;												\
+int error = VMStackPop(&cpu->stack, &a);						\
+if (error) return error;										\
+error = VMStackPop(&cpu->stack, &b);							\
+if (error) return error;										\
+switch (cmd.arg1) {												\
+	case TYPE_I32:												\
+		if (!VAL(int32_t(b))) return 1;							\
+		a = int32_t(EVAL_CONCAT(i64_, FUNCTION)(int32_t(a), 	\
+												int32_t(b)));	\
+		break;													\
+	case TYPE_I64:												\
+		if (!VAL(b)) return 1;									\
+		a = EVAL_CONCAT(i64_, FUNCTION)(a, b);					\
+		break;													\
+	case TYPE_F64:												\
+		a = f64_bits(bits_f64(a) OPERATION bits_f64(b));		\
+		break;													\
+	default:													\
+		return 1;												\
+}																\
+return VMStackPush(&cpu->stack, a);
+
+// Converts value of type from to type to, F64 is truncated 
+// to integer and must fit it
+inline int convert(stack_el_t* val, int from, int to)
+{
+	if (from == TYPE_F64 && to != TYPE_F64) {
+		double x = bits_f64(*val);
+		double limit = (to == TYPE_I32) ? 2147483648.0 : 9223372036854775808.0;
+		
+		// NaN fails both comparisons
+		if (!(x > -limit - 1 && x < limit))
+			return 1;
+		
+		*val = int64_t(x);
+	}
+	else if (from != TYPE_F64 && to == TYPE_F64) {
+		int64_t x = (from == TYPE_I32) ? int32_t(*val) : *val;
+		
+		*val = f64_bits(double(x));
+	}
+	
+	if (to == TYPE_I32)
+		*val = int32_t(*val);
+	
+	return 0;
+}
 
 #define PUT_CMD 						\
-BinCommand cmd = {hex, 0, 0};			\
+BinCommand cmd = {hex, 0, 0, 0};		\
 return CContainerAdd(container, cmd);
 
+#define PUT_TYPED_CMD											\
+int type = TYPE_I32;											\
+if (argc == 2) type = get_type_id(args[1].ptr, args[1].len);	\
+if (type < 0) return 1;											\
+BinCommand cmd = {hex, uint8_t(type), 0, 0};					\
+return CContainerAdd(container, cmd);
+
+#define PUT_REG_CMD								\
+int reg = 0;									\
+int offset = 0;									\
+if (token_to_int(args[1], &reg) ||				\
+	token_to_int(args[2], &offset)) return 1;	\
+if (reg < 0 || reg > UINT8_MAX) return 1;		\
+BinCommand cmd = {hex, uint8_t(reg), 0, offset};\
+return CContainerAdd(container, cmd);
+
+// Value of base register in arg1, on success error is 0
+#define GET_BASE_REG(base)						\
+stack_el_t base = 0;							\
+int error = MemoryGet(cpu->memory, mem_register,\
+						cmd.arg1, &base);		\
+if (error) return error;
+
+//======================================================================
+
+// Executors must not look memory ids up by names every time
+static const int mem_constant = get_mem_id("CONSTANT");
+static const int mem_in = get_mem_id("IN");
+static const int mem_out = get_mem_id("OUT");
+static const int mem_in_f64 = get_mem_id("IN_F64");
+static const int mem_out_f64 = get_mem_id("OUT_F64");
+static const int mem_register = get_mem_id("REGISTER");
+static const int mem_local = get_mem_id("LOCAL");
+static const int mem_memory = get_mem_id("MEMORY");
+
+//======================================================================
+
+/*! Pops length and then count offsets of ranges in MEMORY,
+ * so offsets are pushed in order of operands and length is the last
+ * @param [out] ranges Bases of ranges
+ * @param [out] n Length of ranges
+ * @return 0 if all ranges are inside MEMORY
+ */
+int pop_ranges(CPU* cpu, stack_el_t** ranges, int count, size_t* n)
+{
+	stack_el_t len = 0;
+	int error = VMStackPop(&cpu->stack, &len);
+	if (error) return error;
+	
+	size_t size = cpu->memory->sizes[mem_memory];
+	if (len < 0 || uint64_t(len) > size)
+		return MemoryFault(cpu->memory, mem_memory, len);
+	
+	for (int i = count - 1; i >= 0; --i) {
+		stack_el_t offset = 0;
+		error = VMStackPop(&cpu->stack, &offset);
+		if (error) return error;
+		
+		// Offset of the first element outside is reported
+		if (offset < 0 || uint64_t(offset) > size - len)
+			return MemoryFault(cpu->memory, mem_memory, 
+								(offset < 0) ? offset : int64_t(size));
+		
+		ranges[i] = MemoryRegion(cpu->memory, mem_memory) + offset;
+	}
+	
+	*n = len;
+	
+	return 0;
+}
+
+#define POP_RANGES(count)									\
+stack_el_t* ranges[count] = {};								\
+size_t n = 0;												\
+int error = pop_ranges(cpu, ranges, count, &n);				\
+if (error) return error;
+
+#define CHECK_TYPE \
+if (cmd.arg1 >= get_not_type_id()) return 1;
+
 //======================================================================
 
 #define NOVAL(x) 1
@@ -194,48 +710,71 @@ return CContainerAdd(container, cmd);
 
 DECLARE_COMMANDS(
 
-(SQRT, 0xAC, 1,	
+(SQRT, 0xAC, ARGC_TYPED,	
 ({
-	PUT_CMD
+	PUT_TYPED_CMD
 }),	
 ({
 	cpu->fetcher++;
-	POP_PUSH_FUNC(sqrt, NONNEG)
+	TYPED_FUNC(sqrt, NONNEG)
 })),	
 
+(CONVERT, 0xAD, 3,
+({
+	int from = get_type_id(args[1].ptr, args[1].len);
+	int to = get_type_id(args[2].ptr, args[2].len);
+	if (from < 0 || to < 0) return 1;
+	BinCommand cmd = {hex, uint8_t(from), 0, to};
+	return CContainerAdd(container, cmd);
+}),
+({
+	cpu->fetcher++;
+	if (cmd.arg1 >= get_not_type_id() || 
+		cmd.arg2 < 0 || cmd.arg2 >= get_not_type_id()) return 1;
+	stack_el_t val = 0;
+	int error = VMStackPop(&cpu->stack, &val);
+	if (error) return error;
+	if (convert(&val, cmd.arg1, cmd.arg2)) return 1;
+	return VMStackPush(&cpu->stack, val);
+})),
+
 (PUSH, 0xFA, 3, 	
 ({
-	int mem_id = get_mem_id(args[1]);
-	if (mem_id >= get_not_mem_id() &&
-		mem_id != get_mem_id("CONSTANT") &&
-		mem_id != get_mem_id("IN")) return 1;
+	int mem_id = get_mem_id(args[1].ptr, args[1].len);
+	if (mem_id < 0 || 
+		(mem_id >= get_not_mem_id() &&
+		 mem_id != mem_constant &&
+		 mem_id != mem_in &&
+		 mem_id != mem_in_f64)) return 1;
 		
-	int arg2 = strcmp(args[2], GET_1 INDEX ) ? 
-				atoi(args[2]) : GET_2 INDEX ;
+	int arg2 = GET_2 INDEX ;
+	if (!token_equals(args[2], GET_1 INDEX ) && 
+		token_to_int(args[2], &arg2)) return 1;
 				
 	// TODO something to not convert mem_id
-	BinCommand cmd = {hex, uint8_t(mem_id), arg2}; 
+	BinCommand cmd = {hex, uint8_t(mem_id), 0, arg2};
 	return CContainerAdd(container, cmd);
 }), 
 ({
 	cpu->fetcher++;
-	if (cmd.arg1 == get_mem_id("CONSTANT")) {
-		return PStackPush(cpu->stack, cmd.arg2);
+	if (cmd.arg1 == mem_constant) {
+		return VMStackPush(&cpu->stack, cmd.arg2);
 	}
-	else if (cmd.arg1 == get_mem_id("IN")) {
+	else if (cmd.arg1 == mem_in || cmd.arg1 == mem_in_f64) {
 		int error = 0;
 		stack_el_t val = 0;
 		for (int i = 0; i < cmd.arg2; ++i) {
-			if (!scanf("%d", &val)) return 1;
-			error = PStackPush(cpu->stack, val);
+			if ((cmd.arg1 == mem_in) ? 	VMIORead(&cpu->io, &val) :
+										VMIOReadF64(&cpu->io, &val)) return 1;
+			error = VMStackPush(&cpu->stack, val);
 			if (error) return error;
 		}
 		return error;
 	}
 	
-	int index = 0;
+	stack_el_t index = 0;
 	if (cmd.arg2 == GET_2 INDEX ) {
-		int error = PStackPop(cpu->stack, &index);
+		int error = VMStackPop(&cpu->stack, &index);
 		if (error) return error;
 	}
 	else {
@@ -245,39 +784,43 @@ DECLARE_COMMANDS(
 	stack_el_t val = 0;
 	int error = MemoryGet(cpu->memory, cmd.arg1, index, &val);
 	if (error) return error;
-	return PStackPush(cpu->stack, val);
+	return VMStackPush(&cpu->stack, val);
 })), 
 
 (POP, 0xFB, 3, 	
 ({
-	int mem_id = get_mem_id(args[1]);
-	if (mem_id >= get_not_mem_id() &&
-		mem_id != get_mem_id("OUT")) return 1;
+	int mem_id = get_mem_id(args[1].ptr, args[1].len);
+	if (mem_id < 0 || 
+		(mem_id >= get_not_mem_id() &&
+		 mem_id != mem_out &&
+		 mem_id != mem_out_f64)) return 1;
 	
 	// Bad thing for INDEX support
-	int arg2 = strcmp(args[2], GET_1 INDEX ) ? 
-				atoi(args[2]) : GET_2 INDEX ;
+	int arg2 = GET_2 INDEX ;
+	if (!token_equals(args[2], GET_1 INDEX ) && 
+		token_to_int(args[2], &arg2)) return 1;
 				
 	// TODO something to not convert mem_id
-	BinCommand cmd = {hex, uint8_t(mem_id), arg2};
+	BinCommand cmd = {hex, uint8_t(mem_id), 0, arg2};
 	return CContainerAdd(container, cmd);
 }),	
 ({
 	cpu->fetcher++;
-	if (cmd.arg1 == get_mem_id("OUT")) {
+	if (cmd.arg1 == mem_out || cmd.arg1 == mem_out_f64) {
 		stack_el_t val = 0;
 		int error = 0;
 		for (int i = 0; i < cmd.arg2; ++i) {
-			error = PStackPop(cpu->stack, &val);
+			error = VMStackPop(&cpu->stack, &val);
 			if (error) return error;
-			if (!printf("%d\n", val)) return 1;
+			if ((cmd.arg1 == mem_out) ? VMIOWrite(&cpu->io, val) :
+										VMIOWriteF64(&cpu->io, val)) return 1;
 		}
 		return error;
 	}
 	
-	int index = 0;
+	stack_el_t index = 0;
 	if (cmd.arg2 == GET_2 INDEX ) {
-		int error = PStackPop(cpu->stack, &index);
+		int error = VMStackPop(&cpu->stack, &index);
 		if (error) return error;
 	}
 	else {
@@ -285,45 +828,45 @@ DECLARE_COMMANDS(
 	}
 	
 	stack_el_t val = 0;
-	int error = PStackPop(cpu->stack, &val);
+	int error = VMStackPop(&cpu->stack, &val);
 	if (error) return error;
 	return MemorySet(cpu->memory, cmd.arg1, index, val);
 })),
 
-(MUL, 0xFC, 1,	
+(MUL, 0xFC, ARGC_TYPED,	
 ({
-	PUT_CMD
+	PUT_TYPED_CMD
 }),	
 ({
 	cpu->fetcher++;
-	POP_PUSH_OP(*, NOVAL, NOVAL)
+	TYPED_OP(mul, *, NOVAL)
 })),
 
-(DIV, 0xFD, 1,	
+(DIV, 0xFD, ARGC_TYPED,	
 ({
-	PUT_CMD
+	PUT_TYPED_CMD
 }),	
 ({
 	cpu->fetcher++;
-	POP_PUSH_OP(/, NOVAL, NOTNULL)
+	TYPED_OP(div, /, NOTNULL)
 })),
 
-(ADD, 0xFE, 1,	
+(ADD, 0xFE, ARGC_TYPED,	
 ({
-	PUT_CMD
+	PUT_TYPED_CMD
 }),	
 ({
 	cpu->fetcher++;
-	POP_PUSH_OP(+, NOVAL, NOVAL)
+	TYPED_OP(add, +, NOVAL)
 })),
 
-(SUB, 0xFF, 1,	
+(SUB, 0xFF, ARGC_TYPED,	
 ({
-	PUT_CMD
+	PUT_TYPED_CMD
 }),	
 ({
 	cpu->fetcher++;
-	POP_PUSH_OP(-, NOVAL, NOVAL)
+	TYPED_OP(sub, -, NOVAL)
 })),
 
 (LABEL, 0x00, 2, 	
@@ -340,11 +883,12 @@ DECLARE_COMMANDS(
 
 (JUMP, 0xC1, 3, 	
 ({ 
-	int id = get_jmp_id(args[1]);
+	int id = get_jmp_id(args[1].ptr, args[1].len);
 	if (id < 0) return 1; 
 	BinCommand cmd = {
 				hex,
 				jmp_binaries[id],
+				0,
 				CContainerLabelGet(container, args[2])
 				};
 	return CContainerAdd(container, cmd);
@@ -360,52 +904,219 @@ DECLARE_COMMANDS(
 	BinCommand cmd = {
 				hex,
 				0,
+				0,
 				CContainerLabelGet(container, args[1])
 				};
 	return CContainerAdd(container, cmd);
 }), 
 ({
-	int error = PStackPush(cpu->rstack, cpu->fetcher);
+	// Depth of calls isn't known before, return stack is always checked
+	int error = ::VMStackPush(&cpu->rstack, cpu->fetcher);
 	if (error) return error;
 	cpu->fetcher = cmd.arg2;
 	return 0;
 })),
 
+// CALL followed by RETURN, callee returns to caller of this function
+(TAILCALL, 0xC5, 2,
+({
+	BinCommand cmd = {
+				hex,
+				0,
+				0,
+				CContainerLabelGet(container, args[1])
+				};
+	return CContainerAdd(container, cmd);
+}),
+({
+	cpu->fetcher = cmd.arg2;
+	return 0;
+})),
+
 (RETURN, 0xC3, 1, 	
 ({
 	PUT_CMD
 }), 
 ({
-	int tmp = 0;
-	int error = PStackPop(cpu->rstack, &tmp);
+	stack_el_t tmp = 0;
+	int error = VMStackPop(&cpu->rstack, &tmp);
 	if (error) return error;
 	cpu->fetcher = tmp + 1;
 	return 0;
+})),
+
+(SNAPSHOT, 0xC4, 1,
+({
+	PUT_CMD
+}),
+({
+	cpu->fetcher++;
+	return CPU_SNAPSHOT;
+})),
+
+// Vector commands on ranges of MEMORY. Offsets of ranges and length
+// are taken from stack, length is on top:
+//	VADD, VMUL	dst a b n
+//	VDOT		a b n -> sum
+//	VSUM		a n -> sum
+//	VFILL		val dst n
+//	VCOPY		dst src n
+
+(VADD, 0xB1, ARGC_TYPED,
+({
+	PUT_TYPED_CMD
+}),
+({
+	cpu->fetcher++;
+	CHECK_TYPE
+	POP_RANGES(3)
+	VectorAdd(cmd.arg1, ranges[0], ranges[1], ranges[2], n);
+	return 0;
+})),
+
+(VMUL, 0xB2, ARGC_TYPED,
+({
+	PUT_TYPED_CMD
+}),
+({
+	cpu->fetcher++;
+	CHECK_TYPE
+	POP_RANGES(3)
+	VectorMul(cmd.arg1, ranges[0], ranges[1], ranges[2], n);
+	return 0;
+})),
+
+(VDOT, 0xB3, ARGC_TYPED,
+({
+	PUT_TYPED_CMD
+}),
+({
+	cpu->fetcher++;
+	CHECK_TYPE
+	POP_RANGES(2)
+	return VMStackPush(&cpu->stack, VectorDot(cmd.arg1, ranges[0], ranges[1], n));
+})),
+
+(VSUM, 0xB4, ARGC_TYPED,
+({
+	PUT_TYPED_CMD
+}),
+({
+	cpu->fetcher++;
+	CHECK_TYPE
+	POP_RANGES(1)
+	return VMStackPush(&cpu->stack, VectorSum(cmd.arg1, ranges[0], n));
+})),
+
+(VFILL, 0xB5, 1,
+({
+	PUT_CMD
+}),
+({
+	cpu->fetcher++;
+	POP_RANGES(1)
+	stack_el_t val = 0;
+	error = VMStackPop(&cpu->stack, &val);
+	if (error) return error;
+	VectorFill(ranges[0], val, n);
+	return 0;
+})),
+
+(VCOPY, 0xB6, 1,
+({
+	PUT_CMD
+}),
+({
+	cpu->fetcher++;
+	POP_RANGES(2)
+	VectorCopy(ranges[0], ranges[1], n);
+	return 0;
+})),
+
+// Superinstructions produced by optimizer, 
+// base register index is in arg1
+
+(LOADLOCAL, 0xD1, 3,
+({
+	PUT_REG_CMD
+}),
+({
+	cpu->fetcher++;
+	GET_BASE_REG(base)
+	stack_el_t val = 0;
+	error = MemoryGet(cpu->memory, mem_local, base + cmd.arg2, &val);
+	if (error) return error;
+	return VMStackPush(&cpu->stack, val);
+})),
+
+(STORELOCAL, 0xD2, 3,
+({
+	PUT_REG_CMD
+}),
+({
+	cpu->fetcher++;
+	GET_BASE_REG(base)
+	stack_el_t val = 0;
+	error = VMStackPop(&cpu->stack, &val);
+	if (error) return error;
+	return MemorySet(cpu->memory, mem_local, base + cmd.arg2, val);
+})),
+
+(FRAMEENTER, 0xD3, 3,
+({
+	PUT_REG_CMD
+}),
+({
+	cpu->fetcher++;
+	GET_BASE_REG(base)
+	// Fused ADD is I32
+	return MemorySet(cpu->memory, mem_register, cmd.arg1, 
+					int32_t(uint32_t(base) + uint32_t(cmd.arg2)));
+})),
+
+(FRAMELEAVE, 0xD4, 3,
+({
+	PUT_REG_CMD
+}),
+({
+	cpu->fetcher++;
+	GET_BASE_REG(base)
+	// Fused SUB is I32
+	return MemorySet(cpu->memory, mem_register, cmd.arg1, 
+					int32_t(uint32_t(base) - uint32_t(cmd.arg2)));
 }))
 )
 
 //======================================================================
 
-int get_command_id(const char *name)
+// Jump conditions are stored in arg1, not in type, but keeping
+// them apart makes any byte of code unambiguous
+static_assert(	!has_collisions(cmd_binaries, SIZE(cmd_binaries),
+								jmp_binaries, SIZE(jmp_binaries)),
+				"Command and jump binaries collision");
+
+//======================================================================
+
+int get_command_id(const char *name, size_t len)
 {
 	assert(name);
 	
 	for (int i = 0; i < SIZE(cmd_names); ++i) {
-		if (strcmp(cmd_names[i], name) == 0)
+		if (strncmp(cmd_names[i], name, len) == 0 && !cmd_names[i][len])
 			return i;
 	}
 	
 	return -1;
 }
 
+int get_command_id(const char *name)
+{
+	return get_command_id(name, strlen(name));
+}
+
 int get_command_id(const uint8_t hex)
 {
-	for (int i = 0; i < SIZE(cmd_binaries); ++i) {
-		if (cmd_binaries[i] == hex)
-			return i;
-	}
-	
-	return -1;
+	return cmd_decode.ids[hex];
 }
 
 int (*get_processor(int id)) PROCESSOR_FUNC_ARGS
@@ -418,14 +1129,127 @@ int (*get_executor(int id)) EXECUTOR_FUNC_ARGS
 	return cmd_executors[id];
 }
 
+int get_not_command_id()
+{
+	return NOT_CMD_ID;
+}
+
 const char* get_command_name(int id)
 {
 	return cmd_names[id];
 }
 
+int get_type_id(const char* name, size_t len)
+{
+	assert(name);
+	
+	for (int i = 0; i < SIZE(type_names); ++i)
+		if (strncmp(type_names[i], name, len) == 0 && !type_names[i][len])
+			return i;
+	
+	return -1;
+}
+
+const char* get_type_name(int type)
+{
+	return type_names[type];
+}
+
+int get_not_type_id()
+{
+	return SIZE(type_names);
+}
+
+size_t get_command_argc(int id)
+{
+	return cmd_argcs[id];
+}
+
 uint8_t get_command_binary(int id)
 {
     return cmd_binaries[id];
 }
 
+DecodedCommand* decode_commands(const BinaryFile* file, const CodeBlocks* blocks)
+{
+	assert(file);
+	
+#ifdef COMPUTED_GOTO
+	// Static initialization is thread safe, so cpus can be
+	// created concurrently
+	static const int targets_ready = execute_commands(0);
+	(void)targets_ready;
+#endif
+	
+	size_t ncommands = file->ncommands;
+	
+	// One more command for halt sentinel, so there is
+	// no need to check fetcher on every dispatch
+	DecodedCommand* retval = reinterpret_cast<DecodedCommand*>(
+		exiting_malloc((ncommands + 1) * sizeof(DecodedCommand))
+	);
+	
+	for (size_t i = 0; i < ncommands; ++i) {
+		BinCommand cmd = file->commands[i];
+		int id = get_command_id(cmd.type);
+		
+		if (id < 0) {
+			diag_printf("## Error: unknown command on %lu\n", i);
+			
+			free(retval);
+			return 0;
+		}
+		
+		if ((id == CMD_JUMP || id == CMD_CALL || id == CMD_TAILCALL) &&
+			(cmd.arg2 < 0 || size_t(cmd.arg2) > ncommands)) {
+			diag_printf("## Error: bad address on %lu\n", i);
+			
+			free(retval);
+			return 0;
+		}
+		
+		retval[i].id = id;
+		retval[i].cmd = cmd;
+	}
+	
+	retval[ncommands].id = NOT_CMD_ID;
+	retval[ncommands].cmd = {0, 0, 0, 0};
+	
+	set_dispatch(retval, ncommands, blocks);
+	
+	return retval;
+}
+
+void set_dispatch(DecodedCommand* code, size_t ncommands, const CodeBlocks* blocks)
+{
+	assert(code);
+	
+	for (size_t i = 0; i <= ncommands; ++i) {
+		code[i].reserve = 0;
+#ifdef COMPUTED_GOTO
+		code[i].target = blocks ? 	verified_targets[code[i].id] :
+									dispatch_targets[code[i].id];
+#else
+		code[i].target = 0;
+#endif
+	}
+	
+#ifdef COMPUTED_GOTO
+	if (!blocks)
+		return;
+	
+	// Blocks that push go through capacity check first
+	for (size_t i = 0; i < blocks->nblocks; ++i) {
+		const CodeBlock* block = blocks->blocks + i;
+		if (block->peak == 0)
+			continue;
+		
+		// Too many elements fail on reservation anyway
+		code[block->start].reserve = (block->peak < UINT32_MAX) ? 
+										uint32_t(block->peak) : UINT32_MAX;
+		code[block->start].target = verified_targets[TARGET_BLOCK];
+	}
+#endif
+}
+
 //======================================================================
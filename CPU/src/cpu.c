@@ -1,75 +1,246 @@
 #include <assert.h>
+#include <unistd.h>
 
 #include "cpu.h"
 
 #include "command.h"
+#include "jit.h"
+#include "profiler.h"
+#include "trace.h"
+#include "verifier.h"
+#include "diag.h"
 #include "exitingalloc.h"
 
 #define INITIAL_SIZE (128)
+#define DEFAULT_MAX_DEPTH (1 << 24)
 
-CPU* CPUInit(BinaryFile* code)
+void CPUConfigInit(CPUConfig* config)
+{
+	assert(config);
+	
+	config->checked = 0;
+	config->max_depth = DEFAULT_MAX_DEPTH;
+	config->jit = 0;
+	config->profile = 0;
+	config->trace = 0;
+	config->verify = 1;
+	config->check_memory = 1;
+	config->in_format = VMIO_TEXT;
+	config->out_format = VMIO_TEXT;
+	config->in_fd = STDIN_FILENO;
+	config->out_fd = STDOUT_FILENO;
+}
+
+CPUCode* CPUCodeInit(const BinaryFile* file, const CPUConfig* config)
+{
+	assert(file);
+	assert(config);
+	
+	CPUCode* retval = reinterpret_cast<CPUCode*>(
+						exiting_malloc(sizeof(CPUCode))
+					);
+	
+	retval->file = file;
+	
+	// Sizes of regions not set by code are default
+	for (int i = 0; i < MEMORY_REGIONS; ++i)
+		retval->sizes[i] = get_mem_default_size(i);
+	
+	if (BinaryFileRegions(file, retval->sizes, MEMORY_REGIONS)) {
+		diag_printf("## Error: bad memory section\n");
+		
+		free(retval);
+		return 0;
+	}
+	
+	// Static indices are checked once for any code, so only indices
+	// from stack and registers may be out of regions
+	int dynamic = 0;
+	if (VerifyIndices(file, retval->sizes, &dynamic)) {
+		free(retval);
+		return 0;
+	}
+	
+	retval->blocks = 0;
+	if (config->verify && !config->checked)
+		retval->blocks = BlocksBuild(file);
+	
+	retval->verified = retval->blocks && 
+						VerifyCode(file, retval->blocks, retval->sizes, 0) == 0;
+	if (!retval->verified) {
+		BlocksDeInit(retval->blocks);
+		retval->blocks = 0;
+	}
+	
+	retval->decoded = decode_commands(file, retval->blocks);
+	if (!retval->decoded) {
+		diag_printf("## Error: failed to decode code\n");
+		
+		BlocksDeInit(retval->blocks);
+		free(retval);
+		return 0;
+	}
+	
+	// Code that is not verified or has dynamic indices runs with
+	// checked memory
+	retval->check_memory = config->checked || !retval->verified || 
+							(config->check_memory && dynamic);
+	
+	retval->jit = 0;
+	if (config->jit && !config->checked && !config->profile && 
+		!config->trace) {
+		retval->jit = JitCompile(retval->decoded, file->ncommands, 
+								retval->check_memory);
+		if (!retval->jit)
+			diag_printf("## Warning: jit is not available, interpreting\n");
+	}
+	
+	return retval;
+}
+
+void CPUCodeDeInit(CPUCode* code)
 {
 	assert(code);
 	
+	JitDeInit(code->jit);
+	free(code->decoded);
+	BlocksDeInit(code->blocks);
+	
+	free(code);
+}
+
+CPU* CPUInitShared(const CPUCode* code, const CPUConfig* config)
+{
+	assert(code);
+	assert(config);
+	
 	CPU* retval = reinterpret_cast<CPU*>(
 						exiting_malloc(sizeof(CPU))
 					);
 	
 	retval->fetcher = 0;
-	retval->code = code;
-	
-	retval->stack = reinterpret_cast<PStack_t*>(
-						exiting_malloc(sizeof(PStack_t))
-					);
+	retval->budget = UINT64_MAX;
+	retval->code = code->file;
+	retval->decoded = code->decoded;
+	retval->verified = code->verified;
+	retval->own_code = 0;
 	
-	PS_ERROR error = PStackInitMACRO(retval->stack, INITIAL_SIZE);
+	PS_ERROR error = VMStackInit(&retval->stack, INITIAL_SIZE, 
+								config->max_depth, config->checked);
 	if (error != NO_ERROR) {
-		printf("## Error: failed to init stack\n");
+		diag_printf("## Error: failed to init stack\n");
 		
-		free(retval->stack);
 		free(retval);
-		retval = 0;
+		return 0;
 	}
 	
-	retval->rstack = reinterpret_cast<PStack_t*>(
-						exiting_malloc(sizeof(PStack_t))
-					);
-	
-	error = PStackInitMACRO(retval->rstack, INITIAL_SIZE);
+	error = VMStackInit(&retval->rstack, INITIAL_SIZE, 
+						config->max_depth, config->checked);
 	if (error != NO_ERROR) {
-		printf("## Error: failed to init stack\n");
+		diag_printf("## Error: failed to init stack\n");
 		
-		free(retval->stack);
-		free(retval->rstack);
+		VMStackDeInit(&retval->stack);
+		free(retval);
+		return 0;
+	}
+	
+	retval->memory = MemoryInit(code->sizes, config->checked || 
+								code->check_memory);
+	if (!retval->memory) {
+		VMStackDeInit(&retval->stack);
+		VMStackDeInit(&retval->rstack);
 		free(retval);
-		retval = 0;
+		return 0;
 	}
 	
-	retval->memory = MemoryInit();
+	VMIOInit(&retval->io, config->in_fd, config->in_format, 
+			config->out_fd, config->out_format);
+	
+	retval->profile = 0;
+	if (config->profile)
+		retval->profile = ProfileInit(code->file);
+	
+	// Checked, profiled and traced cpus interpret shared code
+	retval->jit = 0;
+	if (!config->checked && !config->profile && !config->trace)
+		retval->jit = code->jit;
+	
+	retval->trace = 0;
+	if (config->trace && !config->profile) {
+		retval->trace = TraceInit(code->file, config->trace);
+		if (!retval->trace) {
+			CPUDeInit(retval);
+			return 0;
+		}
+	}
 	
 	return retval;
 }
 
-int CPUExecute(CPU* cpu)
+CPU* CPUInit(const BinaryFile* code, const CPUConfig* config)
 {
-	while (cpu->fetcher < cpu->code->ncommands) {
-		BinCommand cmd = cpu->code->commands[cpu->fetcher];
-		int id = get_command_id(cmd.type);
-		
-		if (id < 0) {
-			printf("## Error: unknown command\n");
-			
-			return 1;
-		}
-		
-		//printf("## \t%s:\t%d\t%d\n", get_command_name(id), cmd.arg1, cmd.arg2);
-		
-		int error = get_executor(id)(cpu, cmd);
-		
-		if (error) return error;
+	assert(code);
+	assert(config);
+	
+	CPUCode* own_code = CPUCodeInit(code, config);
+	if (!own_code)
+		return 0;
+	
+	CPU* retval = CPUInitShared(own_code, config);
+	if (!retval) {
+		CPUCodeDeInit(own_code);
+		return 0;
 	}
 	
-	return 0;
+	retval->own_code = own_code;
+	
+	return retval;
+}
+
+// Failed push or reserve is reported with its stack and depth
+int report_overflow(const CPU* cpu, int error)
+{
+	const char* name = "operand";
+	const VMStack* stack = &cpu->stack;
+	if (!stack->overflow) {
+		name = "return";
+		stack = &cpu->rstack;
+	}
+	
+	if (!stack->overflow)
+		return error;
+	
+	diag_printf("## Error: %s stack overflow, depth %zu is above max depth %zu\n",
+			name, stack->overflow, stack->max);
+	
+	return CPU_STACK_OVERFLOW;
+}
+
+int CPUExecute(CPU* cpu)
+{
+	assert(cpu);
+	
+	cpu->stack.overflow = 0;
+	cpu->rstack.overflow = 0;
+	
+	int error = 0;
+	if (cpu->profile)
+		error = ProfileExecute(cpu->profile, cpu);
+	else if (cpu->trace)
+		error = TraceExecute(cpu->trace, cpu);
+	else if (cpu->jit)
+		error = JitExecute(cpu->jit, cpu);
+	else
+		error = execute_commands(cpu);
+	
+	if (error && error != CPU_BUDGET && error != CPU_SNAPSHOT)
+		error = report_overflow(cpu, error);
+	
+	// Output of stopped program must not be lost
+	if (VMIOFlush(&cpu->io) && !error)
+		error = 1;
+	
+	return error;
 }
 
 void CPUDeInit(CPU* cpu)
@@ -77,13 +248,15 @@ void CPUDeInit(CPU* cpu)
 	assert(cpu);
 	
 	MemoryDeInit(cpu->memory);
+	VMIODeInit(&cpu->io);
 	
-	PStackDeInit(cpu->stack);
-	PStackDeInit(cpu->rstack);
+	VMStackDeInit(&cpu->stack);
+	VMStackDeInit(&cpu->rstack);
 	
-	free(cpu->code);
-	free(cpu->stack);
-	free(cpu->rstack);
+	ProfileDeInit(cpu->profile);
+	TraceDeInit(cpu->trace);
+	if (cpu->own_code)
+		CPUCodeDeInit(cpu->own_code);
 	
 	free(cpu);
 }
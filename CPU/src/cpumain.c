@@ -1,59 +1,334 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/stat.h>
 
+#include "batch.h"
 #include "binaryfile.h"
 #include "cpu.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "verifier.h"
+
+// Signals are noticed at least every SIGNAL_SLICE commands
+#define SIGNAL_SLICE (1 << 20)
+
+// Cpu was stopped by SIGTERM after snapshot, differs from CPU results
+#define RUN_STOPPED (CPU_STACK_OVERFLOW - 1)
+
+enum SnapshotRequest {
+	REQUEST_NONE,
+	REQUEST_CONTINUE,
+	REQUEST_STOP
+};
+
+volatile sig_atomic_t snapshot_request = REQUEST_NONE;
+
+void snapshot_handler(int signum)
+{
+	// Stop request must not be overwritten by SIGUSR1
+	if (signum == SIGTERM)
+		snapshot_request = REQUEST_STOP;
+	else if (snapshot_request == REQUEST_NONE)
+		snapshot_request = REQUEST_CONTINUE;
+}
+
+int install_handlers()
+{
+	struct sigaction action = {};
+	action.sa_handler = snapshot_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	
+	return 	sigaction(SIGUSR1, &action, 0) ||
+			sigaction(SIGTERM, &action, 0);
+}
+
+/*! Executes cpu by slices, so snapshots can be written between them
+ * @param [in] cpu CPU
+ * @param [in] snapshot_name Snapshot file, NULL if snapshots are disabled
+ * @param [in] every Write snapshot every this number of commands, 0 to never,
+ * requires snapshot_name
+ * @param [out] executed Number of executed commands, NULL to not count them,
+ * counting runs slower budgeted loop
+ * @return 0 on halt, RUN_STOPPED on SIGTERM, other value on error
+ */
+int run(CPU* cpu, const char* snapshot_name, uint64_t every, uint64_t* executed)
+{
+	uint64_t left = every;
+	
+	for (;;) {
+		// Without snapshots only SNAPSHOT commands stop cpu
+		uint64_t slice = (snapshot_name || executed) ? SIGNAL_SLICE : UINT64_MAX;
+		if (every && left < slice)
+			slice = left;
+		
+		cpu->budget = slice;
+		int error = CPUExecute(cpu);
+		
+		if (executed)
+			*executed += slice - cpu->budget;
+		
+		if (every) {
+			left -= slice - cpu->budget;
+			if (left == 0) {
+				left = every;
+				if (SnapshotWrite(cpu, snapshot_name))
+					return 1;
+			}
+		}
+		
+		if (error == CPU_SNAPSHOT && snapshot_name &&
+			SnapshotWrite(cpu, snapshot_name))
+			return 1;
+		
+		if (error && error != CPU_BUDGET && error != CPU_SNAPSHOT)
+			return error;
+		
+		if (snapshot_request != REQUEST_NONE) {
+			int stop = (snapshot_request == REQUEST_STOP);
+			snapshot_request = REQUEST_NONE;
+			
+			if (SnapshotWrite(cpu, snapshot_name))
+				return 1;
+			
+			if (stop)
+				return RUN_STOPPED;
+		}
+		
+		if (!error)
+			return 0;
+	}
+}
+
+// Verifies code with regions it would run with
+int verify(const BinaryFile* file)
+{
+	size_t sizes[MEMORY_REGIONS] = {};
+	for (int i = 0; i < MEMORY_REGIONS; ++i)
+		sizes[i] = get_mem_default_size(i);
+	
+	if (BinaryFileRegions(file, sizes, MEMORY_REGIONS)) {
+		printf("## Error: bad memory section\n");
+		
+		return 1;
+	}
+	
+	CodeBlocks* blocks = BlocksBuild(file);
+	int error = VerifyCode(file, blocks, sizes, 1);
+	if (!error)
+		printf("## Verified\n");
+	
+	BlocksDeInit(blocks);
+	
+	return error;
+}
 
 inline int print_usage(const char* name)
 {
 	printf("## CPU for .bin files\n");
 	printf("## By InversionSpaces\n");
 	printf("## Executes code in BIN_FILE\n");
-	printf("## Usage: %s BIN_FILE\n", name);
+	printf("## Usage: %s [OPTIONS] BIN_FILE\n", name);
+	printf("##        %s [OPTIONS] --batch MANIFEST [-j N]\n", name);
+	printf("## Options:\n");
+	printf("##   --checked\tcheck stacks guards, hashes and memory bounds on every access\n");
+	printf("##   --max-depth N\tlimit operand and return stacks to N elements\n");
+	printf("##   --jit\ttranslate code to x86-64 machine code before running\n");
+	printf("##   --profile PREFIX\twrite PREFIX.txt report and PREFIX.folded stacks\n");
+	printf("##   --trace FILE\trecord every executed command to FILE for trace-replay\n");
+	printf("##   --binary-in\tread IN as raw little endian elements\n");
+	printf("##   --binary-out\twrite OUT as raw little endian elements\n");
+	printf("##   --snapshot FILE\twrite state to FILE on SNAPSHOT command,\n");
+	printf("##   \t\tSIGUSR1 and SIGTERM, the last one also stops cpu\n");
+	printf("##   --snapshot-every N\twrite snapshot every N commands\n");
+	printf("##   --restore FILE\tcontinue from snapshot, IN is read anew\n");
+	printf("##   --batch MANIFEST\trun jobs of lines BIN_FILE IN_FILE OUT_FILE,\n");
+	printf("##   \t\tIN_FILE - is empty input, optional fourth\n");
+	printf("##   \t\t--check-memory or --no-check-memory sets it for job\n");
+	printf("##   -j N\trun batch jobs on N threads\n");
+	printf("##   --stats\tprint number of executed commands\n");
+	printf("##   --no-verify\trun code with checks of every command\n");
+	printf("##   --no-check-memory\trun indices from stack and registers\n");
+	printf("##   \t\tof verified code without bounds checks\n");
+	printf("##   --check-memory\tcheck them, default\n");
+	printf("##   --verify\tonly verify code and print the reason if it fails\n");
 	
 	return 0;
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc != 2)
+	CPUConfig config;
+	CPUConfigInit(&config);
+	
+	const char* bin_name = 0;
+	const char* profile_prefix = 0;
+	const char* snapshot_name = 0;
+	const char* restore_name = 0;
+	uint64_t snapshot_every = 0;
+	const char* manifest = 0;
+	size_t nthreads = 1;
+	int stats = 0;
+	int verify_only = 0;
+	
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--checked") == 0)
+			config.checked = 1;
+		else if (strcmp(argv[i], "--jit") == 0)
+			config.jit = 1;
+		else if (strcmp(argv[i], "--stats") == 0)
+			stats = 1;
+		else if (strcmp(argv[i], "--no-verify") == 0)
+			config.verify = 0;
+		else if (strcmp(argv[i], "--check-memory") == 0)
+			config.check_memory = 1;
+		else if (strcmp(argv[i], "--no-check-memory") == 0)
+			config.check_memory = 0;
+		else if (strcmp(argv[i], "--verify") == 0)
+			verify_only = 1;
+		else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+			config.profile = 1;
+			profile_prefix = argv[++i];
+		}
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			config.trace = argv[++i];
+		else if (strcmp(argv[i], "--binary-in") == 0)
+			config.in_format = VMIO_BINARY;
+		else if (strcmp(argv[i], "--binary-out") == 0)
+			config.out_format = VMIO_BINARY;
+		else if (strcmp(argv[i], "--max-depth") == 0 && i + 1 < argc) {
+			char* end = 0;
+			config.max_depth = strtoull(argv[++i], &end, 10);
+			if (*end || config.max_depth == 0)
+				return print_usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+			snapshot_name = argv[++i];
+		else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc)
+			restore_name = argv[++i];
+		else if (strcmp(argv[i], "--snapshot-every") == 0 && i + 1 < argc) {
+			char* end = 0;
+			snapshot_every = strtoull(argv[++i], &end, 10);
+			if (*end || snapshot_every == 0)
+				return print_usage(argv[0]);
+		}
+		else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+			manifest = argv[++i];
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			char* end = 0;
+			nthreads = strtoull(argv[++i], &end, 10);
+			if (*end || nthreads == 0)
+				return print_usage(argv[0]);
+		}
+		else if (argv[i][0] != '-' && !bin_name)
+			bin_name = argv[i];
+		else
+			return print_usage(argv[0]);
+	}
+	
+	// Batch jobs are not profiled and snapshotted
+	if (manifest) {
+		if (bin_name || config.profile || config.trace || snapshot_name || 
+			restore_name || stats || verify_only)
+			return print_usage(argv[0]);
+		
+		int failed = BatchRun(manifest, &config, nthreads);
+		if (failed < 0)
+			printf("## Error reading manifest\n");
+		
+		return failed != 0;
+	}
+	
+	if (!bin_name || (snapshot_every && !snapshot_name))
 		return print_usage(argv[0]);
 	
-	BinaryFile* file = BinaryFileFromBinFile(argv[1]);
+	// Trace starts from the first command and replaces profiler loop
+	if (config.trace && (restore_name || config.profile))
+		return print_usage(argv[0]);
+	
+	// Jit doesn't count commands, so it can't stop for signals
+	if ((snapshot_name || stats || config.trace) && config.jit) {
+		printf("## Warning: jit is disabled by %s\n", 
+				snapshot_name ? "snapshots" : 
+				(stats ? "stats" : "trace"));
+		
+		config.jit = 0;
+	}
+	
+	BinaryFile* file = BinaryFileMap(bin_name);
 	
 	if (file == 0) {
-		printf("## Error disasm\n");
+		printf("## Error loading binary file\n");
 		
 		return 1;
 	}
 	
-	CPU* cpu = CPUInit(file);
+	if (verify_only) {
+		int error = verify(file);
+		BinaryFileUnmap(file);
+		
+		return error;
+	}
 	
-	int error = CPUExecute(cpu);
+	CPU* cpu = CPUInit(file, &config);
+	
+	if (cpu == 0) {
+		BinaryFileUnmap(file);
+		
+		return 1;
+	}
+	
+	if (restore_name && SnapshotRead(cpu, restore_name)) {
+		CPUDeInit(cpu);
+		BinaryFileUnmap(file);
+		
+		return 1;
+	}
+	
+	if (snapshot_name && install_handlers())
+		printf("## Warning: failed to install signal handlers\n");
+	
+	uint64_t executed = 0;
+	int error = run(cpu, snapshot_name, snapshot_every, stats ? &executed : 0);
+	
+	if (stats)
+		printf("## Commands: %" PRIu64 "\n", executed);
+	
+	if (error == RUN_STOPPED) {
+		printf("## Stopped, snapshot is written to %s\n", snapshot_name);
+		
+		CPUDeInit(cpu);
+		BinaryFileUnmap(file);
+		
+		return 0;
+	}
+	
+	// Profile of failed run is still useful
+	if (cpu->profile && ProfileWrite(cpu->profile, profile_prefix))
+		printf("## Error writing profile\n");
 	
 	if (error) {
 		printf("## Error executing\n");
 		
 		CPUDeInit(cpu);
+		BinaryFileUnmap(file);
 		
 		return 1;
 	}
 	
-	int empty = 1;
-	PStackIsEmpty(cpu->stack, &empty);
 	int i = 0;
-	while (!empty) {
+	while (VMStackSize(&cpu->stack)) {
 		stack_el_t a = 0;
-		PStackPop(cpu->stack, &a);
-		
-		printf("## %d:\t|%d|\n", i++, a);
+		VMStackPop(&cpu->stack, &a);
 		
-		PStackIsEmpty(cpu->stack, &empty);
+		printf("## %d:\t|%" PRId64 "|\n", i++, a);
 	}
 	
 	CPUDeInit(cpu);
+	BinaryFileUnmap(file);
 }
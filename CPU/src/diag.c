@@ -0,0 +1,36 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "diag.h"
+
+// Longer messages are cut
+#define DIAG_MAX (512)
+
+static DiagFunc diag_func = 0;
+static void* diag_ctx = 0;
+
+void set_diag_handler(DiagFunc func, void* ctx)
+{
+	diag_func = func;
+	diag_ctx = ctx;
+}
+
+int diag_printf(const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	
+	int retval = 0;
+	if (diag_func) {
+		char message[DIAG_MAX] = "";
+		retval = vsnprintf(message, DIAG_MAX, format, args);
+		diag_func(diag_ctx, message);
+	}
+	else {
+		retval = vprintf(format, args);
+	}
+	
+	va_end(args);
+	
+	return retval;
+}
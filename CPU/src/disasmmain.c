@@ -0,0 +1,299 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "binaryfile.h"
+#include "command.h"
+#include "memory.h"
+#include "exitingalloc.h"
+
+#define OUTPUT_BUFFER (1 << 20)
+
+inline int print_usage(const char* name)
+{
+	printf("## Disassembler for .bin files\n");
+	printf("## By InversionSpaces\n");
+	printf("## Translates BIN_FILE back to .vm text\n");
+	printf("## Usage: %s BIN_FILE [VM_FILE]\n", name);
+	printf("## Writes to stdout if VM_FILE is not given\n");
+
+	return 0;
+}
+
+int compare_addresses(const void* a, const void* b)
+{
+	const LabelEntry* first = reinterpret_cast<const LabelEntry*>(a);
+	const LabelEntry* second = reinterpret_cast<const LabelEntry*>(b);
+
+	return (first->ncommand > second->ncommand) -
+			(first->ncommand < second->ncommand);
+}
+
+struct Disassembly {
+	const BinaryFile* file;
+
+	// Labels sorted by address
+	LabelEntry* labels;
+	size_t nlabels;
+
+	// Index of the first label at every address
+	size_t* first;
+
+	// Names of addresses without labels
+	char** synthesized;
+};
+
+typedef struct Disassembly Disassembly;
+
+int has_label(const Disassembly* dis, const char* name)
+{
+	for (size_t i = 0; i < dis->nlabels; ++i)
+		if (strcmp(dis->labels[i].name, name) == 0)
+			return 1;
+
+	return 0;
+}
+
+// Labels from debug section and L<address> for jump targets without them
+void init_labels(Disassembly* dis)
+{
+	const BinaryFile* file = dis->file;
+	size_t ncommands = file->ncommands;
+
+	dis->nlabels = 0;
+	dis->labels = BinaryFileLabels(file, &dis->nlabels);
+
+	// Insertion sort keeps order of labels at the same address,
+	// sections written by this assembler are already sorted
+	if (dis->labels) {
+		for (size_t i = 1; i < dis->nlabels; ++i) {
+			LabelEntry cur = dis->labels[i];
+			size_t j = i;
+			for (; j > 0 && compare_addresses(&dis->labels[j - 1], &cur) > 0; --j)
+				dis->labels[j] = dis->labels[j - 1];
+			dis->labels[j] = cur;
+		}
+	}
+
+	dis->first = reinterpret_cast<size_t*>(
+		exiting_malloc((ncommands + 2) * sizeof(size_t))
+	);
+
+	size_t label = 0;
+	for (size_t pc = 0; pc <= ncommands + 1; ++pc) {
+		while (label < dis->nlabels && size_t(dis->labels[label].ncommand) < pc)
+			++label;
+		dis->first[pc] = label;
+	}
+
+	dis->synthesized = reinterpret_cast<char**>(
+		exiting_calloc(ncommands + 1, sizeof(char*))
+	);
+
+	const int jump_id = get_command_id("JUMP");
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+
+	for (size_t pc = 0; pc < ncommands; ++pc) {
+		BinCommand cmd = file->commands[pc];
+		int id = get_command_id(cmd.type);
+
+		if (id != jump_id && id != call_id && id != tailcall_id)
+			continue;
+
+		size_t target = cmd.arg2;
+		if (dis->first[target] != dis->first[target + 1] ||
+			dis->synthesized[target])
+			continue;
+
+		char name[64] = "";
+		int len = snprintf(name, sizeof(name), "L%zu", target);
+		while (has_label(dis, name) && len + 1 < int(sizeof(name)))
+			name[len++] = '_';
+
+		dis->synthesized[target] = strdup(name);
+	}
+}
+
+inline const char* label_name(const Disassembly* dis, size_t pc)
+{
+	if (dis->first[pc] != dis->first[pc + 1])
+		return dis->labels[dis->first[pc]].name;
+
+	return dis->synthesized[pc];
+}
+
+void write_labels(const Disassembly* dis, size_t pc, FILE* fp)
+{
+	for (size_t i = dis->first[pc]; i < dis->first[pc + 1]; ++i)
+		fprintf(fp, "LABEL %s\n", dis->labels[i].name);
+
+	if (dis->synthesized[pc])
+		fprintf(fp, "LABEL %s\n", dis->synthesized[pc]);
+}
+
+int disassemble(const Disassembly* dis, FILE* fp)
+{
+	const BinaryFile* file = dis->file;
+
+	const int jump_id = get_command_id("JUMP");
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+	const int push_id = get_command_id("PUSH");
+	const int pop_id = get_command_id("POP");
+	const int convert_id = get_command_id("CONVERT");
+
+	// Only regions set by code are written, defaults are kept
+	size_t sizes[MEMORY_REGIONS] = {};
+	if (BinaryFileRegions(file, sizes, MEMORY_REGIONS)) {
+		printf("## Error: bad memory section\n");
+		
+		return 1;
+	}
+	
+	for (int mem_id = 0; mem_id < MEMORY_REGIONS; ++mem_id)
+		if (sizes[mem_id])
+			fprintf(fp, "REGION %s %zu\n", get_mem_name(mem_id), sizes[mem_id]);
+	
+	for (size_t pc = 0; pc < file->ncommands; ++pc) {
+		write_labels(dis, pc, fp);
+
+		BinCommand cmd = file->commands[pc];
+		int id = get_command_id(cmd.type);
+
+		const char* name = get_command_name(id);
+
+		if (id == jump_id) {
+			int jmp = get_jmp_id(cmd.arg1);
+			if (jmp < 0) {
+				printf("## Error: unknown jump condition on %zu\n", pc);
+
+				return 1;
+			}
+
+			fprintf(fp, "\t%s %s %s\n", name, get_jmp_name(jmp),
+					label_name(dis, cmd.arg2));
+		}
+		else if (id == call_id || id == tailcall_id)
+			fprintf(fp, "\t%s %s\n", name, label_name(dis, cmd.arg2));
+		else if (id == push_id || id == pop_id) {
+			int mem_id = cmd.arg1;
+
+			// Values of constants and counts of IN and OUT can be -1
+			if (cmd.arg2 == -1 && mem_id < MEMORY_REGIONS)
+				fprintf(fp, "\t%s %s INDEX\n", name, get_mem_name(mem_id));
+			else
+				fprintf(fp, "\t%s %s %d\n", name, get_mem_name(mem_id),
+						cmd.arg2);
+		}
+		else if (id == convert_id)
+			fprintf(fp, "\t%s %s %s\n", name, get_type_name(cmd.arg1),
+					get_type_name(cmd.arg2));
+		// I32 is default type
+		else if (get_command_argc(id) == ARGC_TYPED && cmd.arg1 != TYPE_I32)
+			fprintf(fp, "\t%s %s\n", name, get_type_name(cmd.arg1));
+		else if (get_command_argc(id) == 3)
+			fprintf(fp, "\t%s %d %d\n", name, cmd.arg1, cmd.arg2);
+		else if (get_command_argc(id) == 2)
+			fprintf(fp, "\t%s %d\n", name, cmd.arg2);
+		else
+			fprintf(fp, "\t%s\n", name);
+	}
+
+	write_labels(dis, file->ncommands, fp);
+
+	return 0;
+}
+
+// Checks opcodes, memory ids and jump targets
+int check_commands(const BinaryFile* file)
+{
+	const int jump_id = get_command_id("JUMP");
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+	const int push_id = get_command_id("PUSH");
+	const int pop_id = get_command_id("POP");
+	const int convert_id = get_command_id("CONVERT");
+	
+	// OUT_F64 is the last memory id
+	const int mem_last = get_mem_id("OUT_F64");
+	
+	for (size_t pc = 0; pc < file->ncommands; ++pc) {
+		BinCommand cmd = file->commands[pc];
+		int id = get_command_id(cmd.type);
+		
+		int bad = (id < 0);
+		if (id == jump_id || id == call_id || id == tailcall_id)
+			bad = (cmd.arg2 < 0 || uint64_t(cmd.arg2) > file->ncommands);
+		else if (id == push_id || id == pop_id)
+			bad = (cmd.arg1 > mem_last);
+		else if (id == convert_id)
+			bad = (	cmd.arg1 >= get_not_type_id() || 
+					cmd.arg2 < 0 || cmd.arg2 >= get_not_type_id());
+		else if (id >= 0 && get_command_argc(id) == ARGC_TYPED)
+			bad = (cmd.arg1 >= get_not_type_id());
+		
+		if (bad) {
+			printf("## Error: bad command on %zu\n", pc);
+			
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2 && argc != 3)
+		return print_usage(argv[0]);
+
+	BinaryFile* file = BinaryFileMap(argv[1]);
+
+	if (file == 0) {
+		printf("## Error loading binary file\n");
+
+		return 1;
+	}
+
+	if (check_commands(file)) {
+		BinaryFileUnmap(file);
+		
+		return 1;
+	}
+	
+	FILE* fp = (argc == 3) ? fopen(argv[2], "w") : stdout;
+	if (!fp) {
+		printf("## Error: failed to open %s\n", argv[2]);
+
+		BinaryFileUnmap(file);
+		return 1;
+	}
+
+	setvbuf(fp, 0, _IOFBF, OUTPUT_BUFFER);
+
+	Disassembly dis = {};
+	dis.file = file;
+	init_labels(&dis);
+
+	int error = disassemble(&dis, fp);
+
+	if (fflush(fp) || ferror(fp)) {
+		printf("## Error writing output\n");
+
+		error = 1;
+	}
+
+	if (fp != stdout)
+		fclose(fp);
+
+	for (size_t pc = 0; pc <= file->ncommands; ++pc)
+		free(dis.synthesized[pc]);
+	free(dis.synthesized);
+	free(dis.first);
+	free(dis.labels);
+
+	BinaryFileUnmap(file);
+
+	return error;
+}
@@ -1,13 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include "diag.h"
 #include "exitingalloc.h"
 
 void *exiting_calloc(size_t n, size_t size)
 {
 	void *retval = calloc(n, size);
 	if (retval == NULL) {
-		printf("# ERROR: Failed to calloc memory. Exiting...\n");
+		diag_printf("# ERROR: Failed to calloc memory. Exiting...\n");
 		exit(2);
 	}
 
@@ -18,7 +19,7 @@ void *exiting_malloc(size_t size)
 {
 	void *retval = malloc(size);
 	if (retval == NULL) {
-		printf("# ERROR: Failed to malloc memory. Exiting...\n");
+		diag_printf("# ERROR: Failed to malloc memory. Exiting...\n");
 		exit(2);
 	}
 
@@ -29,7 +30,7 @@ void *exiting_realloc(void *ptr, size_t size)
 {
 	void *retval = realloc(ptr, size);
 	if (retval == NULL) {
-		printf("# ERROR: Failed to realloc memory. Exiting...\n");
+		diag_printf("# ERROR: Failed to realloc memory. Exiting...\n");
 		exit(2);
 	}
 
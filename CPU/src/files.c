@@ -2,8 +2,15 @@
 #include <stdlib.h>
 #include <sys/stat.h>
 
+#ifdef __unix__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 #include "files.h"
 
+#include "diag.h"
 #include "exitingalloc.h"
 
 FILE *exiting_fopen(const char *fname, const char *mod)
@@ -14,7 +21,7 @@ FILE *exiting_fopen(const char *fname, const char *mod)
 	FILE *retval = fopen(fname, mod);
 	
 	if (retval == NULL) {
-		printf("# ERROR: Failed to open file: %s. Exiting...\n", fname);
+		diag_printf("# ERROR: Failed to open file: %s. Exiting...\n", fname);
 		exit(1);
 	}
 
@@ -50,7 +57,7 @@ void write_file(FileData data, const char* filename)
 	size_t writed = fwrite(data.ptr, 1, data.size, fp);
 	
 	if (writed != data.size) {
-		printf("# ERROR: Failed to write file: %s. \
+		diag_printf("# ERROR: Failed to write file: %s. \
 					Exiting...\n", filename);
                     
 		fclose(fp);
@@ -71,7 +78,7 @@ char* read_file_str(const char *filename)
 
 	size_t readed = fread(retval, 1, size, fp);
 	if (readed != size) {
-		printf("# ERROR: Failed to read file: %s. \
+		diag_printf("# ERROR: Failed to read file: %s. \
 			Exiting...\n", filename);
 		
 		free(retval);
@@ -96,7 +103,7 @@ FileData read_file_bin(const char *filename)
 	size_t readed = fread(ptr, 1, size, fp);
 	
 	if (readed != size) {
-		printf("# ERROR: Failed to read file: %s. \
+		diag_printf("# ERROR: Failed to read file: %s. \
 			Exiting...\n", filename);
 			
 		free(ptr);
@@ -104,5 +111,55 @@ FileData read_file_bin(const char *filename)
         size = 0;
 	}
 	
+	fclose(fp);
+	
+	return {ptr, size};
+}
+
+FileData map_file(const char *filename)
+{
+	assert(filename);
+	
+#ifdef __unix__
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		diag_printf("# ERROR: Failed to open file: %s\n", filename);
+		
+		return {0, 0};
+	}
+	
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		diag_printf("# ERROR: Failed to stat file: %s\n", filename);
+		
+		close(fd);
+		return {0, 0};
+	}
+	
+	size_t size = st.st_size;
+	
+	// Pages are shared with page cache and other processes
+	void* ptr = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	
+	if (ptr == MAP_FAILED) {
+		diag_printf("# ERROR: Failed to map file: %s\n", filename);
+		
+		return {0, 0};
+	}
+	
 	return {ptr, size};
+#else
+	return read_file_bin(filename);
+#endif
+}
+
+void unmap_file(FileData data)
+{
+#ifdef __unix__
+	if (data.ptr)
+		munmap(data.ptr, data.size);
+#else
+	free(data.ptr);
+#endif
 }
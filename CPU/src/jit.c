@@ -0,0 +1,818 @@
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "jit.h"
+
+#include "command.h"
+#include "memory.h"
+#include "exitingalloc.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+
+#include <sys/mman.h>
+
+//======================================================================
+// Machine code buffer
+
+struct JitBuffer {
+	uint8_t* data;
+	size_t size;
+	size_t capacity;
+};
+
+typedef struct JitBuffer JitBuffer;
+
+inline void emit8(JitBuffer* buf, uint8_t byte)
+{
+	if (buf->size == buf->capacity) {
+		buf->capacity *= 2;
+		buf->data = reinterpret_cast<uint8_t*>(
+			exiting_realloc(buf->data, buf->capacity)
+		);
+	}
+
+	buf->data[buf->size++] = byte;
+}
+
+inline void emit32(JitBuffer* buf, uint32_t val)
+{
+	for (int i = 0; i < 4; ++i)
+		emit8(buf, (val >> (8 * i)) & 0xFF);
+}
+
+inline void emit64(JitBuffer* buf, uint64_t val)
+{
+	for (int i = 0; i < 8; ++i)
+		emit8(buf, (val >> (8 * i)) & 0xFF);
+}
+
+inline void patch32(JitBuffer* buf, size_t pos, uint32_t val)
+{
+	for (int i = 0; i < 4; ++i)
+		buf->data[pos + i] = (val >> (8 * i)) & 0xFF;
+}
+
+//======================================================================
+// x86-64 encoding
+
+enum Reg {
+	RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+	R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+enum Cond {
+	CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+	CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF, CC_NONE = -1
+};
+
+#define NO_INDEX (-1)
+
+// Register roles in compiled code, all callee saved
+#define R_TOP (RBX)		// Operand stack top
+#define R_END (RBP)		// Operand stack end
+#define R_CPU (R12)		// CPU*
+#define R_ADDR (R13)	// Native address of every command
+#define R_BASE (R14)	// Operand stack base
+#define R_MEM (R15)		// Base of every memory region
+
+#define SLOT ((int)sizeof(stack_el_t))
+
+inline void emit_opcode(JitBuffer* buf, uint32_t opcode)
+{
+	if (opcode > 0xFF)
+		emit8(buf, opcode >> 8);
+	emit8(buf, opcode & 0xFF);
+}
+
+// op reg, [base + index * 2^scale + disp]
+void emit_mem(	JitBuffer* buf, int w, uint32_t opcode, int reg,
+				int base, int index, int scale, int32_t disp)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+	if (index != NO_INDEX)
+		rex |= (index >> 3) << 1;
+	if (rex != 0x40)
+		emit8(buf, rex);
+
+	emit_opcode(buf, opcode);
+
+	// Always disp32 form, so rbp and r13 don't need special cases
+	if (index == NO_INDEX && (base & 7) != RSP)
+		emit8(buf, 0x80 | ((reg & 7) << 3) | (base & 7));
+	else {
+		if (index == NO_INDEX)
+			index = RSP; // No index
+
+		emit8(buf, 0x80 | ((reg & 7) << 3) | RSP);
+		emit8(buf, (scale << 6) | ((index & 7) << 3) | (base & 7));
+	}
+
+	emit32(buf, disp);
+}
+
+// op rm, reg or op reg, rm depending on opcode
+void emit_reg(JitBuffer* buf, int w, uint32_t opcode, int reg, int rm)
+{
+	uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+	if (rex != 0x40)
+		emit8(buf, rex);
+
+	emit_opcode(buf, opcode);
+	emit8(buf, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+inline void emit_push(JitBuffer* buf, int reg)
+{
+	if (reg >= R8)
+		emit8(buf, 0x41);
+	emit8(buf, 0x50 + (reg & 7));
+}
+
+inline void emit_pop(JitBuffer* buf, int reg)
+{
+	if (reg >= R8)
+		emit8(buf, 0x41);
+	emit8(buf, 0x58 + (reg & 7));
+}
+
+inline void emit_mov_imm64(JitBuffer* buf, int reg, uint64_t imm)
+{
+	emit8(buf, 0x48 | (reg >> 3));
+	emit8(buf, 0xB8 + (reg & 7));
+	emit64(buf, imm);
+}
+
+inline void emit_mov_imm32(JitBuffer* buf, int reg, uint32_t imm)
+{
+	if (reg >= R8)
+		emit8(buf, 0x41);
+	emit8(buf, 0xB8 + (reg & 7));
+	emit32(buf, imm);
+}
+
+// add/sub reg64, imm8
+inline void emit_add_imm8(JitBuffer* buf, int reg, int8_t imm)
+{
+	if (imm >= 0)
+		emit_reg(buf, 1, 0x83, 0, reg);
+	else {
+		emit_reg(buf, 1, 0x83, 5, reg);
+		imm = -imm;
+	}
+	emit8(buf, imm);
+}
+
+// jmp/call/jcc rel32 to known position
+inline void emit_rel32(JitBuffer* buf, size_t target)
+{
+	emit32(buf, uint32_t(target - (buf->size + 4)));
+}
+
+inline void emit_jmp(JitBuffer* buf, size_t target)
+{
+	emit8(buf, 0xE9);
+	emit_rel32(buf, target);
+}
+
+inline void emit_call(JitBuffer* buf, size_t target)
+{
+	emit8(buf, 0xE8);
+	emit_rel32(buf, target);
+}
+
+inline void emit_jcc(JitBuffer* buf, int cc, size_t target)
+{
+	emit8(buf, 0x0F);
+	emit8(buf, 0x80 + cc);
+	emit_rel32(buf, target);
+}
+
+// Short forward jcc, returns position to patch with jcc8_here
+inline size_t emit_jcc8(JitBuffer* buf, int cc)
+{
+	emit8(buf, 0x70 + cc);
+	emit8(buf, 0);
+
+	return buf->size;
+}
+
+inline void jcc8_here(JitBuffer* buf, size_t pos)
+{
+	assert(buf->size - pos < 128);
+
+	buf->data[pos - 1] = buf->size - pos;
+}
+
+//======================================================================
+// Helpers called from compiled code
+
+int jit_call_executor(CPU* cpu, const DecodedCommand* cmd)
+{
+	return get_executor(cmd->id)(cpu, cmd->cmd);
+}
+
+int jit_grow_stack(CPU* cpu)
+{
+	return VMStackGrow(&cpu->stack);
+}
+
+int jit_grow_rstack(CPU* cpu)
+{
+	return VMStackGrow(&cpu->rstack);
+}
+
+//======================================================================
+
+#define CPU_OFFSET(field) int32_t(offsetof(CPU, field))
+
+#define OFF_TOP CPU_OFFSET(stack.top)
+#define OFF_BASE CPU_OFFSET(stack.base)
+#define OFF_END CPU_OFFSET(stack.end)
+#define OFF_RTOP CPU_OFFSET(rstack.top)
+#define OFF_RBASE CPU_OFFSET(rstack.base)
+#define OFF_FETCHER CPU_OFFSET(fetcher)
+
+typedef int (*JitEntry)(CPU* cpu, void* const* addr,
+						stack_el_t* const* regions, const void* start);
+
+struct JitCode {
+	uint8_t* code;
+	size_t size;
+
+	// Native address of every command and halt sentinel
+	void** addr;
+	size_t ncommands;
+};
+
+// Positions of shared stubs
+struct JitStubs {
+	size_t exit;
+	size_t halt;
+	size_t underflow;
+	size_t divzero;
+	size_t grow;
+	size_t rgrow;
+};
+
+typedef struct JitStubs JitStubs;
+
+// Ids of translated commands and memory regions
+struct JitIds {
+	int push, pop, add, sub, mul, div;
+	int jump, call, tailcall, ret;
+	int loadlocal, storelocal, frameenter, frameleave;
+
+	int constant, in, out, reg, local, not_mem;
+
+	int cond[256];
+};
+
+typedef struct JitIds JitIds;
+
+struct JitFixup {
+	size_t pos;
+	size_t target;
+};
+
+typedef struct JitFixup JitFixup;
+
+struct JitContext {
+	JitBuffer buf;
+	JitStubs stubs;
+	JitIds ids;
+
+	// Indices from stack and registers are left to executors
+	int check_memory;
+
+	JitFixup* fixups;
+	size_t nfixups;
+	size_t fcapacity;
+};
+
+typedef struct JitContext JitContext;
+
+void add_fixup(JitContext* ctx, size_t target)
+{
+	if (ctx->nfixups == ctx->fcapacity) {
+		ctx->fcapacity *= 2;
+		ctx->fixups = reinterpret_cast<JitFixup*>(
+			exiting_realloc(ctx->fixups, ctx->fcapacity * sizeof(JitFixup))
+		);
+	}
+
+	ctx->fixups[ctx->nfixups++] = {ctx->buf.size, target};
+	emit32(&ctx->buf, 0);
+}
+
+// Jump to command, resolved when all commands are emitted
+inline void emit_jmp_cmd(JitContext* ctx, size_t target)
+{
+	emit8(&ctx->buf, 0xE9);
+	add_fixup(ctx, target);
+}
+
+inline void emit_jcc_cmd(JitContext* ctx, int cc, size_t target)
+{
+	emit8(&ctx->buf, 0x0F);
+	emit8(&ctx->buf, 0x80 + cc);
+	add_fixup(ctx, target);
+}
+
+//======================================================================
+
+void emit_stubs(JitContext* ctx, size_t ncommands)
+{
+	JitBuffer* buf = &ctx->buf;
+	JitStubs* stubs = &ctx->stubs;
+
+	// Entry: (cpu, addr, regions, start)
+	emit_push(buf, RBX);
+	emit_push(buf, RBP);
+	emit_push(buf, R12);
+	emit_push(buf, R13);
+	emit_push(buf, R14);
+	emit_push(buf, R15);
+	emit_add_imm8(buf, RSP, -8); // Align for calls
+
+	emit_reg(buf, 1, 0x89, RDI, R_CPU);
+	emit_reg(buf, 1, 0x89, RSI, R_ADDR);
+	emit_reg(buf, 1, 0x89, RDX, R_MEM);
+	emit_mem(buf, 1, 0x8B, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_mem(buf, 1, 0x8B, R_BASE, R_CPU, NO_INDEX, 0, OFF_BASE);
+	emit_mem(buf, 1, 0x8B, R_END, R_CPU, NO_INDEX, 0, OFF_END);
+	emit_reg(buf, 0, 0xFF, 4, RCX); // jmp rcx
+
+	// Exit with eax
+	stubs->exit = buf->size;
+	emit_mem(buf, 1, 0x89, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_add_imm8(buf, RSP, 8);
+	emit_pop(buf, R15);
+	emit_pop(buf, R14);
+	emit_pop(buf, R13);
+	emit_pop(buf, R12);
+	emit_pop(buf, RBP);
+	emit_pop(buf, RBX);
+	emit8(buf, 0xC3);
+
+	stubs->halt = buf->size;
+	emit_mem(buf, 1, 0xC7, 0, R_CPU, NO_INDEX, 0, OFF_FETCHER);
+	emit32(buf, ncommands);
+	emit_reg(buf, 0, 0x31, RAX, RAX);
+	emit_jmp(buf, stubs->exit);
+
+	// Errors with command number in esi
+	stubs->underflow = buf->size;
+	emit_mem(buf, 1, 0x89, RSI, R_CPU, NO_INDEX, 0, OFF_FETCHER);
+	emit_mov_imm32(buf, RAX, TOO_SMALL_SIZE);
+	emit_jmp(buf, stubs->exit);
+
+	stubs->divzero = buf->size;
+	emit_mem(buf, 1, 0x89, RSI, R_CPU, NO_INDEX, 0, OFF_FETCHER);
+	emit_mov_imm32(buf, RAX, 1);
+	emit_jmp(buf, stubs->exit);
+
+	// Grows operand stack, keeps rax, rcx and rdx
+	stubs->grow = buf->size;
+	emit_push(buf, RAX);
+	emit_push(buf, RCX);
+	emit_push(buf, RDX);
+	emit_mem(buf, 1, 0x89, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_reg(buf, 1, 0x89, R_CPU, RDI);
+	emit_mov_imm64(buf, RAX, uint64_t(jit_grow_stack));
+	emit_reg(buf, 0, 0xFF, 2, RAX); // call rax
+	emit_reg(buf, 0, 0x85, RAX, RAX);
+	size_t grown = emit_jcc8(buf, CC_E);
+	emit_add_imm8(buf, RSP, 32);
+	emit_jmp(buf, stubs->exit);
+	jcc8_here(buf, grown);
+	emit_mem(buf, 1, 0x8B, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_mem(buf, 1, 0x8B, R_BASE, R_CPU, NO_INDEX, 0, OFF_BASE);
+	emit_mem(buf, 1, 0x8B, R_END, R_CPU, NO_INDEX, 0, OFF_END);
+	emit_pop(buf, RDX);
+	emit_pop(buf, RCX);
+	emit_pop(buf, RAX);
+	emit8(buf, 0xC3);
+
+	// Grows return stack
+	stubs->rgrow = buf->size;
+	emit_add_imm8(buf, RSP, -8);
+	emit_reg(buf, 1, 0x89, R_CPU, RDI);
+	emit_mov_imm64(buf, RAX, uint64_t(jit_grow_rstack));
+	emit_reg(buf, 0, 0xFF, 2, RAX);
+	emit_reg(buf, 0, 0x85, RAX, RAX);
+	size_t rgrown = emit_jcc8(buf, CC_E);
+	emit_add_imm8(buf, RSP, 16);
+	emit_jmp(buf, stubs->exit);
+	jcc8_here(buf, rgrown);
+	emit_add_imm8(buf, RSP, 8);
+	emit8(buf, 0xC3);
+}
+
+//======================================================================
+
+// Makes sure there are at least n elements on operand stack
+void emit_need(JitContext* ctx, size_t pc, int n)
+{
+	JitBuffer* buf = &ctx->buf;
+
+	emit_mem(buf, 1, 0x8D, RAX, R_BASE, NO_INDEX, 0, n * SLOT);
+	emit_reg(buf, 1, 0x39, RAX, R_TOP); // cmp rbx, rax
+	size_t ok = emit_jcc8(buf, CC_AE);
+	emit_mov_imm32(buf, RSI, pc);
+	emit_jmp(buf, ctx->stubs.underflow);
+	jcc8_here(buf, ok);
+}
+
+// Pushes rax on operand stack
+void emit_push_rax(JitContext* ctx)
+{
+	JitBuffer* buf = &ctx->buf;
+
+	emit_reg(buf, 1, 0x39, R_END, R_TOP); // cmp rbx, rbp
+	size_t ok = emit_jcc8(buf, CC_B);
+	emit_call(buf, ctx->stubs.grow);
+	jcc8_here(buf, ok);
+
+	emit_mem(buf, 1, 0x89, RAX, R_TOP, NO_INDEX, 0, 0);
+	emit_add_imm8(buf, R_TOP, SLOT);
+}
+
+
+// reg = base of memory region
+inline void emit_region(JitContext* ctx, int reg, int mem_id)
+{
+	emit_mem(&ctx->buf, 1, 0x8B, reg, R_MEM, NO_INDEX, 0, mem_id * 8);
+}
+
+// rcx = value of register, rax = base of LOCAL
+void emit_local_address(JitContext* ctx, const BinCommand* cmd)
+{
+	emit_region(ctx, RDX, ctx->ids.reg);
+	emit_mem(&ctx->buf, 1, 0x8B, RCX, RDX, NO_INDEX, 0, cmd->arg1 * SLOT);
+	emit_region(ctx, RAX, ctx->ids.local);
+}
+
+// Calls interpreter executor and continues from cpu->fetcher
+void emit_fallback(JitContext* ctx, const DecodedCommand* cmd, size_t pc)
+{
+	JitBuffer* buf = &ctx->buf;
+
+	emit_mem(buf, 1, 0x89, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_mem(buf, 1, 0xC7, 0, R_CPU, NO_INDEX, 0, OFF_FETCHER);
+	emit32(buf, pc);
+	emit_reg(buf, 1, 0x89, R_CPU, RDI);
+	emit_mov_imm64(buf, RSI, uint64_t(cmd));
+	emit_mov_imm64(buf, RAX, uint64_t(jit_call_executor));
+	emit_reg(buf, 0, 0xFF, 2, RAX);
+
+	// Executor could grow stack
+	emit_mem(buf, 1, 0x8B, R_TOP, R_CPU, NO_INDEX, 0, OFF_TOP);
+	emit_mem(buf, 1, 0x8B, R_BASE, R_CPU, NO_INDEX, 0, OFF_BASE);
+	emit_mem(buf, 1, 0x8B, R_END, R_CPU, NO_INDEX, 0, OFF_END);
+	emit_reg(buf, 0, 0x85, RAX, RAX);
+	emit_jcc(buf, CC_NE, ctx->stubs.exit);
+
+	emit_mem(buf, 1, 0x8B, RAX, R_CPU, NO_INDEX, 0, OFF_FETCHER);
+	emit_mem(buf, 0, 0xFF, 4, R_ADDR, RAX, 3, 0); // jmp [r13 + rax * 8]
+}
+
+inline int fits_disp(int32_t index)
+{
+	return index > -(1 << 28) && index < (1 << 28);
+}
+
+// Emits native code of command, returns 0 if command isn't supported
+int emit_command(JitContext* ctx, const DecodedCommand* decoded, size_t pc)
+{
+	JitBuffer* buf = &ctx->buf;
+	const JitIds* ids = &ctx->ids;
+
+	const BinCommand* cmd = &decoded->cmd;
+	int id = decoded->id;
+
+	int index = (cmd->arg2 == -1);
+	int region = (cmd->arg1 < ids->not_mem);
+	int inline_dynamic = !ctx->check_memory;
+
+	int arith = (	id == ids->add || id == ids->sub ||
+					id == ids->mul || id == ids->div);
+
+	if (id == ids->push && cmd->arg1 == ids->constant) {
+		emit_reg(buf, 1, 0xC7, 0, RAX); // mov rax, sign extended imm32
+		emit32(buf, cmd->arg2);
+		emit_push_rax(ctx);
+	}
+	else if (id == ids->push && region && index && inline_dynamic) {
+		emit_need(ctx, pc, 1);
+		emit_mem(buf, 1, 0x8B, RCX, R_TOP, NO_INDEX, 0, -SLOT);
+		emit_region(ctx, RAX, cmd->arg1);
+		emit_mem(buf, 1, 0x8B, RAX, RAX, RCX, 3, 0);
+		emit_mem(buf, 1, 0x89, RAX, R_TOP, NO_INDEX, 0, -SLOT);
+	}
+	else if (id == ids->push && region && !index && fits_disp(cmd->arg2)) {
+		emit_region(ctx, RAX, cmd->arg1);
+		emit_mem(buf, 1, 0x8B, RAX, RAX, NO_INDEX, 0, cmd->arg2 * SLOT);
+		emit_push_rax(ctx);
+	}
+	else if (id == ids->pop && region && index && inline_dynamic) {
+		emit_need(ctx, pc, 2);
+		emit_mem(buf, 1, 0x8B, RCX, R_TOP, NO_INDEX, 0, -SLOT);
+		emit_mem(buf, 1, 0x8B, RAX, R_TOP, NO_INDEX, 0, -2 * SLOT);
+		emit_add_imm8(buf, R_TOP, -2 * SLOT);
+		emit_region(ctx, RDX, cmd->arg1);
+		emit_mem(buf, 1, 0x89, RAX, RDX, RCX, 3, 0);
+	}
+	else if (id == ids->pop && region && !index && fits_disp(cmd->arg2)) {
+		emit_need(ctx, pc, 1);
+		emit_add_imm8(buf, R_TOP, -SLOT);
+		emit_mem(buf, 1, 0x8B, RAX, R_TOP, NO_INDEX, 0, 0);
+		emit_region(ctx, RDX, cmd->arg1);
+		emit_mem(buf, 1, 0x89, RAX, RDX, NO_INDEX, 0, cmd->arg2 * SLOT);
+	}
+	else if (arith && cmd->arg1 == TYPE_F64) {
+		// IEEE 754 needs no checks, even division by zero
+		emit_need(ctx, pc, 2);
+		emit8(buf, 0xF2);
+		emit_mem(buf, 0, 0x0F10, 0, R_TOP, NO_INDEX, 0, -SLOT);
+
+		uint32_t opcode = 	(id == ids->add) ? 0x0F58 :
+							(id == ids->sub) ? 0x0F5C :
+							(id == ids->mul) ? 0x0F59 : 0x0F5E;
+		emit8(buf, 0xF2);
+		emit_mem(buf, 0, opcode, 0, R_TOP, NO_INDEX, 0, -2 * SLOT);
+
+		emit8(buf, 0xF2);
+		emit_mem(buf, 0, 0x0F11, 0, R_TOP, NO_INDEX, 0, -2 * SLOT);
+		emit_add_imm8(buf, R_TOP, -SLOT);
+	}
+	else if (arith && (cmd->arg1 == TYPE_I32 || 
+			(cmd->arg1 == TYPE_I64 && id != ids->div))) {
+		// I32 is computed in 64 bits and truncated, so division
+		// of minimal value by -1 doesn't trap
+		int w = (cmd->arg1 == TYPE_I64);
+
+		emit_need(ctx, pc, 2);
+		emit_mem(buf, 1, 0x8B, RAX, R_TOP, NO_INDEX, 0, -SLOT);
+		emit_mem(buf, 1, 0x8B, RCX, R_TOP, NO_INDEX, 0, -2 * SLOT);
+
+		if (id == ids->add)
+			emit_reg(buf, w, 0x01, RCX, RAX);
+		else if (id == ids->sub)
+			emit_reg(buf, w, 0x29, RCX, RAX);
+		else if (id == ids->mul)
+			emit_reg(buf, w, 0x0FAF, RAX, RCX);
+		else {
+			emit_reg(buf, 0, 0x85, RCX, RCX);
+			size_t ok = emit_jcc8(buf, CC_NE);
+			emit_mov_imm32(buf, RSI, pc);
+			emit_jmp(buf, ctx->stubs.divzero);
+			jcc8_here(buf, ok);
+			emit_reg(buf, 1, 0x63, RAX, RAX);
+			emit_reg(buf, 1, 0x63, RCX, RCX);
+			emit8(buf, 0x48); // cqo
+			emit8(buf, 0x99);
+			emit_reg(buf, 1, 0xF7, 7, RCX);
+		}
+
+		if (!w)
+			emit_reg(buf, 1, 0x63, RAX, RAX); // movsxd rax, eax
+		emit_mem(buf, 1, 0x89, RAX, R_TOP, NO_INDEX, 0, -2 * SLOT);
+		emit_add_imm8(buf, R_TOP, -SLOT);
+	}
+	else if (id == ids->jump && ids->cond[cmd->arg1] == CC_NONE) {
+		emit_jmp_cmd(ctx, cmd->arg2);
+	}
+	else if (id == ids->jump && ids->cond[cmd->arg1] >= 0) {
+		emit_need(ctx, pc, 1);
+		emit_add_imm8(buf, R_TOP, -SLOT);
+		emit_mem(buf, 1, 0x8B, RAX, R_TOP, NO_INDEX, 0, 0);
+		emit_reg(buf, 1, 0x85, RAX, RAX);
+		emit_jcc_cmd(ctx, ids->cond[cmd->arg1], cmd->arg2);
+	}
+	else if (id == ids->call) {
+		emit_mem(buf, 1, 0x8B, RAX, R_CPU, NO_INDEX, 0, OFF_RTOP);
+		emit_mem(buf, 1, 0x3B, RAX, R_CPU, NO_INDEX, 0,
+				CPU_OFFSET(rstack.end));
+		size_t ok = emit_jcc8(buf, CC_B);
+		emit_call(buf, ctx->stubs.rgrow);
+		emit_mem(buf, 1, 0x8B, RAX, R_CPU, NO_INDEX, 0, OFF_RTOP);
+		jcc8_here(buf, ok);
+
+		emit_mem(buf, 1, 0xC7, 0, RAX, NO_INDEX, 0, 0);
+		emit32(buf, pc);
+		emit_add_imm8(buf, RAX, SLOT);
+		emit_mem(buf, 1, 0x89, RAX, R_CPU, NO_INDEX, 0, OFF_RTOP);
+		emit_jmp_cmd(ctx, cmd->arg2);
+	}
+	else if (id == ids->tailcall) {
+		emit_jmp_cmd(ctx, cmd->arg2);
+	}
+	else if (id == ids->ret) {
+		emit_mem(buf, 1, 0x8B, RAX, R_CPU, NO_INDEX, 0, OFF_RTOP);
+		emit_mem(buf, 1, 0x3B, RAX, R_CPU, NO_INDEX, 0, OFF_RBASE);
+		size_t ok = emit_jcc8(buf, CC_A);
+		emit_mov_imm32(buf, RSI, pc);
+		emit_jmp(buf, ctx->stubs.underflow);
+		jcc8_here(buf, ok);
+
+		emit_add_imm8(buf, RAX, -SLOT);
+		emit_mem(buf, 1, 0x89, RAX, R_CPU, NO_INDEX, 0, OFF_RTOP);
+		emit_mem(buf, 1, 0x8B, RAX, RAX, NO_INDEX, 0, 0);
+		// Continue after call
+		emit_mem(buf, 0, 0xFF, 4, R_ADDR, RAX, 3, 8);
+	}
+	else if (id == ids->loadlocal && inline_dynamic && fits_disp(cmd->arg2)) {
+		emit_local_address(ctx, cmd);
+		emit_mem(buf, 1, 0x8B, RAX, RAX, RCX, 3, cmd->arg2 * SLOT);
+		emit_push_rax(ctx);
+	}
+	else if (id == ids->storelocal && inline_dynamic && fits_disp(cmd->arg2)) {
+		emit_need(ctx, pc, 1);
+		emit_local_address(ctx, cmd);
+		emit_add_imm8(buf, R_TOP, -SLOT);
+		emit_mem(buf, 1, 0x8B, RDX, R_TOP, NO_INDEX, 0, 0);
+		emit_mem(buf, 1, 0x89, RDX, RAX, RCX, 3, cmd->arg2 * SLOT);
+	}
+	else if (id == ids->frameenter || id == ids->frameleave) {
+		// Fused ADD and SUB are I32, result is sign extended
+		emit_region(ctx, RDX, ids->reg);
+		emit_mem(buf, 0, 0x8B, RAX, RDX, NO_INDEX, 0, cmd->arg1 * SLOT);
+		emit_reg(buf, 0, 0x81, (id == ids->frameenter) ? 0 : 5, RAX);
+		emit32(buf, cmd->arg2);
+		emit_reg(buf, 1, 0x63, RAX, RAX); // movsxd rax, eax
+		emit_mem(buf, 1, 0x89, RAX, RDX, NO_INDEX, 0, cmd->arg1 * SLOT);
+	}
+	else return 0;
+
+	return 1;
+}
+
+//======================================================================
+
+void init_ids(JitIds* ids)
+{
+	ids->push = get_command_id("PUSH");
+	ids->pop = get_command_id("POP");
+	ids->add = get_command_id("ADD");
+	ids->sub = get_command_id("SUB");
+	ids->mul = get_command_id("MUL");
+	ids->div = get_command_id("DIV");
+	ids->jump = get_command_id("JUMP");
+	ids->call = get_command_id("CALL");
+	ids->tailcall = get_command_id("TAILCALL");
+	ids->ret = get_command_id("RETURN");
+	ids->loadlocal = get_command_id("LOADLOCAL");
+	ids->storelocal = get_command_id("STORELOCAL");
+	ids->frameenter = get_command_id("FRAMEENTER");
+	ids->frameleave = get_command_id("FRAMELEAVE");
+
+	ids->constant = get_mem_id("CONSTANT");
+	ids->in = get_mem_id("IN");
+	ids->out = get_mem_id("OUT");
+	ids->reg = get_mem_id("REGISTER");
+	ids->local = get_mem_id("LOCAL");
+	ids->not_mem = get_not_mem_id();
+
+	// Unknown conditions go to executor
+	for (int i = 0; i < 256; ++i)
+		ids->cond[i] = -2;
+
+	struct {
+		const char* name;
+		int cc;
+	} conds[] = {
+		{"UN", CC_NONE}, {"NEQ", CC_NE}, {"EQ", CC_E}, {"GT", CC_G},
+		{"LS", CC_L}, {"LEQ", CC_LE}, {"GEQ", CC_GE}
+	};
+
+	for (size_t i = 0; i < sizeof(conds) / sizeof(conds[0]); ++i)
+		for (int hex = 0; hex < 256; ++hex)
+			if (get_jmp_id(uint8_t(hex)) == get_jmp_id(conds[i].name))
+				ids->cond[hex] = conds[i].cc;
+}
+
+JitCode* JitCompile(const DecodedCommand* code, size_t ncommands, 
+					int check_memory)
+{
+	assert(code);
+
+	if (ncommands >= INT32_MAX)
+		return 0;
+
+	JitContext ctx = {};
+	ctx.check_memory = check_memory;
+	ctx.buf.capacity = 4096;
+	ctx.buf.data = reinterpret_cast<uint8_t*>(
+		exiting_malloc(ctx.buf.capacity)
+	);
+	ctx.fcapacity = 64;
+	ctx.fixups = reinterpret_cast<JitFixup*>(
+		exiting_malloc(ctx.fcapacity * sizeof(JitFixup))
+	);
+
+	init_ids(&ctx.ids);
+	emit_stubs(&ctx, ncommands);
+
+	size_t* offsets = reinterpret_cast<size_t*>(
+		exiting_malloc((ncommands + 1) * sizeof(size_t))
+	);
+
+	for (size_t pc = 0; pc < ncommands; ++pc) {
+		offsets[pc] = ctx.buf.size;
+
+		if (!emit_command(&ctx, code + pc, pc))
+			emit_fallback(&ctx, code + pc, pc);
+	}
+
+	offsets[ncommands] = ctx.buf.size;
+	emit_jmp(&ctx.buf, ctx.stubs.halt);
+
+	for (size_t i = 0; i < ctx.nfixups; ++i) {
+		size_t pos = ctx.fixups[i].pos;
+		patch32(&ctx.buf, pos,
+				uint32_t(offsets[ctx.fixups[i].target] - (pos + 4)));
+	}
+
+	JitCode* retval = 0;
+
+	void* mapped = mmap(0, ctx.buf.size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mapped != MAP_FAILED) {
+		memcpy(mapped, ctx.buf.data, ctx.buf.size);
+
+		if (mprotect(mapped, ctx.buf.size, PROT_READ | PROT_EXEC) == 0) {
+			retval = reinterpret_cast<JitCode*>(
+				exiting_malloc(sizeof(JitCode))
+			);
+
+			retval->code = reinterpret_cast<uint8_t*>(mapped);
+			retval->size = ctx.buf.size;
+			retval->ncommands = ncommands;
+			retval->addr = reinterpret_cast<void**>(
+				exiting_malloc((ncommands + 1) * sizeof(void*))
+			);
+
+			for (size_t pc = 0; pc <= ncommands; ++pc)
+				retval->addr[pc] = retval->code + offsets[pc];
+		}
+		else munmap(mapped, ctx.buf.size);
+	}
+
+	free(offsets);
+	free(ctx.fixups);
+	free(ctx.buf.data);
+
+	return retval;
+}
+
+int JitExecute(JitCode* jit, CPU* cpu)
+{
+	assert(jit);
+	assert(cpu);
+	assert(!cpu->stack.checked && !cpu->rstack.checked);
+	assert(cpu->fetcher <= jit->ncommands);
+
+	stack_el_t* regions[256] = {};
+	for (int i = 0; i < get_not_mem_id(); ++i)
+		regions[i] = MemoryRegion(cpu->memory, i);
+
+	JitEntry entry = reinterpret_cast<JitEntry>(jit->code);
+
+	return entry(cpu, jit->addr, regions, jit->addr[cpu->fetcher]);
+}
+
+void JitDeInit(JitCode* jit)
+{
+	if (!jit)
+		return;
+
+	munmap(jit->code, jit->size);
+	free(jit->addr);
+	free(jit);
+}
+
+#else
+
+struct JitCode {
+	int unused;
+};
+
+JitCode* JitCompile(const DecodedCommand* code, size_t ncommands, 
+					int check_memory)
+{
+	return 0;
+}
+
+int JitExecute(JitCode* jit, CPU* cpu)
+{
+	return 1;
+}
+
+void JitDeInit(JitCode* jit)
+{
+}
+
+#endif
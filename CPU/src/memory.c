@@ -1,12 +1,17 @@
 #include <string.h>
 #include <assert.h>
 
+#ifdef __unix__
+#include <sys/mman.h>
+#endif
+
 #include "memory.h"
 
+#include "diag.h"
 #include "exitingalloc.h"
 #include "foreachmacro.h"
 
-#define ARRAY_DEF(name, size) stack_el_t name[size];
+#define SIZE_COMMA(name, size) size,
 
 #define NAME(name, ...) name,
 
@@ -15,31 +20,25 @@
 #define LOC_ID(...) EVAL_CONCAT(LOC_, GET_1(__VA_ARGS__))
 #define LOC_ID_COMMA(...) LOC_ID(__VA_ARGS__),
 
-#define LOC_GETTER(...) 				\
-if (LOC_ID(__VA_ARGS__) == mem_id) 		\
-	return mem->GET_1(__VA_ARGS__);
-
 #define DECLARE_MEMORY(...)									\
-struct Memory {												\
-	FOR_EACH(ARRAY_DEF, __VA_ARGS__)						\
+const size_t mem_default_sizes[] = {						\
+	FOR_EACH(SIZE_COMMA, __VA_ARGS__)						\
 };															\
 const char* mem_names[] = {									\
 	FOR_EACH(NAME_STRING, __VA_ARGS__)						\
 	"CONSTANT",												\
 	"IN",													\
 	"OUT",													\
+	"IN_F64",												\
+	"OUT_F64",												\
 };															\
 enum MEM_ID 												\
 {															\
 	FOR_EACH(LOC_ID_COMMA, __VA_ARGS__)						\
 	NOT_MEM_ID												\
-};															\
-stack_el_t* get_mem_loc(Memory* mem, int mem_id)			\
-{															\
-	FOR_EACH(LOC_GETTER, __VA_ARGS__)						\
-	return 0;												\
-}
+};
 
+// Default sizes, .bin can change them with REGION directive
 DECLARE_MEMORY(	
 		(LOCAL, 128), 
 		(REGISTER, 128),
@@ -47,58 +46,247 @@ DECLARE_MEMORY(
 		(MEMORY, 1024)
 	)
 
+static_assert(NOT_MEM_ID == MEMORY_REGIONS, "Wrong number of memory regions");
+
 #define SIZE(x) (sizeof(x) / sizeof(0[x]))
 
-Memory* MemoryInit()
+inline int is_lazy(size_t size)
+{
+	return size * sizeof(stack_el_t) >= MEMORY_LAZY_SIZE;
+}
+
+#ifdef __unix__
+
+// Anonymous mapping is zero filled by kernel page by page,
+// so untouched part of region costs nothing
+stack_el_t* alloc_region(size_t size)
+{
+	if (!is_lazy(size))
+		return reinterpret_cast<stack_el_t*>(
+			exiting_calloc(size, sizeof(stack_el_t))
+		);
+	
+	void* mapped = mmap(0, size * sizeof(stack_el_t), 
+						PROT_READ | PROT_WRITE, 
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	
+	return (mapped == MAP_FAILED) ? 0 : reinterpret_cast<stack_el_t*>(mapped);
+}
+
+void free_region(stack_el_t* base, size_t size)
+{
+	if (is_lazy(size))
+		munmap(base, size * sizeof(stack_el_t));
+	else
+		free(base);
+}
+
+// Lazy region drops its pages, they are zeroed again on next access
+void clear_region(stack_el_t* base, size_t size)
+{
+	if (!is_lazy(size) || 
+		madvise(base, size * sizeof(stack_el_t), MADV_DONTNEED))
+		memset(base, 0, size * sizeof(stack_el_t));
+}
+
+#else
+
+stack_el_t* alloc_region(size_t size)
+{
+	return reinterpret_cast<stack_el_t*>(calloc(size, sizeof(stack_el_t)));
+}
+
+void free_region(stack_el_t* base, size_t size)
+{
+	free(base);
+}
+
+void clear_region(stack_el_t* base, size_t size)
+{
+	memset(base, 0, size * sizeof(stack_el_t));
+}
+
+#endif
+
+Memory* MemoryInit(const size_t* sizes, int checked)
 {
+	if (!sizes)
+		sizes = mem_default_sizes;
+	
 	Memory* retval = reinterpret_cast<Memory*>(
-						exiting_malloc(sizeof(Memory))
+						exiting_calloc(1, sizeof(Memory))
 					);
-					
+	
+	retval->checked = checked;
+	
+	for (int i = 0; i < MEMORY_REGIONS; ++i) {
+		retval->sizes[i] = sizes[i];
+		
+		if (sizes[i] > 0 && sizes[i] <= MEMORY_MAX_REGION)
+			retval->bases[i] = alloc_region(sizes[i]);
+		
+		if (!retval->bases[i]) {
+			diag_printf("## Error: failed to allocate %zu elements of %s\n",
+					sizes[i], mem_names[i]);
+			
+			MemoryDeInit(retval);
+			return 0;
+		}
+	}
+	
 	return retval;
 }
 
+size_t get_mem_default_size(int mem_id)
+{
+	return mem_default_sizes[mem_id];
+}
+
 int get_not_mem_id()
 {
 	return NOT_MEM_ID;
 }
 
-int get_mem_id(const char* name)
+int get_mem_id(const char* name, size_t len)
 {
 	for (int i = 0; i < SIZE(mem_names); ++i)
-		if (strcmp(mem_names[i], name) == 0)
+		if (strncmp(mem_names[i], name, len) == 0 && !mem_names[i][len])
 			return i;
 	
 	return -1;
 }
 
-int MemorySet(Memory* mem, int mem_id, int offset, stack_el_t val)
+const char* get_mem_name(int mem_id)
+{
+	return mem_names[mem_id];
+}
+
+int get_mem_id(const char* name)
+{
+	return get_mem_id(name, strlen(name));
+}
+
+int MemoryFault(const Memory* mem, int mem_id, int64_t offset)
 {
 	assert(mem);
 	
-	if ((mem_id >= 0) && (mem_id < NOT_MEM_ID)) {		
-		get_mem_loc(mem, mem_id)[offset] = val;
-		
+	diag_printf("## Error: %s %" PRId64 " is out of %zu elements\n",
+			mem_names[mem_id], offset, mem->sizes[mem_id]);
+	
+	return 1;
+}
+
+stack_el_t* MemoryRegion(Memory* mem, int mem_id)
+{
+	assert(mem);
+	
+	if (mem_id < 0 || mem_id >= MEMORY_REGIONS)
 		return 0;
+	
+	return mem->bases[mem_id];
+}
+
+size_t MemorySize(const Memory* mem)
+{
+	assert(mem);
+	
+	size_t size = 0;
+	for (int i = 0; i < MEMORY_REGIONS; ++i)
+		size += mem->sizes[i] * sizeof(stack_el_t);
+	
+	return size;
+}
+
+// Index after the last page of region
+#define PAGE_END (-1)
+
+inline int is_zero(const stack_el_t* data, size_t size)
+{
+	stack_el_t bits = 0;
+	for (size_t i = 0; i < size; ++i)
+		bits |= data[i];
+	
+	return bits == 0;
+}
+
+int MemoryWrite(const Memory* mem, FILE* fp, uint64_t* hash)
+{
+	assert(mem);
+	assert(fp);
+	assert(hash);
+	
+	for (int i = 0; i < MEMORY_REGIONS; ++i) {
+		size_t size = mem->sizes[i];
+		
+		for (size_t start = 0; start < size; start += MEMORY_PAGE) {
+			const stack_el_t* page = mem->bases[i] + start;
+			size_t len = (size - start < MEMORY_PAGE) ? size - start : MEMORY_PAGE;
+			if (is_zero(page, len))
+				continue;
+			
+			stack_el_t index = start / MEMORY_PAGE;
+			if (fwrite(&index, sizeof(index), 1, fp) != 1 ||
+				fwrite(page, sizeof(stack_el_t), len, fp) != len)
+				return 1;
+			
+			hash_elements(hash, &index, 1);
+			hash_elements(hash, page, len);
+		}
+		
+		stack_el_t end = PAGE_END;
+		if (fwrite(&end, sizeof(end), 1, fp) != 1)
+			return 1;
 	}
 	
-	return 1;
+	return 0;
 }
 
-int MemoryGet(Memory* mem, int mem_id, int offset, stack_el_t* val)
+int MemoryRead(Memory* mem, FILE* fp, uint64_t* hash)
 {
 	assert(mem);
+	assert(fp);
+	assert(hash);
 	
-	if ((mem_id >= 0) && (mem_id < NOT_MEM_ID)) { 
-		*val = get_mem_loc(mem, mem_id)[offset];
+	for (int i = 0; i < MEMORY_REGIONS; ++i) {
+		size_t size = mem->sizes[i];
+		clear_region(mem->bases[i], size);
 		
-		return 0;
+		// Pages follow in increasing order
+		stack_el_t next = 0;
+		while (1) {
+			stack_el_t index = 0;
+			if (fread(&index, sizeof(index), 1, fp) != 1)
+				return 1;
+			
+			if (index == PAGE_END)
+				break;
+			
+			if (index < next || uint64_t(index) * MEMORY_PAGE >= size)
+				return 1;
+			
+			size_t start = index * MEMORY_PAGE;
+			stack_el_t* page = mem->bases[i] + start;
+			size_t len = (size - start < MEMORY_PAGE) ? size - start : MEMORY_PAGE;
+			if (fread(page, sizeof(stack_el_t), len, fp) != len)
+				return 1;
+			
+			hash_elements(hash, &index, 1);
+			hash_elements(hash, page, len);
+			
+			next = index + 1;
+		}
 	}
 	
-	return 1;
+	return 0;
 }
 
 void MemoryDeInit(Memory* mem)
 {
+	assert(mem);
+	
+	for (int i = 0; i < MEMORY_REGIONS; ++i)
+		if (mem->bases[i])
+			free_region(mem->bases[i], mem->sizes[i]);
+	
 	free(mem);
 }
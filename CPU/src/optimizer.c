@@ -0,0 +1,213 @@
+#include <assert.h>
+#include <string.h>
+
+#include "optimizer.h"
+
+#include "command.h"
+#include "memory.h"
+#include "exitingalloc.h"
+
+#define INDEX_ARG (-1)
+
+struct Opcodes {
+	uint8_t push;
+	uint8_t pop;
+	uint8_t add;
+	uint8_t sub;
+	
+	uint8_t call;
+	uint8_t tailcall;
+	uint8_t ret;
+	
+	uint8_t loadlocal;
+	uint8_t storelocal;
+	uint8_t frameenter;
+	uint8_t frameleave;
+	
+	int constant;
+	int reg;
+	int local;
+};
+
+typedef struct Opcodes Opcodes;
+
+inline uint8_t binary(const char* name)
+{
+	int id = get_command_id(name);
+	assert(id >= 0);
+	
+	return get_command_binary(id);
+}
+
+inline int is_cmd(const BinCommand* cmd, uint8_t type, int arg1, int arg2)
+{
+	return cmd->type == type && cmd->arg1 == arg1 && cmd->arg2 == arg2;
+}
+
+inline int is_push_const(const Opcodes* op, const BinCommand* cmd)
+{
+	return cmd->type == op->push && cmd->arg1 == op->constant;
+}
+
+inline int is_push_reg(const Opcodes* op, const BinCommand* cmd)
+{
+	return 	cmd->type == op->push && cmd->arg1 == op->reg &&
+			cmd->arg2 >= 0 && cmd->arg2 <= UINT8_MAX;
+}
+
+/* Matches register + constant on stack in any order:
+ *	PUSH CONSTANT k | PUSH REGISTER r
+ *	PUSH REGISTER r | PUSH CONSTANT k
+ *	ADD             | ADD
+ */
+inline int match_reg_plus_const(const Opcodes* op, const BinCommand* cmds,
+								int* reg, int* constant)
+{
+	if (cmds[2].type != op->add || cmds[2].arg1 != TYPE_I32)
+		return 0;
+	
+	if (is_push_const(op, cmds) && is_push_reg(op, cmds + 1)) {
+		*constant = cmds[0].arg2;
+		*reg = cmds[1].arg2;
+		
+		return 1;
+	}
+	
+	if (is_push_reg(op, cmds) && is_push_const(op, cmds + 1)) {
+		*reg = cmds[0].arg2;
+		*constant = cmds[1].arg2;
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* Matches register - constant on stack:
+ *	PUSH CONSTANT k
+ *	PUSH REGISTER r
+ *	SUB
+ */
+inline int match_reg_minus_const(const Opcodes* op, const BinCommand* cmds,
+								int* reg, int* constant)
+{
+	if (cmds[2].type != op->sub || cmds[2].arg1 != TYPE_I32 ||
+		!is_push_const(op, cmds) || 
+		!is_push_reg(op, cmds + 1))
+		return 0;
+	
+	*constant = cmds[0].arg2;
+	*reg = cmds[1].arg2;
+	
+	return 1;
+}
+
+/* Tries to fuse 4 commands starting from cmds into one
+ * @return 1 if fused
+ */
+inline int fuse(const Opcodes* op, const BinCommand* cmds, BinCommand* fused)
+{
+	int reg = 0;
+	int constant = 0;
+	
+	const BinCommand* last = cmds + 3;
+	
+	if (match_reg_plus_const(op, cmds, &reg, &constant)) {
+		if (is_cmd(last, op->pop, op->local, INDEX_ARG))
+			*fused = {op->storelocal, uint8_t(reg), 0, constant};
+		else if (is_cmd(last, op->push, op->local, INDEX_ARG))
+			*fused = {op->loadlocal, uint8_t(reg), 0, constant};
+		else if (is_cmd(last, op->pop, op->reg, reg))
+			*fused = {op->frameenter, uint8_t(reg), 0, constant};
+		else
+			return 0;
+		
+		return 1;
+	}
+	
+	if (match_reg_minus_const(op, cmds, &reg, &constant) &&
+		is_cmd(last, op->pop, op->reg, reg)) {
+		*fused = {op->frameleave, uint8_t(reg), 0, constant};
+		
+		return 1;
+	}
+	
+	return 0;
+}
+
+#define PATTERN_SIZE (4)
+
+int OptimizeCommands(CommandsContainer* container)
+{
+	assert(container);
+	
+	Opcodes op = {
+		binary("PUSH"), binary("POP"), binary("ADD"), binary("SUB"),
+		binary("CALL"), binary("TAILCALL"), binary("RETURN"),
+		binary("LOADLOCAL"), binary("STORELOCAL"),
+		binary("FRAMEENTER"), binary("FRAMELEAVE"),
+		get_mem_id("CONSTANT"), get_mem_id("REGISTER"), get_mem_id("LOCAL")
+	};
+	
+	size_t ncommands = container->file->ncommands;
+	BinCommand* cmds = container->file->commands;
+	
+	// Commands that labels point to can't be inside fused sequence
+	uint8_t* target = reinterpret_cast<uint8_t*>(
+		exiting_calloc(ncommands + 1, sizeof(uint8_t))
+	);
+	
+	// Undefined labels are reported by CContainerPushLabels
+	for (size_t i = 0; i < container->lsize; ++i)
+		if (container->labels[i].ncommand >= 0)
+			target[container->labels[i].ncommand] = 1;
+	
+	// New position of every command, including end of code
+	int* remap = reinterpret_cast<int*>(
+		exiting_malloc((ncommands + 1) * sizeof(int))
+	);
+	
+	size_t out = 0;
+	for (size_t i = 0; i < ncommands; ) {
+		BinCommand fused = {};
+		
+		if (i + PATTERN_SIZE <= ncommands &&
+			!target[i + 1] && !target[i + 2] && !target[i + 3] &&
+			fuse(&op, cmds + i, &fused)) {
+			for (size_t j = 0; j < PATTERN_SIZE; ++j)
+				remap[i + j] = out;
+			
+			cmds[out++] = fused;
+			i += PATTERN_SIZE;
+		}
+		// CALL x; RETURN is TAILCALL x, RETURN stays if something jumps to it
+		else if (i + 1 < ncommands &&
+				cmds[i].type == op.call && cmds[i + 1].type == op.ret) {
+			remap[i] = out;
+			cmds[out++] = {op.tailcall, 0, 0, cmds[i].arg2};
+			
+			if (target[i + 1]) {
+				remap[i + 1] = out;
+				cmds[out++] = cmds[i + 1];
+			}
+			i += 2;
+		}
+		else {
+			remap[i] = out;
+			cmds[out++] = cmds[i++];
+		}
+	}
+	remap[ncommands] = out;
+	
+	container->file->ncommands = out;
+	
+	for (size_t i = 0; i < container->lsize; ++i)
+		if (container->labels[i].ncommand >= 0)
+			container->labels[i].ncommand = 
+				remap[container->labels[i].ncommand];
+	
+	free(remap);
+	free(target);
+	
+	return 0;
+}
@@ -0,0 +1,408 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profiler.h"
+
+#include "command.h"
+#include "exitingalloc.h"
+
+#define HOT_COMMANDS (20)
+
+#define ROOT_NODE (0)
+#define NO_NODE (SIZE_MAX)
+
+inline uint64_t profile_clock()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	timespec ts = {};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Node of call tree, one for every distinct chain of calls
+struct CallNode {
+	// Address of called function, ncommands for root
+	size_t entry;
+
+	size_t parent;
+	size_t child;
+	size_t sibling;
+
+	// Cycles of the function itself, without callees
+	uint64_t cycles;
+};
+
+typedef struct CallNode CallNode;
+
+struct Profile {
+	const BinaryFile* code;
+	size_t ncommands;
+
+	// Per address
+	uint64_t* counts;
+	uint64_t* cycles;
+
+	// Per command id
+	uint64_t* op_counts;
+
+	CallNode* nodes;
+	size_t nnodes;
+	size_t ncapacity;
+
+	// Node of currently executed function
+	size_t current;
+};
+
+//======================================================================
+
+size_t add_node(Profile* profile, size_t parent, size_t entry)
+{
+	if (profile->nnodes == profile->ncapacity) {
+		profile->ncapacity *= 2;
+		profile->nodes = reinterpret_cast<CallNode*>(
+			exiting_realloc(profile->nodes,
+							profile->ncapacity * sizeof(CallNode))
+		);
+	}
+
+	size_t retval = profile->nnodes++;
+	profile->nodes[retval] = {entry, parent, NO_NODE, NO_NODE, 0};
+
+	if (parent != NO_NODE) {
+		profile->nodes[retval].sibling = profile->nodes[parent].child;
+		profile->nodes[parent].child = retval;
+	}
+
+	return retval;
+}
+
+inline size_t call_node(Profile* profile, size_t parent, size_t entry)
+{
+	for (	size_t node = profile->nodes[parent].child;
+			node != NO_NODE;
+			node = profile->nodes[node].sibling)
+		if (profile->nodes[node].entry == entry)
+			return node;
+
+	return add_node(profile, parent, entry);
+}
+
+Profile* ProfileInit(const BinaryFile* code)
+{
+	assert(code);
+
+	Profile* retval = reinterpret_cast<Profile*>(
+		exiting_malloc(sizeof(Profile))
+	);
+
+	retval->code = code;
+	retval->ncommands = code->ncommands;
+
+	retval->counts = reinterpret_cast<uint64_t*>(
+		exiting_calloc(code->ncommands + 1, sizeof(uint64_t))
+	);
+	retval->cycles = reinterpret_cast<uint64_t*>(
+		exiting_calloc(code->ncommands + 1, sizeof(uint64_t))
+	);
+	retval->op_counts = reinterpret_cast<uint64_t*>(
+		exiting_calloc(get_not_command_id(), sizeof(uint64_t))
+	);
+
+	retval->nnodes = 0;
+	retval->ncapacity = 64;
+	retval->nodes = reinterpret_cast<CallNode*>(
+		exiting_malloc(retval->ncapacity * sizeof(CallNode))
+	);
+
+	retval->current = add_node(retval, NO_NODE, code->ncommands);
+
+	return retval;
+}
+
+int ProfileExecute(Profile* profile, CPU* cpu)
+{
+	assert(profile);
+	assert(cpu);
+
+	const int call_id = get_command_id("CALL");
+	const int tailcall_id = get_command_id("TAILCALL");
+	const int return_id = get_command_id("RETURN");
+
+	const DecodedCommand* code = cpu->decoded;
+	size_t ncommands = profile->ncommands;
+
+	while (cpu->fetcher < ncommands) {
+		if (cpu->budget == 0)
+			return CPU_BUDGET;
+		cpu->budget--;
+
+		size_t pc = cpu->fetcher;
+		const DecodedCommand* fetched = code + pc;
+
+		uint64_t start = profile_clock();
+		int error = get_executor(fetched->id)(cpu, fetched->cmd);
+		uint64_t spent = profile_clock() - start;
+
+		profile->counts[pc]++;
+		profile->cycles[pc] += spent;
+		profile->op_counts[fetched->id]++;
+		profile->nodes[profile->current].cycles += spent;
+
+		if (error)
+			return error;
+
+		if (fetched->id == call_id)
+			profile->current = call_node(	profile, profile->current,
+											cpu->fetcher);
+		// Callee of tail call takes place of its caller
+		else if (fetched->id == tailcall_id) {
+			size_t parent = profile->nodes[profile->current].parent;
+			if (profile->current == ROOT_NODE)
+				parent = ROOT_NODE;
+			
+			profile->current = call_node(profile, parent, cpu->fetcher);
+		}
+		else if (fetched->id == return_id &&
+				profile->current != ROOT_NODE)
+			profile->current = profile->nodes[profile->current].parent;
+	}
+
+	if (cpu->fetcher > ncommands) {
+		printf("## Error: bad return address\n");
+
+		return 1;
+	}
+
+	return 0;
+}
+
+//======================================================================
+
+struct ProfileRow {
+	size_t index;
+	uint64_t value;
+};
+
+typedef struct ProfileRow ProfileRow;
+
+int compare_rows(const void* a, const void* b)
+{
+	uint64_t first = reinterpret_cast<const ProfileRow*>(a)->value;
+	uint64_t second = reinterpret_cast<const ProfileRow*>(b)->value;
+
+	return (first < second) - (first > second);
+}
+
+inline double percent(uint64_t part, uint64_t total)
+{
+	return total ? 100.0 * part / total : 0.0;
+}
+
+// Name of first label at every address, NULL if there is no label
+const char** label_names(const Profile* profile)
+{
+	const char** retval = reinterpret_cast<const char**>(
+		exiting_calloc(profile->ncommands + 1, sizeof(char*))
+	);
+
+	size_t nlabels = 0;
+	LabelEntry* labels = BinaryFileLabels(profile->code, &nlabels);
+
+	for (size_t i = nlabels; i-- > 0; )
+		retval[labels[i].ncommand] = labels[i].name;
+
+	free(labels);
+
+	return retval;
+}
+
+void write_report(const Profile* profile, const char** names, FILE* fp)
+{
+	size_t ncommands = profile->ncommands;
+
+	uint64_t total_count = 0;
+	uint64_t total_cycles = 0;
+	for (size_t pc = 0; pc < ncommands; ++pc) {
+		total_count += profile->counts[pc];
+		total_cycles += profile->cycles[pc];
+	}
+
+	fprintf(fp, "Executed commands: %llu\n", (unsigned long long)total_count);
+	fprintf(fp, "Measured cycles:   %llu\n", (unsigned long long)total_cycles);
+
+	size_t nrows = (ncommands > size_t(get_not_command_id())) ?
+					ncommands : get_not_command_id();
+	ProfileRow* rows = reinterpret_cast<ProfileRow*>(
+		exiting_malloc((nrows + 1) * sizeof(ProfileRow))
+	);
+
+	// Opcodes
+	size_t nops = get_not_command_id();
+	for (size_t id = 0; id < nops; ++id)
+		rows[id] = {id, profile->op_counts[id]};
+	qsort(rows, nops, sizeof(ProfileRow), compare_rows);
+
+	fprintf(fp, "\nOpcodes:\n%-12s %20s %8s\n", "name", "count", "%");
+	for (size_t i = 0; i < nops && rows[i].value; ++i)
+		fprintf(fp, "%-12s %20llu %7.2f%%\n",
+				get_command_name(rows[i].index),
+				(unsigned long long)rows[i].value,
+				percent(rows[i].value, total_count));
+
+	// Label regions, every region lasts until the next label
+	fprintf(fp, "\nLabel regions:\n%-24s %8s %20s %20s %8s\n",
+			"label", "start", "commands", "cycles", "%");
+
+	const char* region = "(entry)";
+	size_t start = 0;
+	uint64_t count = 0;
+	uint64_t cycles = 0;
+
+	for (size_t pc = 0; pc <= ncommands; ++pc) {
+		if (pc == ncommands || names[pc]) {
+			if (count)
+				fprintf(fp, "%-24s %8zu %20llu %20llu %7.2f%%\n",
+						region, start,
+						(unsigned long long)count,
+						(unsigned long long)cycles,
+						percent(cycles, total_cycles));
+
+			if (pc < ncommands)
+				region = names[pc];
+
+			start = pc;
+			count = 0;
+			cycles = 0;
+		}
+
+		if (pc < ncommands) {
+			count += profile->counts[pc];
+			cycles += profile->cycles[pc];
+		}
+	}
+
+	// Hot commands
+	for (size_t pc = 0; pc < ncommands; ++pc)
+		rows[pc] = {pc, profile->cycles[pc]};
+	qsort(rows, ncommands, sizeof(ProfileRow), compare_rows);
+
+	fprintf(fp, "\nHot commands:\n%8s %-12s %20s %20s %8s\n",
+			"address", "name", "count", "cycles", "%");
+	for (size_t i = 0; i < ncommands && i < HOT_COMMANDS && rows[i].value; ++i) {
+		size_t pc = rows[i].index;
+
+		fprintf(fp, "%8zu %-12s %20llu %20llu %7.2f%%\n", pc,
+				get_command_name(get_command_id(profile->code->commands[pc].type)),
+				(unsigned long long)profile->counts[pc],
+				(unsigned long long)rows[i].value,
+				percent(rows[i].value, total_cycles));
+	}
+
+	free(rows);
+}
+
+inline void write_frame_name(const Profile* profile, const char** names,
+							size_t entry, FILE* fp)
+{
+	if (entry == profile->ncommands)
+		fputs("main", fp);
+	else if (names[entry])
+		fputs(names[entry], fp);
+	else
+		fprintf(fp, "L%zu", entry);
+}
+
+// One line for every call chain: "main;f;g cycles"
+void write_folded(const Profile* profile, const char** names, FILE* fp)
+{
+	size_t* chain = reinterpret_cast<size_t*>(
+		exiting_malloc(profile->nnodes * sizeof(size_t))
+	);
+
+	for (size_t node = 0; node < profile->nnodes; ++node) {
+		if (!profile->nodes[node].cycles)
+			continue;
+
+		size_t depth = 0;
+		for (size_t cur = node; cur != NO_NODE; cur = profile->nodes[cur].parent)
+			chain[depth++] = cur;
+
+		while (depth--) {
+			write_frame_name(profile, names,
+							profile->nodes[chain[depth]].entry, fp);
+			fputc(depth ? ';' : ' ', fp);
+		}
+
+		fprintf(fp, "%llu\n", (unsigned long long)profile->nodes[node].cycles);
+	}
+
+	free(chain);
+}
+
+FILE* open_report(const char* prefix, const char* suffix)
+{
+	size_t len = strlen(prefix) + strlen(suffix) + 1;
+	char* name = reinterpret_cast<char*>(exiting_malloc(len));
+
+	strcpy(name, prefix);
+	strcat(name, suffix);
+
+	FILE* fp = fopen(name, "w");
+	if (!fp)
+		printf("## Error: failed to open %s\n", name);
+
+	free(name);
+
+	return fp;
+}
+
+int ProfileWrite(const Profile* profile, const char* prefix)
+{
+	assert(profile);
+	assert(prefix);
+
+	const char** names = label_names(profile);
+
+	FILE* report = open_report(prefix, ".txt");
+	FILE* folded = open_report(prefix, ".folded");
+
+	if (report)
+		write_report(profile, names, report);
+	if (folded)
+		write_folded(profile, names, folded);
+
+	int error = !report || !folded;
+
+	if (report && fclose(report))
+		error = 1;
+	if (folded && fclose(folded))
+		error = 1;
+
+	free(reinterpret_cast<void*>(names));
+
+	return error;
+}
+
+void ProfileDeInit(Profile* profile)
+{
+	if (!profile)
+		return;
+
+	free(profile->counts);
+	free(profile->cycles);
+	free(profile->op_counts);
+	free(profile->nodes);
+	free(profile);
+}
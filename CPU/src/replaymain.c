@@ -0,0 +1,294 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "binaryfile.h"
+#include "command.h"
+#include "cpu.h"
+#include "memory.h"
+#include "trace.h"
+#include "exitingalloc.h"
+
+inline int print_usage(const char* name)
+{
+	printf("## Replayer of cpu traces\n");
+	printf("## By InversionSpaces\n");
+	printf("## Runs BIN_FILE again with IN of TRACE_FILE written by cpu --trace\n");
+	printf("## and checks every command against trace\n");
+	printf("## Usage: %s [--counts FILE] BIN_FILE TRACE_FILE\n", name);
+	printf("## Options:\n");
+	printf("##   --counts FILE\twrite lines of address, count and name\n");
+	printf("##   \t\tof every executed command\n");
+
+	return 0;
+}
+
+static const int push_id = get_command_id("PUSH");
+static const int mem_in = get_mem_id("IN");
+static const int mem_in_f64 = get_mem_id("IN_F64");
+
+inline int is_input(int id, BinCommand cmd)
+{
+	return id == push_id && (cmd.arg1 == mem_in || cmd.arg1 == mem_in_f64);
+}
+
+struct Replay {
+	const BinaryFile* file;
+	CPU* cpu;
+	TraceReader* reader;
+
+	// Executions of every command
+	uint64_t* counts;
+	uint64_t nrecords;
+};
+
+typedef struct Replay Replay;
+
+inline const char* name_at(const Replay* replay, size_t pc)
+{
+	if (pc >= replay->file->ncommands)
+		return "halt";
+
+	return get_command_name(replay->cpu->decoded[pc].id);
+}
+
+// Replayed command at pc and top of stack after it
+void print_mismatch(const Replay* replay, const TraceRecord* record,
+					size_t pc, const char* what)
+{
+	const CPU* cpu = replay->cpu;
+
+	printf("## Mismatch at record %" PRIu64 ": %s\n", replay->nrecords, what);
+	printf("##   trace:  %zu %s, top %" PRId64 "\n", record->pc,
+			(record->id < get_not_command_id()) ?
+				get_command_name(record->id) : "unknown",
+			record->tos);
+
+	size_t size = VMStackSize(&cpu->stack);
+	stack_el_t tos = size ? VMStackData(&cpu->stack)[size - 1] : 0;
+	printf("##   replay: %zu %s, top %" PRId64 "\n", pc,
+			name_at(replay, pc), tos);
+}
+
+// PUSH IN and IN_F64 take recorded values instead of reading
+int replay_in(Replay* replay, BinCommand cmd)
+{
+	CPU* cpu = replay->cpu;
+
+	cpu->fetcher++;
+	for (int i = 0; i < cmd.arg2; ++i) {
+		stack_el_t val = 0;
+		if (TraceReadIn(replay->reader, &val))
+			return 1;
+
+		int error = VMStackPush(&cpu->stack, val);
+		if (error)
+			return error;
+	}
+
+	return 0;
+}
+
+// Checks end of trace, failed command is executed again
+int replay_end(Replay* replay, const TraceRecord* record)
+{
+	CPU* cpu = replay->cpu;
+
+	if (record->pc != cpu->fetcher) {
+		print_mismatch(replay, record, cpu->fetcher, "trace ends at other address");
+
+		return 1;
+	}
+
+	if (record->status == CPU_BUDGET) {
+		printf("## Trace of stopped cpu ends at %zu\n", record->pc);
+
+		return 0;
+	}
+
+	if (record->status == 0 || cpu->fetcher >= replay->file->ncommands)
+		return 0;
+
+	// Failed input is not recorded
+	const DecodedCommand* fetched = cpu->decoded + cpu->fetcher;
+	if (is_input(fetched->id, fetched->cmd)) {
+		printf("## Trace ends with failed input at %zu\n", record->pc);
+
+		return 0;
+	}
+
+	int error = get_executor(fetched->id)(cpu, fetched->cmd);
+	if (error != record->status) {
+		printf("## Mismatch at end of trace: status %d, replay %d\n",
+				record->status, error);
+
+		return 1;
+	}
+
+	printf("## Trace ends with error %d at %zu %s\n", record->status,
+			record->pc, get_command_name(fetched->id));
+
+	return 0;
+}
+
+int replay_trace(Replay* replay)
+{
+	CPU* cpu = replay->cpu;
+	size_t ncommands = replay->file->ncommands;
+
+	for (;;) {
+		TraceRecord record = {};
+		if (TraceRead(replay->reader, &record)) {
+			printf("## Error: trace is cut after %" PRIu64 " records\n",
+					replay->nrecords);
+
+			return 1;
+		}
+
+		if (record.end)
+			return replay_end(replay, &record);
+
+		size_t pc = cpu->fetcher;
+		if (pc >= ncommands || record.pc != pc ||
+			record.id != cpu->decoded[pc].id) {
+			print_mismatch(replay, &record, pc, "other command");
+
+			return 1;
+		}
+
+		BinCommand cmd = cpu->decoded[pc].cmd;
+		int error = 0;
+		if (is_input(record.id, cmd))
+			error = replay_in(replay, cmd);
+		else
+			error = get_executor(record.id)(cpu, cmd);
+
+		if (error && error != CPU_SNAPSHOT) {
+			printf("## Mismatch at record %" PRIu64 ": %zu %s failed with %d\n",
+					replay->nrecords, pc, get_command_name(record.id), error);
+
+			return 1;
+		}
+
+		size_t size = VMStackSize(&cpu->stack);
+		stack_el_t tos = size ? VMStackData(&cpu->stack)[size - 1] : 0;
+		if (tos != record.tos) {
+			print_mismatch(replay, &record, pc, "other top of stack");
+
+			return 1;
+		}
+
+		replay->counts[pc]++;
+		replay->nrecords++;
+	}
+}
+
+int write_counts(const Replay* replay, const char* fname)
+{
+	FILE* fp = fopen(fname, "w");
+	if (!fp) {
+		printf("## Error: failed to open %s\n", fname);
+
+		return 1;
+	}
+
+	for (size_t pc = 0; pc < replay->file->ncommands; ++pc)
+		if (replay->counts[pc])
+			fprintf(fp, "%zu %" PRIu64 " %s\n", pc, replay->counts[pc],
+					name_at(replay, pc));
+
+	if (fclose(fp)) {
+		printf("## Error: failed to write %s\n", fname);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* bin_name = 0;
+	const char* trace_name = 0;
+	const char* counts_name = 0;
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--counts") == 0 && i + 1 < argc)
+			counts_name = argv[++i];
+		else if (argv[i][0] != '-' && !bin_name)
+			bin_name = argv[i];
+		else if (argv[i][0] != '-' && !trace_name)
+			trace_name = argv[i];
+		else
+			return print_usage(argv[0]);
+	}
+
+	if (!bin_name || !trace_name)
+		return print_usage(argv[0]);
+
+	BinaryFile* file = BinaryFileMap(bin_name);
+	if (!file) {
+		printf("## Error loading binary file\n");
+
+		return 1;
+	}
+
+	TraceHeader header = {};
+	TraceReader* reader = TraceOpen(trace_name, &header);
+	if (!reader) {
+		BinaryFileUnmap(file);
+
+		return 1;
+	}
+
+	if (header.code_checksum != file->checksum ||
+		header.code_ncommands != file->ncommands) {
+		printf("## Error: trace %s was recorded on different code\n", trace_name);
+
+		TraceClose(reader);
+		BinaryFileUnmap(file);
+		return 1;
+	}
+
+	// Output is already checked by top of stack
+	CPUConfig config;
+	CPUConfigInit(&config);
+	config.verify = 0;
+	config.in_fd = open("/dev/null", O_RDONLY);
+	config.out_fd = open("/dev/null", O_WRONLY);
+
+	Replay replay = {};
+	replay.file = file;
+	replay.reader = reader;
+	replay.cpu = CPUInit(file, &config);
+
+	int error = !replay.cpu || config.in_fd < 0 || config.out_fd < 0;
+	if (!error) {
+		replay.counts = reinterpret_cast<uint64_t*>(
+			exiting_calloc(file->ncommands + 1, sizeof(uint64_t))
+		);
+
+		error = replay_trace(&replay);
+		printf("## Replayed %" PRIu64 " commands\n", replay.nrecords);
+
+		if (counts_name && write_counts(&replay, counts_name))
+			error = 1;
+
+		if (!error)
+			printf("## Trace matches\n");
+	}
+
+	if (replay.cpu)
+		CPUDeInit(replay.cpu);
+	close(config.in_fd);
+	close(config.out_fd);
+
+	free(replay.counts);
+	TraceClose(reader);
+	BinaryFileUnmap(file);
+
+	return error;
+}
@@ -0,0 +1,214 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#include "command.h"
+#include "jit.h"
+#include "exitingalloc.h"
+
+// Writes stack elements from bottom to top
+inline int write_stack(const VMStack* stack, FILE* fp)
+{
+	size_t size = VMStackSize(stack);
+	
+	return fwrite(VMStackData(stack), sizeof(stack_el_t), size, fp) != size;
+}
+
+// Adds stacks to checksum of memory pages
+uint32_t state_checksum(const CPU* cpu, uint64_t hash)
+{
+	hash_elements(&hash, VMStackData(&cpu->stack), VMStackSize(&cpu->stack));
+	hash_elements(&hash, VMStackData(&cpu->rstack), VMStackSize(&cpu->rstack));
+	
+	return uint32_t(hash ^ (hash >> 32));
+}
+
+// Reads size elements to empty stack
+int read_stack(VMStack* stack, size_t size, FILE* fp)
+{
+	stack_el_t buffer[256] = {};
+	
+	while (VMStackSize(stack)) {
+		stack_el_t tmp = 0;
+		VMStackPop(stack, &tmp);
+	}
+	
+	while (size) {
+		size_t chunk = (size < 256) ? size : 256;
+		if (fread(buffer, sizeof(stack_el_t), chunk, fp) != chunk)
+			return 1;
+		
+		for (size_t i = 0; i < chunk; ++i)
+			if (VMStackPush(stack, buffer[i]) != NO_ERROR)
+				return 1;
+		
+		size -= chunk;
+	}
+	
+	return 0;
+}
+
+int SnapshotWrite(CPU* cpu, const char* fname)
+{
+	assert(cpu);
+	assert(fname);
+	
+	// Output before snapshot must not be repeated after restore
+	VMIOFlush(&cpu->io);
+	
+	SnapshotHeader header = {};
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.header_size = sizeof(SnapshotHeader);
+	header.code_checksum = cpu->code->checksum;
+	header.code_ncommands = cpu->code->ncommands;
+	header.fetcher = cpu->fetcher;
+	header.memory_size = MemorySize(cpu->memory);
+	header.stack_size = VMStackSize(&cpu->stack);
+	header.rstack_size = VMStackSize(&cpu->rstack);
+	
+	size_t len = strlen(fname);
+	char* tmp_name = reinterpret_cast<char*>(exiting_malloc(len + 5));
+	strcpy(tmp_name, fname);
+	strcat(tmp_name, ".tmp");
+	
+	FILE* fp = fopen(tmp_name, "wb");
+	if (!fp) {
+		printf("## Error: failed to open %s\n", tmp_name);
+		
+		free(tmp_name);
+		return 1;
+	}
+	
+	// Checksum is known after pages are written, header is rewritten
+	uint64_t hash = 0;
+	int error = fwrite(&header, sizeof(header), 1, fp) != 1;
+	if (!error)
+		error = MemoryWrite(cpu->memory, fp, &hash);
+	if (!error)
+		error = write_stack(&cpu->stack, fp);
+	if (!error)
+		error = write_stack(&cpu->rstack, fp);
+	
+	header.checksum = state_checksum(cpu, hash);
+	if (!error)
+		error = fseek(fp, 0, SEEK_SET) || 
+				fwrite(&header, sizeof(header), 1, fp) != 1;
+	
+	if (fclose(fp))
+		error = 1;
+	
+	if (!error)
+		error = rename(tmp_name, fname) != 0;
+	
+	if (error) {
+		printf("## Error: failed to write snapshot %s\n", fname);
+		
+		remove(tmp_name);
+	}
+	
+	free(tmp_name);
+	
+	return error;
+}
+
+int SnapshotRead(CPU* cpu, const char* fname)
+{
+	assert(cpu);
+	assert(fname);
+	
+	// Shared code can't stop being verified for one cpu
+	if (!cpu->own_code && (cpu->verified || !cpu->memory->checked)) {
+		printf("## Error: snapshot can't be restored on shared code\n");
+		
+		return 1;
+	}
+	
+	FILE* fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("## Error: failed to open %s\n", fname);
+		
+		return 1;
+	}
+	
+	SnapshotHeader header = {};
+	int error = fread(&header, sizeof(header), 1, fp) != 1;
+	
+	if (!error && (	header.magic != SNAPSHOT_MAGIC ||
+					header.version != SNAPSHOT_VERSION ||
+					header.header_size != sizeof(SnapshotHeader))) {
+		printf("## Error: %s is not a snapshot\n", fname);
+		
+		fclose(fp);
+		return 1;
+	}
+	
+	if (!error && (	header.code_checksum != cpu->code->checksum ||
+					header.code_ncommands != cpu->code->ncommands ||
+					header.fetcher > header.code_ncommands)) {
+		printf("## Error: snapshot %s was taken on different code\n", fname);
+		
+		fclose(fp);
+		return 1;
+	}
+	
+	uint64_t hash = 0;
+	if (!error)
+		error = header.memory_size != MemorySize(cpu->memory) ||
+				MemoryRead(cpu->memory, fp, &hash);
+	if (!error)
+		error = read_stack(&cpu->stack, header.stack_size, fp);
+	if (!error)
+		error = read_stack(&cpu->rstack, header.rstack_size, fp);
+	
+	// Nothing must follow
+	if (!error)
+		error = fgetc(fp) != EOF;
+	
+	if (!error)
+		error = state_checksum(cpu, hash) != header.checksum;
+	
+	// Return addresses are CALL commands of code
+	const stack_el_t* returns = VMStackData(&cpu->rstack);
+	for (size_t i = 0; !error && i < header.rstack_size; ++i)
+		error = returns[i] < 0 || uint64_t(returns[i]) >= header.code_ncommands;
+	
+	fclose(fp);
+	
+	if (error) {
+		printf("## Error: snapshot %s is damaged\n", fname);
+		
+		return 1;
+	}
+	
+	cpu->fetcher = header.fetcher;
+	
+	// Stacks and registers of snapshot were not verified with code
+	CPUCode* code = cpu->own_code;
+	if (code && code->verified) {
+		set_dispatch(code->decoded, code->file->ncommands, 0);
+		BlocksDeInit(code->blocks);
+		code->blocks = 0;
+		code->verified = 0;
+	}
+	
+	if (code && !code->check_memory) {
+		code->check_memory = 1;
+		
+		if (code->jit) {
+			JitDeInit(code->jit);
+			code->jit = JitCompile(code->decoded, code->file->ncommands, 1);
+		}
+	}
+	
+	if (code) {
+		cpu->verified = code->verified;
+		cpu->jit = code->jit;
+	}
+	cpu->memory->checked = 1;
+	
+	return 0;
+}
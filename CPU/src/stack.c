@@ -1,5 +1,7 @@
 #include "stack.h"
 
+#include "diag.h"
+
 void HashLyAdd(uint32_t* hash, const void* data, size_t size)
 {
 	assert(hash != NULL);
@@ -12,65 +14,65 @@ void HashLyAdd(uint32_t* hash, const void* data, size_t size)
 // Вывод ошибок
 #define PRINT_ERRORS(error) {					\
 	if (error == NO_ERROR)						\
-		printf("## NO ERROR;\n");				\
+		diag_printf("## NO ERROR;\n");				\
 	else 										\
-		printf("## ERRORS OCCURED:\n");			\
+		diag_printf("## ERRORS OCCURED:\n");			\
 	if (error & NULL_STACKP)					\
-		printf("## NULL STACK POINTER;\n");		\
+		diag_printf("## NULL STACK POINTER;\n");		\
 	if (error & NULL_ARRAYP)					\
-		printf("## NULL ARRAY POINTER;\n");		\
+		diag_printf("## NULL ARRAY POINTER;\n");		\
 	if (error & NULL_CAPACITY)					\
-		printf("## NULL CAPACITY;\n");			\
+		diag_printf("## NULL CAPACITY;\n");			\
 	if (error & TOO_BIG_SIZE)					\
-		printf("## TOO BIG SIZE;\n");			\
+		diag_printf("## TOO BIG SIZE;\n");			\
 	if (error & TOO_SMALL_SIZE)					\
-		printf("## TOO SMALL SIZE;\n");			\
+		diag_printf("## TOO SMALL SIZE;\n");			\
 	if (error & GUARD_GORRUPTED)				\
-		printf("## GUARD BYTE CORRUPTED;\n");	\
+		diag_printf("## GUARD BYTE CORRUPTED;\n");	\
 	if (error & HASH_NOT_MATCH)					\
-		printf("## HASH DOESNT MATCH;\n");		\
+		diag_printf("## HASH DOESNT MATCH;\n");		\
 }
 
 // Вывод capacity и size
 #define PRINT_CAPACITY_AND_SIZE(stackp)				\
-	printf("## Capacity:\t%lu;\n## Size:\t%lu;\n",	\
+	diag_printf("## Capacity:\t%lu;\n## Size:\t%lu;\n",	\
 				stackp->capacity, stackp->size);
 
 // Вывод "защитных" полей структуры
 #ifndef PS_NDEBUG			
 #define PRINT_STRUCT_GUARDS(stackp)									\
-	printf("## Struct guards (should all be |%x|):", GUARD_BYTE);	\
-	printf("\n## Front guards:\t");									\
+	diag_printf("## Struct guards (should all be |%x|):", GUARD_BYTE);	\
+	diag_printf("\n## Front guards:\t");									\
 	uint8_t* ptr = stackp->front_guard;								\
 	for (uint8_t* i = ptr; i < ptr + ARRAY_OFFSET; ++i)				\
-		printf("|%x|", *i);											\
-	printf("\n## Back guards:\t\t");								\
+		diag_printf("|%x|", *i);											\
+	diag_printf("\n## Back guards:\t\t");								\
 	ptr = stackp->back_guard;										\
 	for (uint8_t* i = ptr; i < ptr + ARRAY_OFFSET; ++i)				\
-		printf("|%x|", *i);											\
-	printf("\n");
+		diag_printf("|%x|", *i);											\
+	diag_printf("\n");
 #else
 #define PRINT_STRUCT_GUARDS(stackp)								\
-	printf("## No struct guards support\n");
+	diag_printf("## No struct guards support\n");
 #endif
 
 // Вывод "защитных" полей массива
 #ifndef PS_NDEBUG
 #define PRINT_ARRAY_GUARDS(stackp)	{								\
-	printf("## Array guards (should all be |%x|):", GUARD_BYTE);	\
-	printf("\n## Front guards:\t");									\
+	diag_printf("## Array guards (should all be |%x|):", GUARD_BYTE);	\
+	diag_printf("\n## Front guards:\t");									\
 	uint8_t* ptr = ((uint8_t*)stackp->array) - ARRAY_OFFSET;		\
 	for (uint8_t* i = ptr; i < ptr + ARRAY_OFFSET; ++i)				\
-		printf("|%x|", *i);											\
-	printf("\n## Back guards:\t\t");								\
+		diag_printf("|%x|", *i);											\
+	diag_printf("\n## Back guards:\t\t");								\
 	ptr = (uint8_t*)(stackp->array + stackp->capacity);				\
 	for (uint8_t* i = ptr; i < ptr + ARRAY_OFFSET; ++i)				\
-		printf("|%x|", *i);											\
-	printf("\n");													\
+		diag_printf("|%x|", *i);											\
+	diag_printf("\n");													\
 }
 #else
 #define PRINT_ARRAY_GUARDS(stackp)								\
-	printf("## No array guards support\n");
+	diag_printf("## No array guards support\n");
 #endif
 
 // Вывод хэша
@@ -78,58 +80,58 @@ void HashLyAdd(uint32_t* hash, const void* data, size_t size)
 #define PRINT_HASH(stackp) {					                    \
     uint32_t hash = 0;                                              \
     PStackCalcHash(stackp, &hash);                                  \
-	printf("## Hash:\t%u (Should be %u);\n", stackp->hash, hash);   \
+	diag_printf("## Hash:\t%u (Should be %u);\n", stackp->hash, hash);   \
 }
 #else 													
 #define PRINT_HASH(stackp) 						\
-	printf("## No hash support;\n");
+	diag_printf("## No hash support;\n");
 #endif
 
 // Вывод элементов массива
 #define PRINT_ELEMENTS(stackp) {								\
-	printf("## Elements:\n");									\
+	diag_printf("## Elements:\n");									\
 	for (size_t i = 0; i < stackp->size; i++) {					\
-		printf("## + [%lu]\t%d", i, stackp->array[i]);			\
+		diag_printf("## + [%lu]\t%" PRId64, i, stackp->array[i]);			\
 		if (IsDead(stackp->array + i, sizeof(stack_el_t)))		\
-			printf(" (POSSIBLY DEAD)");							\
-		printf("\n");											\
+			diag_printf(" (POSSIBLY DEAD)");							\
+		diag_printf("\n");											\
 	}															\
 	for (size_t i = stackp->size; i < stackp->capacity; i++) {	\
-		printf("## - [%lu]\t%d", i, stackp->array[i]);			\
+		diag_printf("## - [%lu]\t%" PRId64, i, stackp->array[i]);			\
 		if (IsDead(stackp->array + i, sizeof(stack_el_t)))		\
-			printf(" (DEAD)");									\
-		printf("\n");											\
+			diag_printf(" (DEAD)");									\
+		diag_printf("\n");											\
 	}															\
 }
 			
 // Вывод имени	
 #ifndef PS_NDEBUG
-#define PRINT_NAME(stackp) printf("## Stack name:\t%s;\n", \
+#define PRINT_NAME(stackp) diag_printf("## Stack name:\t%s;\n", \
 										stackp->name);
 #else
-#define PRINT_NAME(stackp) printf("## No name support;\n");
+#define PRINT_NAME(stackp) diag_printf("## No name support;\n");
 #endif
 
 // Напечатать причину проверки
 #define PRINT_REASON(reason) {						\
 	if (reason == COMMON)							\
-		printf("## COMMON CHECK REASON;\n");		\
+		diag_printf("## COMMON CHECK REASON;\n");		\
 	if (reason == BEFORE_INIT)						\
-		printf("## BEFORE_INIT CHECK REASON;\n");	\
+		diag_printf("## BEFORE_INIT CHECK REASON;\n");	\
 	if (reason == AFTER_INIT)						\
-		printf("## AFTER_INIT CHECK REASON;\n");	\
+		diag_printf("## AFTER_INIT CHECK REASON;\n");	\
 	if (reason == BEFORE_DEINIT)					\
-		printf("## BEFORE_DEINIT CHECK REASON;\n");	\
+		diag_printf("## BEFORE_DEINIT CHECK REASON;\n");	\
 	if (reason == BEFORE_PUSH)						\
-		printf("## BEFORE_PUSH CHECK REASON;\n");	\
+		diag_printf("## BEFORE_PUSH CHECK REASON;\n");	\
 	if (reason == AFTER_PUSH)						\
-		printf("## AFTER_PUSH CHECK REASON;\n");	\
+		diag_printf("## AFTER_PUSH CHECK REASON;\n");	\
 	if (reason == BEFORE_POP)						\
-		printf("## BEFORE_POP CHECK REASON;\n");	\
+		diag_printf("## BEFORE_POP CHECK REASON;\n");	\
 	if (reason == AFTER_POP)						\
-		printf("## AFTER_POP CHECK REASON;\n");		\
+		diag_printf("## AFTER_POP CHECK REASON;\n");		\
 	if (reason == BEFORE_HASH)						\
-		printf("## BEFORE_HASH CHECK REASON;\n");	\
+		diag_printf("## BEFORE_HASH CHECK REASON;\n");	\
 }
 
 // PS_ASSERT проверяет стэк
@@ -137,10 +139,10 @@ void HashLyAdd(uint32_t* hash, const void* data, size_t size)
 #define PS_ASSERT(stackp, reason) {					\
 	PS_ERROR err = PStackCheck(stackp, reason);		\
 	if (err & ~NO_ERROR) {							\
-		printf("## STACK ASSERT FAILED;\n");		\
+		diag_printf("## STACK ASSERT FAILED;\n");		\
 		PRINT_REASON(reason)						\
-		printf("## IN FUNCTION %s;\n", __func__);	\
-        printf("## ON LINE %d;\n", __LINE__);         \
+		diag_printf("## IN FUNCTION %s;\n", __func__);	\
+        diag_printf("## ON LINE %d;\n", __LINE__);         \
 		PStackDump(stackp, err);					\
         return err;                                 \
 		/*exit(ASSERT_EXIT_CODE);*/					\
@@ -257,7 +259,7 @@ PS_ERROR PStackCheck(PStack_t* stackp, PS_CHECK_REASON reason)
 
 void PStackDump(PStack_t* stackp, PS_ERROR error)
 {
-	printf("## STACK DUMP;\n");
+	diag_printf("## STACK DUMP;\n");
 
 	PRINT_ERRORS(error)
 	
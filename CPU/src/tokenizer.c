@@ -1,67 +1,200 @@
 #include <assert.h>
 #include <string.h>
+#include <stdio.h>
+#include <limits.h>
 
 #include "tokenizer.h"
 
+#include "diag.h"
 #include "exitingalloc.h"
 
-char *next_line(char *cur_line)
+inline int is_delim(char c)
 {
-	assert(cur_line != NULL);
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits complete line [begin, end) into tokens, returns number of tokens
+// or TOKENIZER_MAX_TOKENS + 1 if there are too many
+size_t split_line(const char* begin, const char* end, Token* tokens)
+{
+	size_t ntokens = 0;
+
+	for (const char* cur = begin; cur < end; ) {
+		if (is_delim(*cur)) {
+			++cur;
+			continue;
+		}
+
+		if (*cur == ';')
+			break;
+
+		const char* start = cur;
+		while (cur < end && !is_delim(*cur) && *cur != ';')
+			++cur;
+
+		if (ntokens == TOKENIZER_MAX_TOKENS)
+			return ntokens + 1;
+
+		tokens[ntokens++] = {start, size_t(cur - start)};
+	}
+
+	return ntokens;
+}
+
+// Calls ptk for complete lines of [data, end), the last line without
+// newline is processed only if last is set. Start of unprocessed
+// rest is stored to rest
+int tokenize_lines(	const char* data, const char* end, int last, 
+					size_t* nline, const char** rest,
+					int (*ptk)(const Token*, size_t, size_t, void*),
+					void* arg )
+{
+	Token tokens[TOKENIZER_MAX_TOKENS] = {};
+	
+	const char* line = data;
+	int retval = 0;
 	
-	for (; *cur_line; ++cur_line) {
-		if (*cur_line == '\n') {
-			*cur_line = '\0';
-			return (++cur_line);
+	while (line < end) {
+		const char* line_end = reinterpret_cast<const char*>(
+			memchr(line, '\n', end - line)
+		);
+		
+		if (!line_end) {
+			if (!last)
+				break;
+			
+			line_end = end;
 		}
+		
+		size_t ntokens = split_line(line, line_end, tokens);
+		if (ntokens > TOKENIZER_MAX_TOKENS) {
+			diag_printf("## ERROR: Too many tokens on line %lu\n", *nline);
+			
+			retval = 1;
+			break;
+		}
+		
+		retval = ptk(tokens, ntokens, (*nline)++, arg);
+		if (retval != 0)
+			break;
+		
+		line = (line_end == end) ? end : line_end + 1;
 	}
 	
-	return NULL;
+	*rest = line;
+	
+	return retval;
 }
 
-#define TOKENS_CHUNK (5)
-
-int tokenize_lines(	char *data, const char *delim,
-					int (*ptk)(const char**, size_t, size_t, void*),
+int tokenize_file(	const char* filename,
+					int (*ptk)(const Token*, size_t, size_t, void*),
 					void* arg )
 {
-	assert(data != NULL);
-	assert(delim != NULL);
+	assert(filename != NULL);
 	assert(ptk != NULL);
 	
+	FILE* fp = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+	if (!fp) {
+		diag_printf("## ERROR: Failed to open file: %s\n", filename);
+		
+		return 1;
+	}
+	
+	// Only a line split between chunks is kept, so memory doesn't
+	// depend on size of input. Buffer grows only for longer lines
+	size_t capacity = TOKENIZER_CHUNK;
+	char* buffer = reinterpret_cast<char*>(exiting_malloc(capacity));
+	size_t size = 0;
+	
 	int retval = 0;
+	size_t nline = 0;
+	int eof = 0;
 	
-	size_t tokens_size = TOKENS_CHUNK;
-	const char** tokens = reinterpret_cast<const char**>
-				(exiting_calloc(tokens_size, sizeof(char*)));
-				
-	char *cur_line = data;
-	for (size_t nline = 0; cur_line != NULL; ++nline) {
-		char *new_line = next_line(cur_line);
+	while (!retval && !eof) {
+		if (size == capacity) {
+			capacity *= 2;
+			buffer = reinterpret_cast<char*>(
+				exiting_realloc(buffer, capacity)
+			);
+		}
 		
-		size_t ntokens = 0;
-		for (	char *token = strtok(cur_line, delim);
-				token != NULL;
-				token = strtok(NULL, delim)) {
-			
-			if (ntokens == tokens_size) {
-				tokens_size += TOKENS_CHUNK;
-				tokens = reinterpret_cast<const char**>(
-					exiting_realloc(tokens, tokens_size * sizeof(char*))
-				);
+		size_t readed = fread(buffer + size, 1, capacity - size, fp);
+		if (readed == 0) {
+			if (ferror(fp)) {
+				diag_printf("## ERROR: Failed to read file: %s\n", filename);
+				
+				retval = 1;
+				break;
 			}
 			
-			tokens[ntokens++] = token;
+			eof = 1;
 		}
+		size += readed;
 		
-		retval = ptk(tokens, ntokens, nline, arg);
-		if (retval != 0)
-			break;
+		const char* rest = buffer;
+		retval = tokenize_lines(buffer, buffer + size, eof, 
+								&nline, &rest, ptk, arg);
 		
-		cur_line = new_line;
+		size = buffer + size - rest;
+		memmove(buffer, rest, size);
 	}
 	
-	free(tokens);
+	free(buffer);
+	
+	if (fp != stdin)
+		fclose(fp);
 	
 	return retval;
 }
+
+int tokenize_buffer(const char* data, size_t size, size_t first_line,
+					int (*ptk)(const Token*, size_t, size_t, void*),
+					void* arg )
+{
+	assert(data != NULL);
+	assert(ptk != NULL);
+	
+	const char* rest = data;
+	
+	return tokenize_lines(data, data + size, 1, &first_line, &rest, ptk, arg);
+}
+
+int token_equals(Token token, const char* str)
+{
+	assert(str);
+
+	return strncmp(token.ptr, str, token.len) == 0 && str[token.len] == '\0';
+}
+
+int token_to_int(Token token, int* val)
+{
+	assert(val);
+
+	const char* cur = token.ptr;
+	const char* end = token.ptr + token.len;
+
+	int negative = 0;
+	if (cur < end && (*cur == '-' || *cur == '+'))
+		negative = (*cur++ == '-');
+
+	if (cur == end)
+		return 1;
+
+	// Accumulated as negative, so INT_MIN fits
+	long long res = 0;
+	for (; cur < end; ++cur) {
+		if (*cur < '0' || *cur > '9')
+			return 1;
+
+		res = res * 10 - (*cur - '0');
+		if (res < INT_MIN)
+			return 1;
+	}
+
+	if (!negative && res < -INT_MAX)
+		return 1;
+
+	*val = int(negative ? res : -res);
+
+	return 0;
+}
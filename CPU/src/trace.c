@@ -0,0 +1,474 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#include "command.h"
+#include "memory.h"
+#include "exitingalloc.h"
+
+#define TRACE_CHUNKS (16)
+#define TRACE_CHUNK_SIZE (1 << 16)
+
+// Header byte and two varints of 64 bit values
+#define MAX_RECORD (1 + 2 * 10)
+
+struct Trace {
+	int fd;
+
+	// Ring of chunks, producer fills chunk head, writer thread
+	// writes nready chunks from tail, head == (tail + nready) % TRACE_CHUNKS
+	uint8_t* chunks[TRACE_CHUNKS];
+	size_t sizes[TRACE_CHUNKS];
+	size_t head;
+	size_t tail;
+	size_t nready;
+	int done;
+
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	pthread_cond_t space;
+	pthread_t writer;
+
+	// Set by writer thread, remaining chunks are dropped
+	int error;
+
+	// Position in chunk head
+	uint8_t* out;
+	uint8_t* out_end;
+
+	// Pc expected after previous record and previous top of stack
+	size_t next_pc;
+	stack_el_t tos;
+
+	// End record is written
+	int ended;
+
+	// Fetcher of cpu after the last TraceExecute
+	size_t fetcher;
+};
+
+//======================================================================
+
+inline uint64_t zigzag(int64_t val)
+{
+	return (uint64_t(val) << 1) ^ uint64_t(val >> 63);
+}
+
+inline int64_t unzigzag(uint64_t val)
+{
+	return int64_t(val >> 1) ^ -int64_t(val & 1);
+}
+
+inline uint8_t* put_varint(uint8_t* out, uint64_t val)
+{
+	while (val >= 0x80) {
+		*out++ = uint8_t(val) | 0x80;
+		val >>= 7;
+	}
+	*out++ = uint8_t(val);
+
+	return out;
+}
+
+void* writer_thread(void* arg)
+{
+	Trace* trace = reinterpret_cast<Trace*>(arg);
+
+	pthread_mutex_lock(&trace->lock);
+	for (;;) {
+		while (!trace->nready && !trace->done)
+			pthread_cond_wait(&trace->ready, &trace->lock);
+
+		if (!trace->nready)
+			break;
+
+		size_t chunk = trace->tail;
+		int error = trace->error;
+		pthread_mutex_unlock(&trace->lock);
+
+		const uint8_t* data = trace->chunks[chunk];
+		size_t left = trace->sizes[chunk];
+		while (left && !error) {
+			ssize_t written = write(trace->fd, data, left);
+			if (written <= 0) {
+				error = 1;
+				break;
+			}
+
+			data += written;
+			left -= written;
+		}
+
+		pthread_mutex_lock(&trace->lock);
+		trace->error = error;
+		trace->tail = (trace->tail + 1) % TRACE_CHUNKS;
+		trace->nready--;
+		pthread_cond_signal(&trace->space);
+	}
+	pthread_mutex_unlock(&trace->lock);
+
+	return 0;
+}
+
+// Passes chunk head to writer thread and waits for free chunk
+void submit_chunk(Trace* trace)
+{
+	pthread_mutex_lock(&trace->lock);
+
+	trace->sizes[trace->head] = trace->out - trace->chunks[trace->head];
+	trace->head = (trace->head + 1) % TRACE_CHUNKS;
+	trace->nready++;
+	pthread_cond_signal(&trace->ready);
+
+	while (trace->nready == TRACE_CHUNKS)
+		pthread_cond_wait(&trace->space, &trace->lock);
+
+	pthread_mutex_unlock(&trace->lock);
+
+	trace->out = trace->chunks[trace->head];
+	trace->out_end = trace->out + TRACE_CHUNK_SIZE - MAX_RECORD;
+}
+
+inline void reserve_record(Trace* trace)
+{
+	if (trace->out > trace->out_end)
+		submit_chunk(trace);
+}
+
+inline stack_el_t top_of(const VMStack* stack)
+{
+	if (!stack->checked)
+		return (stack->top == stack->base) ? 0 : stack->top[-1];
+
+	size_t size = VMStackSize(stack);
+
+	return size ? VMStackData(stack)[size - 1] : 0;
+}
+
+inline void record_command(Trace* trace, size_t pc, int id, stack_el_t tos)
+{
+	reserve_record(trace);
+
+	uint8_t* head = trace->out++;
+	*head = uint8_t(id);
+
+	if (pc != trace->next_pc) {
+		*head |= TRACE_PC;
+		trace->out = put_varint(trace->out,
+								zigzag(int64_t(pc - trace->next_pc)));
+	}
+	if (tos != trace->tos) {
+		*head |= TRACE_TOS;
+		// Difference wraps, so it doesn't overflow
+		trace->out = put_varint(trace->out,
+								zigzag(int64_t(uint64_t(tos) - uint64_t(trace->tos))));
+	}
+
+	trace->next_pc = pc + 1;
+	trace->tos = tos;
+}
+
+// Values pushed by PUSH IN are the top n elements of stack
+void record_in(Trace* trace, const VMStack* stack, size_t n)
+{
+	size_t size = VMStackSize(stack);
+	const stack_el_t* data = VMStackData(stack) + size - n;
+
+	for (size_t i = 0; i < n; ++i) {
+		reserve_record(trace);
+		trace->out = put_varint(trace->out, zigzag(data[i]));
+	}
+}
+
+void record_end(Trace* trace, size_t pc, int status)
+{
+	if (trace->ended)
+		return;
+
+	reserve_record(trace);
+
+	*trace->out++ = TRACE_END;
+	trace->out = put_varint(trace->out, pc);
+	trace->out = put_varint(trace->out, zigzag(status));
+
+	trace->ended = 1;
+}
+
+//======================================================================
+
+Trace* TraceInit(const BinaryFile* code, const char* fname)
+{
+	assert(code);
+	assert(fname);
+
+	// Ids must fit header byte with TRACE_END left free
+	assert(get_not_command_id() < TRACE_END);
+
+	int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("## Error: failed to open %s\n", fname);
+
+		return 0;
+	}
+
+	TraceHeader header = {};
+	header.magic = TRACE_MAGIC;
+	header.version = TRACE_VERSION;
+	header.header_size = sizeof(TraceHeader);
+	header.code_checksum = code->checksum;
+	header.code_ncommands = code->ncommands;
+
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		printf("## Error: failed to write %s\n", fname);
+
+		close(fd);
+		return 0;
+	}
+
+	Trace* retval = reinterpret_cast<Trace*>(
+		exiting_calloc(1, sizeof(Trace))
+	);
+
+	retval->fd = fd;
+	for (size_t i = 0; i < TRACE_CHUNKS; ++i)
+		retval->chunks[i] = reinterpret_cast<uint8_t*>(
+			exiting_malloc(TRACE_CHUNK_SIZE)
+		);
+
+	retval->out = retval->chunks[0];
+	retval->out_end = retval->out + TRACE_CHUNK_SIZE - MAX_RECORD;
+
+	pthread_mutex_init(&retval->lock, 0);
+	pthread_cond_init(&retval->ready, 0);
+	pthread_cond_init(&retval->space, 0);
+
+	if (pthread_create(&retval->writer, 0, writer_thread, retval)) {
+		printf("## Error: failed to start trace writer\n");
+
+		// Done trace has no thread to join
+		retval->done = 1;
+		TraceDeInit(retval);
+		return 0;
+	}
+
+	return retval;
+}
+
+int TraceExecute(Trace* trace, CPU* cpu)
+{
+	assert(trace);
+	assert(cpu);
+
+	static const int push_id = get_command_id("PUSH");
+	static const int mem_in = get_mem_id("IN");
+	static const int mem_in_f64 = get_mem_id("IN_F64");
+
+	const DecodedCommand* code = cpu->decoded;
+	size_t ncommands = cpu->code->ncommands;
+
+	while (cpu->fetcher < ncommands) {
+		if (cpu->budget == 0) {
+			trace->fetcher = cpu->fetcher;
+			return CPU_BUDGET;
+		}
+		cpu->budget--;
+
+		size_t pc = cpu->fetcher;
+		const DecodedCommand* fetched = code + pc;
+
+		int error = get_executor(fetched->id)(cpu, fetched->cmd);
+		if (error && error != CPU_SNAPSHOT) {
+			record_end(trace, pc, error);
+			return error;
+		}
+
+		record_command(trace, pc, fetched->id, top_of(&cpu->stack));
+
+		if (fetched->id == push_id &&
+			(fetched->cmd.arg1 == mem_in || fetched->cmd.arg1 == mem_in_f64) &&
+			fetched->cmd.arg2 > 0)
+			record_in(trace, &cpu->stack, fetched->cmd.arg2);
+
+		if (error) {
+			trace->fetcher = cpu->fetcher;
+			return error;
+		}
+	}
+
+	if (cpu->fetcher > ncommands) {
+		printf("## Error: bad return address\n");
+
+		record_end(trace, cpu->fetcher, 1);
+		return 1;
+	}
+
+	record_end(trace, cpu->fetcher, 0);
+
+	return 0;
+}
+
+void TraceDeInit(Trace* trace)
+{
+	if (!trace)
+		return;
+
+	// Cpu stopped before halt, trace ends where it can be resumed
+	if (!trace->done)
+		record_end(trace, trace->fetcher, CPU_BUDGET);
+
+	pthread_mutex_lock(&trace->lock);
+	if (!trace->done && trace->out != trace->chunks[trace->head]) {
+		trace->sizes[trace->head] = trace->out - trace->chunks[trace->head];
+		trace->nready++;
+	}
+	int started = !trace->done;
+	trace->done = 1;
+	pthread_cond_signal(&trace->ready);
+	pthread_mutex_unlock(&trace->lock);
+
+	if (started)
+		pthread_join(trace->writer, 0);
+
+	if (close(trace->fd) || trace->error)
+		printf("## Error writing trace\n");
+
+	pthread_mutex_destroy(&trace->lock);
+	pthread_cond_destroy(&trace->ready);
+	pthread_cond_destroy(&trace->space);
+
+	for (size_t i = 0; i < TRACE_CHUNKS; ++i)
+		free(trace->chunks[i]);
+
+	free(trace);
+}
+
+//======================================================================
+
+struct TraceReader {
+	FILE* fp;
+
+	size_t next_pc;
+	stack_el_t tos;
+};
+
+inline int get_varint(FILE* fp, uint64_t* val)
+{
+	*val = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = getc(fp);
+		if (byte == EOF)
+			return 1;
+
+		*val |= uint64_t(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return 0;
+	}
+
+	return 1;
+}
+
+TraceReader* TraceOpen(const char* fname, TraceHeader* header)
+{
+	assert(fname);
+	assert(header);
+
+	FILE* fp = fopen(fname, "rb");
+	if (!fp) {
+		printf("## Error: failed to open %s\n", fname);
+
+		return 0;
+	}
+
+	if (fread(header, sizeof(TraceHeader), 1, fp) != 1 ||
+		header->magic != TRACE_MAGIC ||
+		header->version != TRACE_VERSION ||
+		header->header_size != sizeof(TraceHeader)) {
+		printf("## Error: %s is not a trace\n", fname);
+
+		fclose(fp);
+		return 0;
+	}
+
+	TraceReader* retval = reinterpret_cast<TraceReader*>(
+		exiting_calloc(1, sizeof(TraceReader))
+	);
+	retval->fp = fp;
+
+	return retval;
+}
+
+int TraceRead(TraceReader* reader, TraceRecord* record)
+{
+	assert(reader);
+	assert(record);
+
+	int head = getc(reader->fp);
+	if (head == EOF)
+		return 1;
+
+	*record = {};
+	record->id = head & TRACE_ID_MASK;
+
+	uint64_t val = 0;
+	if (record->id == TRACE_END) {
+		record->end = 1;
+
+		if (get_varint(reader->fp, &val))
+			return 1;
+		record->pc = val;
+
+		if (get_varint(reader->fp, &val))
+			return 1;
+		record->status = int(unzigzag(val));
+
+		return 0;
+	}
+
+	record->pc = reader->next_pc;
+	if (head & TRACE_PC) {
+		if (get_varint(reader->fp, &val))
+			return 1;
+		record->pc += unzigzag(val);
+	}
+
+	record->tos = reader->tos;
+	if (head & TRACE_TOS) {
+		if (get_varint(reader->fp, &val))
+			return 1;
+		record->tos = int64_t(uint64_t(record->tos) + uint64_t(unzigzag(val)));
+	}
+
+	reader->next_pc = record->pc + 1;
+	reader->tos = record->tos;
+
+	return 0;
+}
+
+int TraceReadIn(TraceReader* reader, stack_el_t* val)
+{
+	assert(reader);
+	assert(val);
+
+	uint64_t raw = 0;
+	if (get_varint(reader->fp, &raw))
+		return 1;
+
+	*val = unzigzag(raw);
+
+	return 0;
+}
+
+void TraceClose(TraceReader* reader)
+{
+	if (!reader)
+		return;
+
+	fclose(reader->fp);
+	free(reader);
+}
@@ -0,0 +1,500 @@
+#include <assert.h>
+#include <string.h>
+
+#include "vector.h"
+
+#include "command.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define VECTOR_X86
+#include <immintrin.h>
+#endif
+
+//======================================================================
+// Scalar operations, the same as of arithmetic commands
+
+inline double as_f64(stack_el_t val)
+{
+	double retval = 0;
+	memcpy(&retval, &val, sizeof(retval));
+
+	return retval;
+}
+
+inline stack_el_t f64_as(double val)
+{
+	stack_el_t retval = 0;
+	memcpy(&retval, &val, sizeof(retval));
+
+	return retval;
+}
+
+inline stack_el_t add_i64(stack_el_t a, stack_el_t b)
+{
+	return stack_el_t(uint64_t(a) + uint64_t(b));
+}
+
+inline stack_el_t mul_i64(stack_el_t a, stack_el_t b)
+{
+	return stack_el_t(uint64_t(a) * uint64_t(b));
+}
+
+inline stack_el_t add_i32(stack_el_t a, stack_el_t b)
+{
+	return int32_t(add_i64(a, b));
+}
+
+inline stack_el_t mul_i32(stack_el_t a, stack_el_t b)
+{
+	return int32_t(mul_i64(a, b));
+}
+
+inline stack_el_t add_f64(stack_el_t a, stack_el_t b)
+{
+	return f64_as(as_f64(a) + as_f64(b));
+}
+
+inline stack_el_t mul_f64(stack_el_t a, stack_el_t b)
+{
+	return f64_as(as_f64(a) * as_f64(b));
+}
+
+// Partial sums of F64 reductions
+#define PARTS (4)
+
+inline stack_el_t join_parts(const double* parts)
+{
+	return f64_as((parts[0] + parts[2]) + (parts[1] + parts[3]));
+}
+
+//======================================================================
+// Kernels of every instruction set
+
+typedef void (*ElementwiseKernel)(	stack_el_t* dst, const stack_el_t* a,
+									const stack_el_t* b, size_t n);
+typedef stack_el_t (*DotKernel)(const stack_el_t* a, const stack_el_t* b, size_t n);
+typedef stack_el_t (*SumKernel)(const stack_el_t* a, size_t n);
+
+// Indexed by type
+struct VectorKernels {
+	const char* name;
+
+	ElementwiseKernel add[3];
+	ElementwiseKernel mul[3];
+	DotKernel dot[3];
+	SumKernel sum[3];
+};
+
+typedef struct VectorKernels VectorKernels;
+
+// Vector loop over WIDTH elements and scalar tail
+#define ELEMENTWISE(NAME, TARGET, WIDTH, VECTOR_OP, SCALAR_OP)			\
+TARGET void NAME(	stack_el_t* dst, const stack_el_t* a,				\
+					const stack_el_t* b, size_t n)						\
+{																		\
+	size_t i = 0;														\
+	for (; i + WIDTH <= n; i += WIDTH)									\
+		VECTOR_OP(dst + i, a + i, b + i);								\
+	for (; i < n; ++i)													\
+		dst[i] = SCALAR_OP(a[i], b[i]);									\
+}
+
+#define SCALAR_ELEMENTWISE(NAME, SCALAR_OP)								\
+void NAME(	stack_el_t* dst, const stack_el_t* a,						\
+			const stack_el_t* b, size_t n)								\
+{																		\
+	for (size_t i = 0; i < n; ++i)										\
+		dst[i] = SCALAR_OP(a[i], b[i]);									\
+}
+
+SCALAR_ELEMENTWISE(scalar_add_i32, add_i32)
+SCALAR_ELEMENTWISE(scalar_add_i64, add_i64)
+SCALAR_ELEMENTWISE(scalar_add_f64, add_f64)
+SCALAR_ELEMENTWISE(scalar_mul_i32, mul_i32)
+SCALAR_ELEMENTWISE(scalar_mul_i64, mul_i64)
+SCALAR_ELEMENTWISE(scalar_mul_f64, mul_f64)
+
+// Integer sums wrap, so order doesn't matter
+stack_el_t scalar_dot_i64(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	stack_el_t sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum = add_i64(sum, mul_i64(a[i], b[i]));
+
+	return sum;
+}
+
+stack_el_t scalar_dot_i32(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	return int32_t(scalar_dot_i64(a, b, n));
+}
+
+stack_el_t scalar_dot_f64(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	double parts[PARTS] = {};
+	for (size_t i = 0; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]) * as_f64(b[i]);
+
+	return join_parts(parts);
+}
+
+stack_el_t scalar_sum_i64(const stack_el_t* a, size_t n)
+{
+	stack_el_t sum = 0;
+	for (size_t i = 0; i < n; ++i)
+		sum = add_i64(sum, a[i]);
+
+	return sum;
+}
+
+stack_el_t scalar_sum_i32(const stack_el_t* a, size_t n)
+{
+	return int32_t(scalar_sum_i64(a, n));
+}
+
+stack_el_t scalar_sum_f64(const stack_el_t* a, size_t n)
+{
+	double parts[PARTS] = {};
+	for (size_t i = 0; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]);
+
+	return join_parts(parts);
+}
+
+const VectorKernels scalar_kernels = {
+	"scalar",
+	{scalar_add_i32, scalar_add_i64, scalar_add_f64},
+	{scalar_mul_i32, scalar_mul_i64, scalar_mul_f64},
+	{scalar_dot_i32, scalar_dot_i64, scalar_dot_f64},
+	{scalar_sum_i32, scalar_sum_i64, scalar_sum_f64}
+};
+
+#ifdef VECTOR_X86
+
+//======================================================================
+// SSE2, 2 elements in register. There is no 64 bit multiplication,
+// but low 32 bits of unsigned product are the same as of signed
+
+#define SSE2 __attribute__((target("sse2")))
+
+#define SSE2_LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))
+#define SSE2_STORE(p, x) _mm_storeu_si128(reinterpret_cast<__m128i*>(p), x)
+#define SSE2_LOADF(p) _mm_loadu_pd(reinterpret_cast<const double*>(p))
+#define SSE2_STOREF(p, x) _mm_storeu_pd(reinterpret_cast<double*>(p), x)
+
+// Sign extends low 32 bits of every element
+SSE2 inline __m128i sse2_extend_i32(__m128i x)
+{
+	const __m128i low = _mm_set_epi32(0, -1, 0, -1);
+	__m128i sign = _mm_shuffle_epi32(	_mm_srai_epi32(x, 31),
+										_MM_SHUFFLE(2, 2, 0, 0));
+
+	return _mm_or_si128(_mm_and_si128(low, x), _mm_andnot_si128(low, sign));
+}
+
+#define SSE2_ADD_I32(dst, a, b) \
+SSE2_STORE(dst, sse2_extend_i32(_mm_add_epi64(SSE2_LOAD(a), SSE2_LOAD(b))))
+#define SSE2_ADD_I64(dst, a, b) \
+SSE2_STORE(dst, _mm_add_epi64(SSE2_LOAD(a), SSE2_LOAD(b)))
+#define SSE2_ADD_F64(dst, a, b) \
+SSE2_STOREF(dst, _mm_add_pd(SSE2_LOADF(a), SSE2_LOADF(b)))
+#define SSE2_MUL_I32(dst, a, b) \
+SSE2_STORE(dst, sse2_extend_i32(_mm_mul_epu32(SSE2_LOAD(a), SSE2_LOAD(b))))
+#define SSE2_MUL_F64(dst, a, b) \
+SSE2_STOREF(dst, _mm_mul_pd(SSE2_LOADF(a), SSE2_LOADF(b)))
+
+ELEMENTWISE(sse2_add_i32, SSE2, 2, SSE2_ADD_I32, add_i32)
+ELEMENTWISE(sse2_add_i64, SSE2, 2, SSE2_ADD_I64, add_i64)
+ELEMENTWISE(sse2_add_f64, SSE2, 2, SSE2_ADD_F64, add_f64)
+ELEMENTWISE(sse2_mul_i32, SSE2, 2, SSE2_MUL_I32, mul_i32)
+ELEMENTWISE(sse2_mul_f64, SSE2, 2, SSE2_MUL_F64, mul_f64)
+
+SSE2 inline stack_el_t sse2_join_i64(__m128i acc)
+{
+	return add_i64(_mm_cvtsi128_si64(acc),
+					_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc)));
+}
+
+SSE2 stack_el_t sse2_dot_i32(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_epi64(acc, _mm_mul_epu32(SSE2_LOAD(a + i), SSE2_LOAD(b + i)));
+
+	stack_el_t sum = sse2_join_i64(acc);
+	for (; i < n; ++i)
+		sum = add_i64(sum, mul_i64(a[i], b[i]));
+
+	return int32_t(sum);
+}
+
+SSE2 stack_el_t sse2_sum_i64(const stack_el_t* a, size_t n)
+{
+	__m128i acc = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 2 <= n; i += 2)
+		acc = _mm_add_epi64(acc, SSE2_LOAD(a + i));
+
+	stack_el_t sum = sse2_join_i64(acc);
+	for (; i < n; ++i)
+		sum = add_i64(sum, a[i]);
+
+	return sum;
+}
+
+SSE2 stack_el_t sse2_sum_i32(const stack_el_t* a, size_t n)
+{
+	return int32_t(sse2_sum_i64(a, n));
+}
+
+// Two registers hold partial sums 0, 1 and 2, 3
+SSE2 stack_el_t sse2_dot_f64(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + PARTS <= n; i += PARTS) {
+		acc0 = _mm_add_pd(acc0, _mm_mul_pd(SSE2_LOADF(a + i), SSE2_LOADF(b + i)));
+		acc1 = _mm_add_pd(acc1, _mm_mul_pd(SSE2_LOADF(a + i + 2),
+											SSE2_LOADF(b + i + 2)));
+	}
+
+	double parts[PARTS] = {};
+	_mm_storeu_pd(parts, acc0);
+	_mm_storeu_pd(parts + 2, acc1);
+	for (; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]) * as_f64(b[i]);
+
+	return join_parts(parts);
+}
+
+SSE2 stack_el_t sse2_sum_f64(const stack_el_t* a, size_t n)
+{
+	__m128d acc0 = _mm_setzero_pd();
+	__m128d acc1 = _mm_setzero_pd();
+	size_t i = 0;
+	for (; i + PARTS <= n; i += PARTS) {
+		acc0 = _mm_add_pd(acc0, SSE2_LOADF(a + i));
+		acc1 = _mm_add_pd(acc1, SSE2_LOADF(a + i + 2));
+	}
+
+	double parts[PARTS] = {};
+	_mm_storeu_pd(parts, acc0);
+	_mm_storeu_pd(parts + 2, acc1);
+	for (; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]);
+
+	return join_parts(parts);
+}
+
+const VectorKernels sse2_kernels = {
+	"sse2",
+	{sse2_add_i32, sse2_add_i64, sse2_add_f64},
+	{sse2_mul_i32, scalar_mul_i64, sse2_mul_f64},
+	{sse2_dot_i32, scalar_dot_i64, sse2_dot_f64},
+	{sse2_sum_i32, sse2_sum_i64, sse2_sum_f64}
+};
+
+//======================================================================
+// AVX2, 4 elements in register
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define AVX2_LOAD(p) _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p))
+#define AVX2_STORE(p, x) _mm256_storeu_si256(reinterpret_cast<__m256i*>(p), x)
+#define AVX2_LOADF(p) _mm256_loadu_pd(reinterpret_cast<const double*>(p))
+#define AVX2_STOREF(p, x) _mm256_storeu_pd(reinterpret_cast<double*>(p), x)
+
+AVX2 inline __m256i avx2_extend_i32(__m256i x)
+{
+	__m256i sign = _mm256_shuffle_epi32(_mm256_srai_epi32(x, 31),
+										_MM_SHUFFLE(2, 2, 0, 0));
+
+	return _mm256_blend_epi32(x, sign, 0xAA);
+}
+
+#define AVX2_ADD_I32(dst, a, b) \
+AVX2_STORE(dst, avx2_extend_i32(_mm256_add_epi64(AVX2_LOAD(a), AVX2_LOAD(b))))
+#define AVX2_ADD_I64(dst, a, b) \
+AVX2_STORE(dst, _mm256_add_epi64(AVX2_LOAD(a), AVX2_LOAD(b)))
+#define AVX2_ADD_F64(dst, a, b) \
+AVX2_STOREF(dst, _mm256_add_pd(AVX2_LOADF(a), AVX2_LOADF(b)))
+#define AVX2_MUL_I32(dst, a, b) \
+AVX2_STORE(dst, avx2_extend_i32(_mm256_mul_epu32(AVX2_LOAD(a), AVX2_LOAD(b))))
+#define AVX2_MUL_F64(dst, a, b) \
+AVX2_STOREF(dst, _mm256_mul_pd(AVX2_LOADF(a), AVX2_LOADF(b)))
+
+ELEMENTWISE(avx2_add_i32, AVX2, 4, AVX2_ADD_I32, add_i32)
+ELEMENTWISE(avx2_add_i64, AVX2, 4, AVX2_ADD_I64, add_i64)
+ELEMENTWISE(avx2_add_f64, AVX2, 4, AVX2_ADD_F64, add_f64)
+ELEMENTWISE(avx2_mul_i32, AVX2, 4, AVX2_MUL_I32, mul_i32)
+ELEMENTWISE(avx2_mul_f64, AVX2, 4, AVX2_MUL_F64, mul_f64)
+
+AVX2 inline stack_el_t avx2_join_i64(__m256i acc)
+{
+	__m128i half = _mm_add_epi64(	_mm256_castsi256_si128(acc),
+									_mm256_extracti128_si256(acc, 1));
+
+	return add_i64(_mm_cvtsi128_si64(half), _mm_extract_epi64(half, 1));
+}
+
+AVX2 stack_el_t avx2_dot_i32(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_epi64(acc, _mm256_mul_epu32(	AVX2_LOAD(a + i),
+														AVX2_LOAD(b + i)));
+
+	stack_el_t sum = avx2_join_i64(acc);
+	for (; i < n; ++i)
+		sum = add_i64(sum, mul_i64(a[i], b[i]));
+
+	return int32_t(sum);
+}
+
+AVX2 stack_el_t avx2_sum_i64(const stack_el_t* a, size_t n)
+{
+	__m256i acc = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 4 <= n; i += 4)
+		acc = _mm256_add_epi64(acc, AVX2_LOAD(a + i));
+
+	stack_el_t sum = avx2_join_i64(acc);
+	for (; i < n; ++i)
+		sum = add_i64(sum, a[i]);
+
+	return sum;
+}
+
+AVX2 stack_el_t avx2_sum_i32(const stack_el_t* a, size_t n)
+{
+	return int32_t(avx2_sum_i64(a, n));
+}
+
+// Lanes hold partial sums 0, 1, 2 and 3
+AVX2 stack_el_t avx2_dot_f64(const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	__m256d acc = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + PARTS <= n; i += PARTS)
+		acc = _mm256_add_pd(acc, _mm256_mul_pd(AVX2_LOADF(a + i), AVX2_LOADF(b + i)));
+
+	double parts[PARTS] = {};
+	_mm256_storeu_pd(parts, acc);
+	for (; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]) * as_f64(b[i]);
+
+	return join_parts(parts);
+}
+
+AVX2 stack_el_t avx2_sum_f64(const stack_el_t* a, size_t n)
+{
+	__m256d acc = _mm256_setzero_pd();
+	size_t i = 0;
+	for (; i + PARTS <= n; i += PARTS)
+		acc = _mm256_add_pd(acc, AVX2_LOADF(a + i));
+
+	double parts[PARTS] = {};
+	_mm256_storeu_pd(parts, acc);
+	for (; i < n; ++i)
+		parts[i % PARTS] += as_f64(a[i]);
+
+	return join_parts(parts);
+}
+
+const VectorKernels avx2_kernels = {
+	"avx2",
+	{avx2_add_i32, avx2_add_i64, avx2_add_f64},
+	{avx2_mul_i32, scalar_mul_i64, avx2_mul_f64},
+	{avx2_dot_i32, scalar_dot_i64, avx2_dot_f64},
+	{avx2_sum_i32, avx2_sum_i64, avx2_sum_f64}
+};
+
+#endif
+
+//======================================================================
+
+const VectorKernels* select_kernels()
+{
+#ifdef VECTOR_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+		return &avx2_kernels;
+
+	if (__builtin_cpu_supports("sse2"))
+		return &sse2_kernels;
+#endif
+
+	return &scalar_kernels;
+}
+
+// Thread safe initialization on the first use
+inline const VectorKernels* kernels()
+{
+	static const VectorKernels* selected = select_kernels();
+
+	return selected;
+}
+
+// Wider loads of sources would see elements written by
+// previous iterations of scalar loop
+inline int overlaps_above(const stack_el_t* dst, const stack_el_t* src, size_t n)
+{
+	return dst > src && dst < src + n;
+}
+
+void VectorAdd(	int type, stack_el_t* dst,
+				const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	assert(type >= 0 && type < get_not_type_id());
+
+	if (overlaps_above(dst, a, n) || overlaps_above(dst, b, n))
+		scalar_kernels.add[type](dst, a, b, n);
+	else
+		kernels()->add[type](dst, a, b, n);
+}
+
+void VectorMul(	int type, stack_el_t* dst,
+				const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	assert(type >= 0 && type < get_not_type_id());
+
+	if (overlaps_above(dst, a, n) || overlaps_above(dst, b, n))
+		scalar_kernels.mul[type](dst, a, b, n);
+	else
+		kernels()->mul[type](dst, a, b, n);
+}
+
+stack_el_t VectorDot(int type, const stack_el_t* a, const stack_el_t* b, size_t n)
+{
+	assert(type >= 0 && type < get_not_type_id());
+
+	return kernels()->dot[type](a, b, n);
+}
+
+stack_el_t VectorSum(int type, const stack_el_t* a, size_t n)
+{
+	assert(type >= 0 && type < get_not_type_id());
+
+	return kernels()->sum[type](a, n);
+}
+
+// Compiler vectorizes these loops itself
+void VectorFill(stack_el_t* dst, stack_el_t val, size_t n)
+{
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = val;
+}
+
+void VectorCopy(stack_el_t* dst, const stack_el_t* src, size_t n)
+{
+	memmove(dst, src, n * sizeof(stack_el_t));
+}
+
+const char* VectorIsa()
+{
+	return kernels()->name;
+}
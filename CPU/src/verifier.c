@@ -0,0 +1,459 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "verifier.h"
+
+#include "blocks.h"
+#include "command.h"
+#include "memory.h"
+#include "diag.h"
+#include "exitingalloc.h"
+
+// Depth of block that is not reached yet
+#define UNSET (INT64_MIN)
+
+// Functions calling each other deeper than this are not verified,
+// every pass goes through the whole code
+#define MAX_PASSES (64)
+
+// Ids of commands and memory regions the verifier checks
+struct VerifyIds {
+	int push, pop, add, sub, mul, div, sqrt, convert;
+	int jump, call, tailcall;
+	int vadd, vmul, vdot, vsum;
+	int loadlocal, storelocal, frameenter, frameleave;
+
+	int constant, in, out, in_f64, out_f64, reg;
+};
+
+typedef struct VerifyIds VerifyIds;
+
+// Effect of function on stack of its caller, found by passes
+struct Summary {
+	// Elements of caller used by function
+	int64_t args;
+
+	// Change of depth, valid if function can return
+	int64_t ret;
+	int returns;
+};
+
+typedef struct Summary Summary;
+
+struct Verifier {
+	const BinaryFile* file;
+	const CodeBlocks* blocks;
+	const size_t* sizes;
+	VerifyIds ids;
+
+	// Function starting at every block or -1, 0 is the start of code
+	int* function_of;
+	const CodeBlock** entries;
+	size_t nfunctions;
+	Summary* summaries;
+
+	// Depth of every block in analyzed function and blocks to visit
+	int64_t* depths;
+	size_t* stack;
+	size_t nstack;
+	size_t* visited;
+	size_t nvisited;
+
+	// Reason code is not verified and its command
+	const char* reason;
+	size_t pc;
+};
+
+typedef struct Verifier Verifier;
+
+//======================================================================
+
+VerifyIds make_verify_ids()
+{
+	VerifyIds ids = {};
+
+	ids.push = get_command_id("PUSH");
+	ids.pop = get_command_id("POP");
+	ids.add = get_command_id("ADD");
+	ids.sub = get_command_id("SUB");
+	ids.mul = get_command_id("MUL");
+	ids.div = get_command_id("DIV");
+	ids.sqrt = get_command_id("SQRT");
+	ids.convert = get_command_id("CONVERT");
+	ids.jump = get_command_id("JUMP");
+	ids.call = get_command_id("CALL");
+	ids.tailcall = get_command_id("TAILCALL");
+	ids.vadd = get_command_id("VADD");
+	ids.vmul = get_command_id("VMUL");
+	ids.vdot = get_command_id("VDOT");
+	ids.vsum = get_command_id("VSUM");
+	ids.loadlocal = get_command_id("LOADLOCAL");
+	ids.storelocal = get_command_id("STORELOCAL");
+	ids.frameenter = get_command_id("FRAMEENTER");
+	ids.frameleave = get_command_id("FRAMELEAVE");
+
+	ids.constant = get_mem_id("CONSTANT");
+	ids.in = get_mem_id("IN");
+	ids.out = get_mem_id("OUT");
+	ids.in_f64 = get_mem_id("IN_F64");
+	ids.out_f64 = get_mem_id("OUT_F64");
+	ids.reg = get_mem_id("REGISTER");
+
+	return ids;
+}
+
+inline int fail(Verifier* ver, size_t pc, const char* reason)
+{
+	if (!ver->reason) {
+		ver->reason = reason;
+		ver->pc = pc;
+	}
+
+	return 1;
+}
+
+// Checks arguments of command
+int check_command(Verifier* ver, size_t pc)
+{
+	const VerifyIds* ids = &ver->ids;
+	BinCommand cmd = ver->file->commands[pc];
+	int id = get_command_id(cmd.type);
+
+	int region = (cmd.arg1 < MEMORY_REGIONS);
+	int index = (cmd.arg2 == -1);
+
+	if (id < 0)
+		return fail(ver, pc, "unknown command");
+
+	if (id == ids->jump && get_jmp_id(cmd.arg1) < 0)
+		return fail(ver, pc, "unknown jump condition");
+
+	if ((id == ids->jump || id == ids->call || id == ids->tailcall) &&
+		(cmd.arg2 < 0 || size_t(cmd.arg2) > ver->file->ncommands))
+		return fail(ver, pc, "bad address");
+
+	if (id == ids->push && !region && cmd.arg1 != ids->constant &&
+		cmd.arg1 != ids->in && cmd.arg1 != ids->in_f64)
+		return fail(ver, pc, "bad memory id");
+
+	if (id == ids->pop && !region && cmd.arg1 != ids->out && cmd.arg1 != ids->out_f64)
+		return fail(ver, pc, "bad memory id");
+
+	if ((id == ids->push || id == ids->pop) && region && !index &&
+		(cmd.arg2 < 0 || size_t(cmd.arg2) >= ver->sizes[cmd.arg1]))
+		return fail(ver, pc, "index out of region");
+
+	if ((id == ids->add || id == ids->sub || id == ids->mul || id == ids->div ||
+		 id == ids->sqrt || id == ids->convert || id == ids->vadd ||
+		 id == ids->vmul || id == ids->vdot || id == ids->vsum) &&
+		cmd.arg1 >= get_not_type_id())
+		return fail(ver, pc, "bad type");
+
+	if (id == ids->convert && (cmd.arg2 < 0 || cmd.arg2 >= get_not_type_id()))
+		return fail(ver, pc, "bad type");
+
+	if ((id == ids->loadlocal || id == ids->storelocal ||
+		 id == ids->frameenter || id == ids->frameleave) &&
+		cmd.arg1 >= ver->sizes[ids->reg])
+		return fail(ver, pc, "index out of region");
+
+	CommandEffect effect = {};
+	if (get_command_effect(cmd, &effect))
+		return fail(ver, pc, "command can't be verified");
+
+	return 0;
+}
+
+// Numbers functions by blocks, which are targets of calls
+void find_functions(Verifier* ver)
+{
+	const CodeBlocks* blocks = ver->blocks;
+	size_t nblocks = blocks->nblocks + 1;
+
+	ver->function_of = reinterpret_cast<int*>(
+		exiting_malloc(nblocks * sizeof(int))
+	);
+	ver->entries = reinterpret_cast<const CodeBlock**>(
+		exiting_malloc((nblocks + 1) * sizeof(CodeBlock*))
+	);
+
+	for (size_t i = 0; i < nblocks; ++i)
+		ver->function_of[i] = -1;
+
+	ver->entries[ver->nfunctions++] = blocks->blocks;
+	for (size_t i = 0; i < blocks->nblocks; ++i) {
+		const CodeBlock* block = blocks->blocks + i;
+		if (block->flow != BLOCK_CALL && block->flow != BLOCK_TAILCALL)
+			continue;
+
+		size_t target = block->target - blocks->blocks;
+		if (ver->function_of[target] < 0) {
+			ver->function_of[target] = ver->nfunctions;
+			ver->entries[ver->nfunctions++] = block->target;
+		}
+	}
+}
+
+//======================================================================
+
+inline int merge(Verifier* ver, const CodeBlock* block, int64_t depth)
+{
+	size_t index = block - ver->blocks->blocks;
+
+	if (ver->depths[index] == UNSET) {
+		ver->depths[index] = depth;
+		ver->stack[ver->nstack++] = index;
+		ver->visited[ver->nvisited++] = index;
+
+		return 0;
+	}
+
+	if (ver->depths[index] != depth)
+		return fail(ver, block->start, "different stack depths");
+
+	return 0;
+}
+
+// Finds command of block that pops more than depth elements
+size_t underflow_pc(const Verifier* ver, const CodeBlock* block, int64_t depth)
+{
+	for (size_t pc = block->start; pc < block->end; ++pc) {
+		const CommandEffect* effect = ver->blocks->effects + pc;
+
+		if (effect->need > depth)
+			return pc;
+		depth += effect->net;
+	}
+
+	return block->start;
+}
+
+// Return from function with depth
+int leave(Verifier* ver, size_t function, const CodeBlock* block,
+			int64_t depth, Summary* summary)
+{
+	if (function == 0)
+		return fail(ver, block->end - 1, "RETURN without CALL");
+
+	if (summary->returns && summary->ret != depth)
+		return fail(ver, block->end - 1, "different depths on RETURN");
+
+	summary->ret = depth;
+	summary->returns = 1;
+
+	return 0;
+}
+
+/*! Finds depths of blocks reached from entry of function,
+ * depth on entry is 0, negative depths are elements of caller
+ * @param [in] function Index of function, 0 for start of code
+ * @param [out] summary Effect of function on its caller
+ * @return 0 on success
+ */
+int analyze(Verifier* ver, size_t function, Summary* summary)
+{
+	*summary = {0, 0, 0};
+
+	ver->nstack = 0;
+	ver->nvisited = 0;
+
+	int error = merge(ver, ver->entries[function], 0);
+
+	while (ver->nstack && !error) {
+		size_t index = ver->stack[--ver->nstack];
+		int64_t depth = ver->depths[index];
+
+		const CodeBlock* block = ver->blocks->blocks + index;
+		if (block->flow == BLOCK_HALT)
+			continue;
+
+		if (block->need - depth > summary->args)
+			summary->args = block->need - depth;
+		if (function == 0 && summary->args > 0) {
+			error = fail(ver, underflow_pc(ver, block, depth), "stack underflow");
+			break;
+		}
+
+		depth += block->net;
+
+		switch (block->flow) {
+			case BLOCK_NEXT:
+				error = merge(ver, block->next, depth);
+				break;
+			case BLOCK_BRANCH:
+				error = merge(ver, block->next, depth) || merge(ver, block->target, depth);
+				break;
+			case BLOCK_JUMP:
+				error = merge(ver, block->target, depth);
+				break;
+			case BLOCK_CALL:
+			case BLOCK_TAILCALL: {
+				size_t target = block->target - ver->blocks->blocks;
+				const Summary* callee = ver->summaries + ver->function_of[target];
+
+				if (callee->args - depth > summary->args)
+					summary->args = callee->args - depth;
+				if (function == 0 && summary->args > 0) {
+					error = fail(ver, block->end - 1, "stack underflow");
+					break;
+				}
+
+				// Until callee is known to return, code after call isn't reached
+				if (!callee->returns)
+					break;
+
+				if (block->flow == BLOCK_CALL)
+					error = merge(ver, block->next, depth + callee->ret);
+				else
+					error = leave(ver, function, block, depth + callee->ret, summary);
+				break;
+			}
+			case BLOCK_RETURN:
+				error = leave(ver, function, block, depth, summary);
+				break;
+		}
+	}
+
+	for (size_t i = 0; i < ver->nvisited; ++i)
+		ver->depths[ver->visited[i]] = UNSET;
+
+	return error;
+}
+
+// Finds summaries of functions, they only grow, so passes stop
+int summarize(Verifier* ver)
+{
+	for (int pass = 0; pass < MAX_PASSES; ++pass) {
+		int changed = 0;
+
+		for (size_t function = 1; function < ver->nfunctions; ++function) {
+			Summary found = {};
+			if (analyze(ver, function, &found))
+				return 1;
+
+			Summary* known = ver->summaries + function;
+			if (known->returns && found.returns && known->ret != found.ret)
+				return fail(ver, ver->entries[function]->start, "function changes its depth");
+
+			if (found.args > known->args || found.returns != known->returns) {
+				*known = found;
+				changed = 1;
+			}
+		}
+
+		if (!changed)
+			return 0;
+	}
+
+	return fail(ver, 0, "calls are too deep to analyze");
+}
+
+//======================================================================
+
+int VerifyCode(const BinaryFile* file, const CodeBlocks* blocks,
+				const size_t* sizes, int verbose)
+{
+	assert(file);
+	assert(sizes);
+
+	Verifier ver = {};
+	ver.file = file;
+	ver.blocks = blocks;
+	ver.sizes = sizes;
+	ver.ids = make_verify_ids();
+
+	int error = 0;
+	for (size_t pc = 0; pc < file->ncommands && !error; ++pc)
+		error = check_command(&ver, pc);
+
+	// Blocks are built of every code that passes checks
+	if (!error && !blocks)
+		error = fail(&ver, 0, "no blocks");
+
+	if (!error) {
+		size_t nblocks = blocks->nblocks + 1;
+
+		find_functions(&ver);
+
+		ver.summaries = reinterpret_cast<Summary*>(
+			exiting_calloc(ver.nfunctions, sizeof(Summary))
+		);
+		ver.depths = reinterpret_cast<int64_t*>(
+			exiting_malloc(nblocks * sizeof(int64_t))
+		);
+		ver.stack = reinterpret_cast<size_t*>(
+			exiting_malloc(nblocks * sizeof(size_t))
+		);
+		ver.visited = reinterpret_cast<size_t*>(
+			exiting_malloc(nblocks * sizeof(size_t))
+		);
+
+		for (size_t i = 0; i < nblocks; ++i)
+			ver.depths[i] = UNSET;
+
+		Summary start = {};
+		error = summarize(&ver) || analyze(&ver, 0, &start);
+	}
+
+	if (error && verbose)
+		diag_printf("## Not verified: %s on %zu\n", ver.reason, ver.pc);
+
+	free(ver.function_of);
+	free(ver.entries);
+	free(ver.summaries);
+	free(ver.depths);
+	free(ver.stack);
+	free(ver.visited);
+
+	return error;
+}
+
+int VerifyIndices(const BinaryFile* file, const size_t* sizes, int* dynamic)
+{
+	assert(file);
+	assert(sizes);
+
+	static const VerifyIds ids = make_verify_ids();
+
+	if (dynamic)
+		*dynamic = 0;
+
+	for (size_t pc = 0; pc < file->ncommands; ++pc) {
+		BinCommand cmd = file->commands[pc];
+		int id = get_command_id(cmd.type);
+
+		int mem_id = -1;
+		int64_t index = 0;
+
+		if ((id == ids.push || id == ids.pop) && cmd.arg1 < MEMORY_REGIONS) {
+			if (cmd.arg2 == -1) {
+				if (dynamic)
+					*dynamic = 1;
+				continue;
+			}
+
+			mem_id = cmd.arg1;
+			index = cmd.arg2;
+		}
+		else if (id == ids.loadlocal || id == ids.storelocal ||
+				id == ids.frameenter || id == ids.frameleave) {
+			if (dynamic && (id == ids.loadlocal || id == ids.storelocal))
+				*dynamic = 1;
+
+			mem_id = ids.reg;
+			index = cmd.arg1;
+		}
+		else
+			continue;
+
+		if (index < 0 || size_t(index) >= sizes[mem_id]) {
+			diag_printf("## Error: %s %" PRId64 " is out of %zu elements on %zu\n",
+					get_mem_name(mem_id), index, sizes[mem_id], pc);
+
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,170 @@
+#include <assert.h>
+
+#include "vm.h"
+
+#include "binaryfile.h"
+#include "command.h"
+#include "cpu.h"
+#include "diag.h"
+
+static_assert(VM_TYPE_I64 == TYPE_I64 && VM_TYPE_F64 == TYPE_F64,
+				"callback types must be types of commands");
+static_assert(VM_BUDGET == CPU_BUDGET && VM_SNAPSHOT == CPU_SNAPSHOT,
+				"results must be results of CPUExecute");
+
+struct VMProgram {
+	BinaryFile* file;
+};
+
+struct VMCpu {
+	CPU* cpu;
+};
+
+//======================================================================
+
+static int no_input(void*, int, int64_t*)
+{
+	return 1;
+}
+
+static int drop_output(void*, int, int64_t)
+{
+	return 0;
+}
+
+inline VMProgram* make_program(BinaryFile* file)
+{
+	if (!file)
+		return 0;
+
+	// Host handles failed allocation, library must not exit
+	VMProgram* retval = reinterpret_cast<VMProgram*>(
+		malloc(sizeof(VMProgram))
+	);
+	if (!retval) {
+		BinaryFileUnmap(file);
+		return 0;
+	}
+
+	retval->file = file;
+
+	return retval;
+}
+
+//======================================================================
+
+int VMApiVersion(void)
+{
+	return VM_API_VERSION;
+}
+
+void VMSetDiagnostics(VMDiagFunc func, void* ctx)
+{
+	set_diag_handler(func, ctx);
+}
+
+VMProgram* VMProgramFromBin(const void* data, size_t size)
+{
+	assert(data);
+
+	return make_program(BinaryFileFromBuffer(data, size));
+}
+
+VMProgram* VMProgramFromText(const char* text, size_t size, int optimize)
+{
+	assert(text);
+
+	return make_program(BinaryFileFromVMBuffer(text, size, optimize));
+}
+
+void VMProgramDeInit(VMProgram* program)
+{
+	if (!program)
+		return;
+
+	BinaryFileUnmap(program->file);
+	free(program);
+}
+
+VMCpu* VMCpuInit(const VMProgram* program, int flags, size_t max_depth)
+{
+	assert(program);
+
+	CPUConfig config;
+	CPUConfigInit(&config);
+	config.checked = (flags & VM_CHECKED) != 0;
+	config.jit = (flags & VM_JIT) != 0;
+	config.verify = !(flags & VM_NO_VERIFY);
+	config.check_memory = !(flags & VM_NO_CHECK_MEMORY);
+	if (max_depth)
+		config.max_depth = max_depth;
+
+	CPU* cpu = CPUInit(program->file, &config);
+	if (!cpu)
+		return 0;
+
+	VMCpu* retval = reinterpret_cast<VMCpu*>(
+		malloc(sizeof(VMCpu))
+	);
+	if (!retval) {
+		CPUDeInit(cpu);
+		return 0;
+	}
+
+	retval->cpu = cpu;
+
+	VMCpuSetIO(retval, 0, 0, 0);
+
+	return retval;
+}
+
+void VMCpuSetIO(VMCpu* cpu, VMReadFunc read, VMWriteFunc write, void* ctx)
+{
+	assert(cpu);
+
+	VMIOSetCallbacks(&cpu->cpu->io, read ? read : no_input,
+					write ? write : drop_output, ctx);
+}
+
+int VMCpuRun(VMCpu* cpu, uint64_t budget)
+{
+	assert(cpu);
+
+	cpu->cpu->budget = budget;
+	int error = CPUExecute(cpu->cpu);
+
+	if (error == CPU_BUDGET || error == CPU_SNAPSHOT)
+		return error;
+
+	return error ? VM_ERROR : VM_HALT;
+}
+
+size_t VMCpuStackSize(const VMCpu* cpu)
+{
+	assert(cpu);
+
+	return VMStackSize(&cpu->cpu->stack);
+}
+
+int VMCpuStackGet(const VMCpu* cpu, size_t depth, int64_t* val)
+{
+	assert(cpu);
+	assert(val);
+
+	size_t size = VMStackSize(&cpu->cpu->stack);
+	if (depth >= size)
+		return 1;
+
+	*val = VMStackData(&cpu->cpu->stack)[size - 1 - depth];
+
+	return 0;
+}
+
+void VMCpuDeInit(VMCpu* cpu)
+{
+	if (!cpu)
+		return;
+
+	CPUDeInit(cpu->cpu);
+	free(cpu);
+}
@@ -0,0 +1,337 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <charconv>
+
+#ifdef __unix__
+#include <unistd.h>
+#endif
+
+#include "vmio.h"
+
+#include "command.h"
+
+#include "exitingalloc.h"
+
+//======================================================================
+
+#ifdef __unix__
+
+inline long raw_read(int fd, char* buffer, size_t size)
+{
+	return read(fd, buffer, size);
+}
+
+inline long raw_write(int fd, const char* buffer, size_t size)
+{
+	return write(fd, buffer, size);
+}
+
+#else
+
+// No descriptors, only standard streams
+inline long raw_read(int fd, char* buffer, size_t size)
+{
+	return fread(buffer, 1, size, stdin);
+}
+
+inline long raw_write(int fd, const char* buffer, size_t size)
+{
+	return fwrite(buffer, 1, size, stdout);
+}
+
+#endif
+
+//======================================================================
+
+void VMIOInit(VMIO* io, int in_fd, int in_format, int out_fd, int out_format)
+{
+	assert(io);
+
+	io->in_fd = in_fd;
+	io->in_format = in_format;
+	io->in_buffer = reinterpret_cast<char*>(
+		exiting_malloc(VMIO_BUFFER_SIZE)
+	);
+	io->in_pos = 0;
+	io->in_size = 0;
+	io->in_eof = 0;
+
+	io->out_fd = out_fd;
+	io->out_format = out_format;
+	io->out_buffer = reinterpret_cast<char*>(
+		exiting_malloc(VMIO_BUFFER_SIZE)
+	);
+	io->out_size = 0;
+
+	io->read_func = 0;
+	io->write_func = 0;
+	io->func_ctx = 0;
+}
+
+void VMIOSetCallbacks(VMIO* io, VMIOReadFunc read_func, 
+						VMIOWriteFunc write_func, void* ctx)
+{
+	assert(io);
+
+	VMIOFlush(io);
+
+	io->func_ctx = ctx;
+	if (read_func) {
+		io->in_format = VMIO_CALLBACK;
+		io->read_func = read_func;
+	}
+	if (write_func) {
+		io->out_format = VMIO_CALLBACK;
+		io->write_func = write_func;
+		io->out_size = VMIO_BUFFER_SIZE;
+	}
+}
+
+int VMIOFlush(VMIO* io)
+{
+	assert(io);
+
+	if (io->out_format == VMIO_CALLBACK)
+		return 0;
+
+	// Messages of host program go before vm output
+	fflush(stdout);
+
+	size_t written = 0;
+	while (written < io->out_size) {
+		long res = raw_write(io->out_fd, io->out_buffer + written,
+							io->out_size - written);
+		if (res <= 0) {
+			io->out_size = 0;
+
+			return 1;
+		}
+
+		written += res;
+	}
+
+	io->out_size = 0;
+
+	return 0;
+}
+
+int VMIOFlushWrite(VMIO* io, stack_el_t val)
+{
+	assert(io);
+
+	if (io->out_format == VMIO_CALLBACK)
+		return io->write_func(io->func_ctx, TYPE_I64, val) != 0;
+
+	if (VMIOFlush(io))
+		return 1;
+
+	return VMIOWrite(io, val);
+}
+
+//======================================================================
+
+// Next input byte or -1 at end of input
+inline int peek_byte(VMIO* io)
+{
+	if (io->in_pos < io->in_size)
+		return (unsigned char)io->in_buffer[io->in_pos];
+
+	if (io->in_eof)
+		return -1;
+
+	// Interactive programs must see their output before input
+	if (VMIOFlush(io))
+		return -1;
+
+	long res = raw_read(io->in_fd, io->in_buffer, VMIO_BUFFER_SIZE);
+	if (res <= 0) {
+		io->in_eof = 1;
+
+		return -1;
+	}
+
+	io->in_pos = 0;
+	io->in_size = res;
+
+	return (unsigned char)io->in_buffer[0];
+}
+
+inline int is_space(int c)
+{
+	return c == ' ' || c == '\n' || c == '\t' ||
+			c == '\r' || c == '\v' || c == '\f';
+}
+
+inline int is_digit(int c)
+{
+	return c >= '0' && c <= '9';
+}
+
+// Same format as scanf("%d"), leaves terminating byte unread
+int read_text(VMIO* io, stack_el_t* val)
+{
+	int c = peek_byte(io);
+	while (is_space(c)) {
+		io->in_pos++;
+		c = peek_byte(io);
+	}
+
+	int negative = (c == '-');
+	if (c == '-' || c == '+') {
+		io->in_pos++;
+		c = peek_byte(io);
+	}
+
+	if (!is_digit(c))
+		return 1;
+
+	// Unsigned, so overflow wraps like machine arithmetic
+	unsigned long long res = 0;
+	do {
+		res = res * 10 + (c - '0');
+		io->in_pos++;
+
+		// Parse the rest of buffered digits without refill checks
+		const char* buffer = io->in_buffer;
+		size_t pos = io->in_pos;
+		while (pos < io->in_size && is_digit(buffer[pos]))
+			res = res * 10 + (buffer[pos++] - '0');
+		io->in_pos = pos;
+
+		c = peek_byte(io);
+	} while (is_digit(c));
+
+	*val = stack_el_t(negative ? -res : res);
+
+	return 0;
+}
+
+int read_binary(VMIO* io, stack_el_t* val)
+{
+	unsigned long long raw = 0;
+
+	for (size_t i = 0; i < sizeof(stack_el_t); ++i) {
+		int c = peek_byte(io);
+		if (c < 0)
+			return 1;
+
+		raw |= (unsigned long long)c << (8 * i);
+		io->in_pos++;
+	}
+
+	*val = stack_el_t(raw);
+
+	return 0;
+}
+
+int VMIORead(VMIO* io, stack_el_t* val)
+{
+	assert(io);
+	assert(val);
+
+	if (io->in_format == VMIO_BINARY)
+		return read_binary(io, val);
+	if (io->in_format == VMIO_CALLBACK)
+		return io->read_func(io->func_ctx, TYPE_I64, val) != 0;
+
+	return read_text(io, val);
+}
+
+// Collects token of number and parses it with from_chars, which
+// unlike strtod doesn't depend on locale
+int read_text_f64(VMIO* io, stack_el_t* val)
+{
+	int c = peek_byte(io);
+	while (is_space(c)) {
+		io->in_pos++;
+		c = peek_byte(io);
+	}
+
+	char token[VMIO_MAX_TEXT * 2] = "";
+	size_t len = 0;
+	while (c >= 0 && !is_space(c)) {
+		if (len + 1 == sizeof(token))
+			return 1;
+
+		token[len++] = c;
+		io->in_pos++;
+		c = peek_byte(io);
+	}
+
+	if (len == 0)
+		return 1;
+
+	// from_chars doesn't take plus sign
+	const char* begin = token + (token[0] == '+');
+	double res = 0;
+	std::from_chars_result parsed = std::from_chars(begin, token + len, res);
+	if (parsed.ec != std::errc() || parsed.ptr != token + len)
+		return 1;
+
+	memcpy(val, &res, sizeof(res));
+
+	return 0;
+}
+
+int VMIOReadF64(VMIO* io, stack_el_t* val)
+{
+	assert(io);
+	assert(val);
+
+	if (io->in_format == VMIO_BINARY)
+		return read_binary(io, val);
+	if (io->in_format == VMIO_CALLBACK)
+		return io->read_func(io->func_ctx, TYPE_F64, val) != 0;
+
+	return read_text_f64(io, val);
+}
+
+//======================================================================
+
+int VMIOWriteF64(VMIO* io, stack_el_t val)
+{
+	assert(io);
+
+	if (io->out_format == VMIO_BINARY)
+		return VMIOWrite(io, val);
+	if (io->out_format == VMIO_CALLBACK)
+		return io->write_func(io->func_ctx, TYPE_F64, val) != 0;
+
+	if (VMIO_BUFFER_SIZE - io->out_size < VMIO_MAX_TEXT && VMIOFlush(io))
+		return 1;
+
+	double x = 0;
+	memcpy(&x, &val, sizeof(x));
+
+	// Most values are short with 15 digits, the rest need 17.
+	// Same as %.15g and %.17g, but without locale
+	char* buffer = io->out_buffer + io->out_size;
+	char* end = std::to_chars(buffer, buffer + VMIO_MAX_TEXT, x,
+							std::chars_format::general, 15).ptr;
+
+	double back = 0;
+	std::from_chars(buffer, end, back);
+	if (back != x)
+		end = std::to_chars(buffer, buffer + VMIO_MAX_TEXT, x,
+							std::chars_format::general, 17).ptr;
+
+	*end++ = '\n';
+	io->out_size = end - io->out_buffer;
+
+	return 0;
+}
+
+//======================================================================
+
+void VMIODeInit(VMIO* io)
+{
+	assert(io);
+
+	VMIOFlush(io);
+
+	free(io->in_buffer);
+	free(io->out_buffer);
+}
@@ -0,0 +1,171 @@
+#include <assert.h>
+
+#include "vmstack.h"
+
+#include "exitingalloc.h"
+
+PS_ERROR VMStackInit(VMStack* stack, size_t capacity, size_t max, int checked)
+{
+	assert(stack);
+	assert(capacity > 0);
+	
+	stack->base = stack->top = stack->end = 0;
+	stack->checked = 0;
+	stack->overflow = 0;
+	
+	if (capacity > max)
+		capacity = max;
+	stack->max = max;
+	
+	if (checked) {
+		stack->checked = reinterpret_cast<PStack_t*>(
+			exiting_malloc(sizeof(PStack_t))
+		);
+		
+		PS_ERROR error = PStackInitMACRO(stack->checked, capacity);
+		if (error != NO_ERROR) {
+			free(stack->checked);
+			stack->checked = 0;
+		}
+		
+		return error;
+	}
+	
+	stack->base = reinterpret_cast<stack_el_t*>(
+		exiting_malloc(capacity * sizeof(stack_el_t))
+	);
+	stack->top = stack->base;
+	stack->end = stack->base + capacity;
+	
+	return NO_ERROR;
+}
+
+PS_ERROR VMStackReserve(VMStack* stack, size_t capacity)
+{
+	assert(stack);
+	
+	if (capacity > stack->max) {
+		stack->overflow = capacity;
+		return TOO_BIG_SIZE;
+	}
+	
+	if (stack->checked) {
+		if (capacity <= stack->checked->capacity)
+			return NO_ERROR;
+		
+		int done = 0;
+		PS_ERROR error = PStackReserve(stack->checked, capacity, &done);
+		if (error != NO_ERROR)
+			return error;
+		
+		return done ? NO_ERROR : TOO_BIG_SIZE;
+	}
+	
+	if (capacity <= size_t(stack->end - stack->base))
+		return NO_ERROR;
+	
+	size_t size = stack->top - stack->base;
+	
+	stack_el_t* array = reinterpret_cast<stack_el_t*>(
+		realloc(stack->base, capacity * sizeof(stack_el_t))
+	);
+	
+	if (!array)
+		return TOO_BIG_SIZE;
+	
+	stack->base = array;
+	stack->top = array + size;
+	stack->end = array + capacity;
+	
+	return NO_ERROR;
+}
+
+PS_ERROR VMStackGrow(VMStack* stack)
+{
+	assert(stack);
+	
+	size_t capacity = stack->checked ? 
+		stack->checked->capacity : stack->end - stack->base;
+	if (capacity >= stack->max) {
+		stack->overflow = VMStackSize(stack) + 1;
+		return TOO_BIG_SIZE;
+	}
+	
+	// Amortized O(1) push
+	capacity *= 2;
+	if (capacity > stack->max)
+		capacity = stack->max;
+	
+	return VMStackReserve(stack, capacity);
+}
+
+PS_ERROR VMStackEnsure(VMStack* stack, size_t n)
+{
+	assert(stack);
+	assert(!stack->checked);
+	
+	size_t size = stack->top - stack->base;
+	if (n > stack->max || size > stack->max - n) {
+		stack->overflow = size + n;
+		return TOO_BIG_SIZE;
+	}
+	
+	// Doubling as in VMStackGrow, so blocks also push in amortized O(1)
+	size_t capacity = stack->end - stack->base;
+	if (capacity == 0)
+		capacity = 1;
+	while (capacity < size + n)
+		capacity *= 2;
+	if (capacity > stack->max)
+		capacity = stack->max;
+	
+	return VMStackReserve(stack, capacity);
+}
+
+PS_ERROR VMStackGrowPush(VMStack* stack, stack_el_t elem)
+{
+	assert(stack);
+	assert(!stack->checked);
+	
+	PS_ERROR error = VMStackGrow(stack);
+	if (error != NO_ERROR)
+		return error;
+	
+	*stack->top++ = elem;
+	
+	return NO_ERROR;
+}
+
+size_t VMStackSize(const VMStack* stack)
+{
+	assert(stack);
+	
+	if (stack->checked)
+		return stack->checked->size;
+	
+	return stack->top - stack->base;
+}
+
+const stack_el_t* VMStackData(const VMStack* stack)
+{
+	assert(stack);
+	
+	if (stack->checked)
+		return stack->checked->array;
+	
+	return stack->base;
+}
+
+void VMStackDeInit(VMStack* stack)
+{
+	assert(stack);
+	
+	if (stack->checked) {
+		PStackDeInit(stack->checked);
+		free(stack->checked);
+		stack->checked = 0;
+	}
+	
+	free(stack->base);
+	stack->base = stack->top = stack->end = 0;
+}